@@ -0,0 +1,313 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+// Microbenchmarks of each layer type and of the optimizers, over a sweep of
+// batch sizes, shapes and thread counts. Each benchmark is repeated, doubling
+// the number of iterations, until it runs for at least `minTime` seconds.
+// Results are printed as a table and written as one JSON object per line to
+// the file given as first argument, to compare versions or BLAS libraries.
+
+#include "network/Network.h"
+#include "network/Optimizer.h"
+#include "network/Inference.h"
+#include <functional>
+
+#ifdef USE_MKL
+static constexpr const char* blasName = "mkl";
+#else
+static constexpr const char* blasName = "openblas";
+#endif
+static constexpr const char* precName = sizeof(Real)==4 ? "single" : "double";
+
+static double minTime = 0.1;
+static FILE* pFile = nullptr;
+
+// Average time of one call of f, after one warm-up call:
+static double timeIt(const std::function<void()>& f)
+{
+  f();
+  for (size_t iters = 1; ; iters *= 2)
+  {
+    const double t0 = omp_get_wtime();
+    for (size_t i = 0; i < iters; i++) f();
+    const double elapsed = omp_get_wtime() - t0;
+    if (elapsed >= minTime || iters >= (1<<20)) return elapsed / iters;
+  }
+}
+
+static void report(const std::string& bench, const std::string& shape,
+  const int batchSize, const int nThreads, const char* const dir,
+  const double time, const double flops, const double bytes)
+{
+  const double gflops = 1e-9 * flops / time, gbps = 1e-9 * bytes / time;
+  printf("%-14s %-22s %5d %3d  %s %10.4f %8.2f %7.2f\n", bench.c_str(),
+    shape.c_str(), batchSize, nThreads, dir, 1e3 * time, gflops, gbps);
+  fprintf(pFile, "{\"blas\": \"%s\", \"prec\": \"%s\", \"bench\": \"%s\", "
+    "\"shape\": \"%s\", \"batch\": %d, \"threads\": %d, \"dir\": \"%s\", "
+    "\"time\": %e, \"gflops\": %e, \"gbps\": %e}\n", blasName, precName,
+    bench.c_str(), shape.c_str(), batchSize, nThreads, dir, time, gflops, gbps);
+  fflush(pFile);
+}
+
+static std::vector<int> threadCounts()
+{
+  const int maxThreads = omp_get_max_threads();
+  std::vector<int> ret;
+  for (int n = 1; n < maxThreads; n *= 2) ret.push_back(n);
+  ret.push_back(maxThreads);
+  return ret;
+}
+
+// Times forward and bckward of the layers added by `build` after the input:
+static void benchLayer(const std::string bench, const std::string shape,
+  const std::function<void(Network<Real>&)>& build)
+{
+  Network<Real> net;
+  build(net);
+  std::normal_distribution<Real> dis(0, 1);
+
+  for (const int batchSize : {1, 32, 256})
+  {
+    Real* const INP = net.getInputBuffer(batchSize);
+    Real* const ERR = net.getOutputErrorBuffer();
+    std::generate(INP, INP + batchSize * net.nInputs, [&]() {return dis(net.gen);});
+    std::generate(ERR, ERR + batchSize * net.nOutputs,[&]() {return dis(net.gen);});
+
+    double flops[2] = {0, 0}, bytes[2] = {0, 0};
+    for (size_t j = 1; j < net.layers.size(); j++)
+      for (const bool bck : {false, true}) {
+        flops[bck] += net.layers[j]->flops(batchSize, bck);
+        bytes[bck] += net.layers[j]->bytes(batchSize, bck);
+      }
+
+    for (const int nThreads : threadCounts())
+    {
+      omp_set_num_threads(nThreads);
+      setBlasThreads(nThreads);
+      const double tF = timeIt([&]() { net.forward(batchSize); });
+      report(bench, shape, batchSize, nThreads, "fwd", tF, flops[0], bytes[0]);
+      const double tB = timeIt([&]() { net.bckward(); });
+      report(bench, shape, batchSize, nThreads, "bck", tB, flops[1], bytes[1]);
+    }
+  }
+}
+
+// Times the update of the optimizer on the params of a Linear layer:
+template<typename Algorithm, int nInputs, int nOutputs>
+static void benchOptimizer(const std::string bench)
+{
+  Network<Real> net;
+  net.addInput<nInputs>();
+  net.addLinear<nInputs, nOutputs>();
+  Optimizer<Algorithm> opt(net);
+  std::normal_distribution<Real> dis(0, 1);
+  std::generate(net.flatGrads, net.flatGrads + net.flatSize,
+                [&]() { return dis(net.gen); });
+
+  const double flops = (double) net.flatSize * Algorithm::flopsPerParam;
+  const double bytes = (double) net.flatSize * Algorithm::accessesPerParam
+                       * sizeof(Real);
+  for (const int nThreads : threadCounts())
+  {
+    omp_set_num_threads(nThreads);
+    const double t = timeIt([&]() { opt.update(1); });
+    report(bench, std::to_string(net.flatSize) + " params", 1, nThreads, "upd",
+           t, flops, bytes);
+  }
+}
+
+// Times the bias gradient of nRows rows of nOut channels at batch size 512,
+// with the loops that the layers used before FusedEpilogue::bckwardBias:
+// channel index modulo nOut with an OpenMP array reduction (convolutions) and
+// the loop over the batch strided by nOut (Linear):
+static void benchBiasGrad(const std::string shape, const int rowsPerSample,
+  const int nOut)
+{
+  static constexpr int batchSize = 512;
+  const int nRows = batchSize * rowsPerSample;
+  std::vector<Real> D(nRows * nOut), B(nOut);
+  Real* const __restrict__ gradB = B.data();
+  const Real* const __restrict__ dEdO = D.data();
+  std::normal_distribution<Real> dis(0, 1);
+  std::mt19937 gen(0);
+  std::generate(D.begin(), D.end(), [&]() { return dis(gen); });
+  const double flops = (double) nRows * nOut, bytes = flops * sizeof(Real);
+
+  for (const int nThreads : threadCounts())
+  {
+    omp_set_num_threads(nThreads);
+    const double tMod = timeIt([&]() {
+      std::fill(gradB, gradB + nOut, 0);
+      #pragma omp parallel for schedule(static) reduction(+ : gradB[:nOut])
+      for (int i = 0; i < nRows * nOut; i++) gradB[i % nOut] += dEdO[i];
+    });
+    report("BiasGrad mod", shape, batchSize, nThreads, "bck", tMod, flops, bytes);
+    const double tStr = timeIt([&]() {
+      std::fill(gradB, gradB + nOut, 0);
+      #pragma omp parallel for schedule(static, 64/sizeof(Real))
+      for (int n = 0; n < nOut; n++)
+        for (int r = 0; r < nRows; r++) gradB[n] += dEdO[n + r*nOut];
+    });
+    report("BiasGrad str", shape, batchSize, nThreads, "bck", tStr, flops, bytes);
+    const double tSum = timeIt([&]() {
+      FusedEpilogue<Real>::bckwardBias(Epilogue::None, nRows, nOut, D.data(),
+                                       D.data(), gradB);
+    });
+    report("BiasGrad sum", shape, batchSize, nThreads, "bck", tSum, flops, bytes);
+  }
+}
+
+// Latency of single-sample forward calls made between training steps at
+// batch size 32: through Network::forward, on views of the workspace of the
+// training batch, and through an InferenceContext. Prints the median, 99th
+// percentile and maximum over nCalls calls.
+static void benchLatency(const std::string bench, const std::string shape,
+  const std::function<void(Network<Real>&)>& build)
+{
+  static constexpr int nCalls = 1000, trainBatch = 32;
+  Network<Real> net;
+  build(net);
+  std::normal_distribution<Real> dis(0, 1);
+  std::vector<Real> sample(net.nInputs), output(net.nOutputs);
+  std::generate(sample.begin(), sample.end(), [&]() { return dis(net.gen); });
+  const InferenceContext<Real> ctx(net);
+  net.verbose = false;
+
+  for (const bool bContext : {false, true})
+  {
+    std::vector<double> times(nCalls);
+    for (int i = 0; i < nCalls; i++)
+    {
+      Real* const INP = net.getInputBuffer(trainBatch);
+      std::fill(INP, INP + trainBatch * net.nInputs, (Real) 0);
+      net.forward(trainBatch);
+      const double t0 = omp_get_wtime();
+      if (bContext) ctx.forward(sample.data());
+      else net.forward(output.data(), sample.data(), 1);
+      times[i] = omp_get_wtime() - t0;
+    }
+    std::sort(times.begin(), times.end());
+    const double p50 = times[nCalls/2], p99 = times[nCalls*99/100];
+    printf("%-14s %-22s %-9s %10.4f %10.4f %10.4f\n", bench.c_str(),
+      shape.c_str(), bContext ? "context" : "network", 1e3 * p50, 1e3 * p99,
+      1e3 * times.back());
+    fprintf(pFile, "{\"blas\": \"%s\", \"prec\": \"%s\", \"bench\": "
+      "\"%s latency\", \"shape\": \"%s\", \"path\": \"%s\", \"p50\": %e, "
+      "\"p99\": %e, \"max\": %e}\n", blasName, precName, bench.c_str(),
+      shape.c_str(), bContext ? "context" : "network", p50, p99, times.back());
+    fflush(pFile);
+  }
+}
+
+int main (int argc, char** argv)
+{
+  const std::string fname = argc > 1 ? argv[1] : "bench_layers.json";
+  if (argc > 2) minTime = std::stod(argv[2]);
+  pFile = fopen(fname.c_str(), "w");
+  if(pFile == nullptr) {
+    printf("Unable to write results %s. Aborting.\n", fname.c_str()); abort();
+  }
+  printf("Layer benchmarks (%s, %s precision), results written to %s\n",
+    blasName, precName, fname.c_str());
+
+  const auto header = [] () {
+    printf("%-14s %-22s %5s %3s  %s %10s %8s %7s\n", "bench", "shape",
+      "batch", "thr", "dir", "time[ms]", "GFLOP/s", "GB/s");
+  };
+
+  header();
+  benchLayer("Linear", "128x128", [](Network<Real>& net) {
+    net.addInput<128>();  net.addLinear<128, 128>(); });
+  benchLayer("Linear", "784x256", [](Network<Real>& net) {
+    net.addInput<784>();  net.addLinear<784, 256>(); });
+  benchLayer("Linear", "1024x1024", [](Network<Real>& net) {
+    net.addInput<1024>(); net.addLinear<1024, 1024>(); });
+
+  // Im2MatLayer followed by Conv2DLayer, then the layer selected by addConv2D:
+  header();
+  benchLayer("Im2MatConv2D", "28x28x1 5x5x16", [](Network<Real>& net) {
+    net.addInput<28*28*1>();  net.addIm2MatConv2D<28,28, 1, 5,5,16>(); });
+  benchLayer("Im2MatConv2D", "14x14x16 3x3x32", [](Network<Real>& net) {
+    net.addInput<14*14*16>(); net.addIm2MatConv2D<14,14,16, 3,3,32>(); });
+  benchLayer("Im2MatConv2D", "11x11x4 6x6x8 s1p0", [](Network<Real>& net) {
+    net.addInput<11*11*4>();  net.addIm2MatConv2D<11,11,4, 6,6,8, 1,1,0,0>(); });
+  benchLayer("Conv2D", "28x28x1 5x5x16", [](Network<Real>& net) {
+    net.addInput<28*28*1>();  net.addConv2D<28,28, 1, 5,5,16>(); });
+  benchLayer("Conv2D", "14x14x16 3x3x32", [](Network<Real>& net) {
+    net.addInput<14*14*16>(); net.addConv2D<14,14,16, 3,3,32>(); });
+  benchLayer("Conv2D", "11x11x4 6x6x8 s1p0", [](Network<Real>& net) {
+    net.addInput<11*11*4>();  net.addConv2D<11,11,4, 6,6,8, 1,1,0,0>(); });
+
+  // Same convolutions with shapes given at runtime, to measure the gain of the
+  // templated layers (3x3 runtime convolutions do not use Winograd):
+  header();
+  benchLayer("Im2MatConv2D rt", "28x28x1 5x5x16", [](Network<Real>& net) {
+    net.addInput(28*28*1);  net.addIm2MatConv2D(28,28, 1, 5,5,16); });
+  benchLayer("Im2MatConv2D rt", "14x14x16 3x3x32", [](Network<Real>& net) {
+    net.addInput(14*14*16); net.addIm2MatConv2D(14,14,16, 3,3,32); });
+  benchLayer("Im2MatConv2D rt", "11x11x4 6x6x8 s1p0", [](Network<Real>& net) {
+    net.addInput(11*11*4);  net.addIm2MatConv2D(11,11,4, 6,6,8, 1,1,0,0); });
+  benchLayer("Conv2D rt", "28x28x1 5x5x16", [](Network<Real>& net) {
+    net.addInput(28*28*1);  net.addConv2D(28,28, 1, 5,5,16); });
+  benchLayer("Conv2D rt", "14x14x16 3x3x32", [](Network<Real>& net) {
+    net.addInput(14*14*16); net.addConv2D(14,14,16, 3,3,32); });
+  benchLayer("Conv2D rt", "11x11x4 6x6x8 s1p0", [](Network<Real>& net) {
+    net.addInput(11*11*4);  net.addConv2D(11,11,4, 6,6,8, 1,1,0,0); });
+
+  // Deconv2DLayer followed by the transposed Im2MatLayer:
+  header();
+  benchLayer("DeConv2D", "3x3x16 4x4x8 s1p0", [](Network<Real>& net) {
+    net.addInput<3*3*16>();   net.addDeConv2D< 3, 3,16, 4,4,8, 1,1,0,0>(); });
+  benchLayer("DeConv2D", "11x11x4 8x8x1 s2p0", [](Network<Real>& net) {
+    net.addInput<11*11*4>();  net.addDeConv2D<11,11, 4, 8,8,1, 2,2,0,0>(); });
+  benchLayer("DeConv2D rt", "3x3x16 4x4x8 s1p0", [](Network<Real>& net) {
+    net.addInput(3*3*16);     net.addDeConv2D( 3, 3,16, 4,4,8, 1,1,0,0); });
+  benchLayer("DeConv2D rt", "11x11x4 8x8x1 s2p0", [](Network<Real>& net) {
+    net.addInput(11*11*4);    net.addDeConv2D(11,11, 4, 8,8,1, 2,2,0,0); });
+
+  header();
+  benchLayer("LReLu", "4096", [](Network<Real>& net) {
+    net.addInput<4096>(); net.addLReLu<4096>(); });
+  benchLayer("Tanh", "4096", [](Network<Real>& net) {
+    net.addInput<4096>(); net.addTanh<4096>(); });
+  benchLayer("SoftMax", "10", [](Network<Real>& net) {
+    net.addInput<10>();   net.addSoftMax<10>(); });
+  benchLayer("SoftMax", "1000", [](Network<Real>& net) {
+    net.addInput<1000>(); net.addSoftMax<1000>(); });
+
+  header();
+  benchBiasGrad("Linear 1024", 1, 1024);
+  benchBiasGrad("Conv 11x11x4", 11*11, 4);
+  benchBiasGrad("Conv 6x6x8", 6*6, 8);
+  benchBiasGrad("DeConv 28x28x1", 28*28, 1);
+
+  header();
+  benchOptimizer<MomentumSGD<Real>,  128,  128>("MomentumSGD");
+  benchOptimizer<MomentumSGD<Real>, 1024, 1024>("MomentumSGD");
+  benchOptimizer<Adam<Real>,  128,  128>("Adam");
+  benchOptimizer<Adam<Real>, 1024, 1024>("Adam");
+  benchOptimizer<AdamW<Real>, 1024, 1024>("AdamW");
+  benchOptimizer<LAMB<Real>,  1024, 1024>("LAMB");
+
+  printf("%-14s %-22s %-9s %10s %10s %10s\n", "latency", "shape", "path",
+    "p50[ms]", "p99[ms]", "max[ms]");
+  benchLatency("Linear", "784x256x10", [](Network<Real>& net) {
+    net.addInput<784>(); net.addLinear<784, 256>(); net.addLReLu<256>();
+    net.addLinear<256, 10>(); net.addSoftMax<10>(); });
+  benchLatency("Conv2D", "28x28x1 5x5x16", [](Network<Real>& net) {
+    net.addInput<28*28*1>(); net.addConv2D<28,28, 1, 5,5,16>();
+    net.addLReLu<28*28*16>(); });
+  benchLatency("Conv2D", "14x14x16 3x3x32", [](Network<Real>& net) {
+    net.addInput<14*14*16>(); net.addConv2D<14,14,16, 3,3,32>(); });
+  benchLatency("Conv2D rt", "28x28x1 5x5x16", [](Network<Real>& net) {
+    net.addInput(28*28*1); net.addConv2D(28,28, 1, 5,5,16); });
+
+  fclose(pFile);
+  return 0;
+}
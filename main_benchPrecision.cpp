@@ -0,0 +1,68 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+// Time training steps of the MNIST classifier in single and double precision.
+// Both networks live in the same binary: no dataset needed, input is random.
+
+#include "network/Network.h"
+#include "network/Optimizer.h"
+
+template<typename T>
+static void build_classifier(Network<T>& net)
+{
+  net.template addInput<28*28*1>();
+  net.template addConv2D< 28, 28,  1,   8,   8,   4,   2,2,    0,0>();
+  net.template addLReLu< 11 * 11 * 4 >();
+  net.template addConv2D< 11, 11,  4,   6,   6,   8,   1,1,    0,0>();
+  net.template addLReLu< 6 * 6 * 8 >();
+  net.template addConv2D<  6,  6,  8,   4,   4,  16,   1,1,    0,0>();
+  net.template addLReLu< 3 * 3 * 16 >();
+  net.template addConv2D<  3,  3, 16,   3,   3,  10,   1,1,    0,0>();
+  net.template addSoftMaxCrossEntropy<10>();
+}
+
+template<typename T>
+static double time_steps(const int batchsize, const int nsteps)
+{
+  Network<T> net;
+  build_classifier(net);
+  Optimizer<Adam<T>> opt(net, 1e-5);
+
+  T* const INP = net.getInputBuffer(batchsize);
+  std::uniform_real_distribution<T> dis(0, 1);
+  std::generate(INP, INP + batchsize*28*28, [&]() { return dis(net.gen); });
+  std::vector<int> LBL(batchsize);
+  std::uniform_int_distribution<int> disLabel(0, 9);
+  std::generate(LBL.begin(), LBL.end(), [&]() { return disLabel(net.gen); });
+
+  // one warm-up step, then measure average time of a training step:
+  double t0 = 0;
+  for (int step = 0; step <= nsteps; step++)
+  {
+    if(step == 1) t0 = omp_get_wtime();
+    net.forward(batchsize);
+    net.bckward(LBL.data(), batchsize);
+    opt.update(batchsize);
+  }
+  return (omp_get_wtime() - t0) / nsteps;
+}
+
+int main (int argc, char** argv)
+{
+  const int nsteps = argc > 1 ? std::stoi(argv[1]) : 20;
+
+  printf("batchsize  double[ms]  float[ms]  speedup\n");
+  for (const int batchsize : {32, 128, 512})
+  {
+    const double tD = time_steps<double>(batchsize, nsteps);
+    const double tF = time_steps<float >(batchsize, nsteps);
+    printf("%9d  %10.3f  %9.3f  %7.2f\n", batchsize, 1e3*tD, 1e3*tF, tD/tF);
+  }
+  return 0;
+}
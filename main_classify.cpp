@@ -11,38 +11,51 @@
 
 #include "network/Network.h"
 #include "network/Optimizer.h"
-#include "mnist/mnist_reader.hpp"
+#include "network/DataLoader.h"
 #include <chrono>
 
-static void prepare_input(const std::vector<int>& image, std::vector<Real>& input)
-{
-  static const Real fac = 1/(Real)255;
-  assert(image.size() == input.size());
-  for (size_t j = 0; j < 28*28; j++) input[j] = image[j]*fac;
-}
-
-static inline uint8_t max_index(const std::vector<Real>& O) {
-  return std::distance(O.begin(), std::max_element(O.begin(), O.end()));
+static inline uint8_t max_index(const Real* const O, const int size) {
+  return std::distance(O, std::max_element(O, O + size));
 }
 
 int main (int argc, char** argv)
 {
-  std::cout << "MNIST data directory: ./" << std::endl;
+#ifdef USE_MPI
+  // e.g. `mpirun -np 2 ./exec_classify`, with OMP_NUM_THREADS set so that
+  // the ranks do not oversubscribe the cores:
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+#endif
+  printf("MNIST data directory: ./\n");
 
-  // Load MNIST data"
-  mnist::MNIST_dataset<std::vector, std::vector<int>, uint8_t> dataset =
-  mnist::read_dataset<std::vector, std::vector, int, uint8_t>("./");
-  assert(dataset.training_labels.size() == dataset.training_images.size());
-  assert(dataset.test_labels.size() == dataset.test_images.size());
-  const int n_train_samp = dataset.training_images.size();
-  const int n_test_samp = dataset.test_images.size();
+  // Pack the MNIST idx files (done only once, by rank 0) and map the packed
+  // datasets once they are complete:
+#ifdef USE_MPI
+  int world_rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+#else
+  const int world_rank = 0;
+#endif
+  if (world_rank == 0) {
+    packIDX("train-images-idx3-ubyte", "train-labels-idx1-ubyte", "train.tdll");
+    packIDX( "t10k-images-idx3-ubyte",  "t10k-labels-idx1-ubyte",  "t10k.tdll");
+  }
+#ifdef USE_MPI
+  MPI_Barrier(MPI_COMM_WORLD);
+#endif
+  const MappedDataset<Real> train("train.tdll"), test("t10k.tdll");
+  const int n_train_samp = train.nSamples;
+  const int n_test_samp = test.nSamples;
+  // test samples are processed in order:
+  std::vector<int> test_ids(n_test_samp);
+  std::iota(test_ids.begin(), test_ids.end(), 0);
 
   // Training parameters:
   const int nepoch = 100, batchsize = 512;
   const Real learn_rate = 1e-5;
 
   // Create Network:
-  Network net;
+  Network<Real> net;
   // layer 0: input
   net.addInput<28*28*1>();
 
@@ -74,102 +87,126 @@ int main (int argc, char** argv)
   net.addLinear<96, 10>();
 #endif
 
-  net.addSoftMax<10>();
+  // softmax fused with cross-entropy loss, its gradient is computed from labels
+  net.addSoftMaxCrossEntropy<10>();
+
+#ifdef USE_MPI
+  // Each rank trains on a shard of each minibatch, grads are summed by
+  // bckward over all ranks:
+  net.distribute(MPI_COMM_WORLD);
+#endif
+  const int rank = net.allreduce.rank, nRanks = net.allreduce.nRanks;
+  assert(batchsize % nRanks == 0);
+  const int shardsize = batchsize / nRanks;
 
   //Create optimizer:
-  Optimizer<Adam> opt(net, learn_rate, 1e-6);
+  Optimizer<Adam<Real>> opt(net, learn_rate, 1e-6);
 
   const int steps_in_epoch = n_train_samp / batchsize;
   assert(steps_in_epoch > 0);
 
-  for (int iepoch = 0; iepoch < nepoch; iepoch++)
+  // Resume from the checkpoint of a previous run, if any. The checkpoint is
+  // written at the end of each epoch by the writer's thread, with the state
+  // of the loader:
+  const std::string checkpoint = "classify.ckpt";
+  std::string saved;
+  if (access(checkpoint.c_str(), F_OK) == 0) saved = opt.restart(checkpoint);
+  const int first_epoch = opt.step / steps_in_epoch;
+  CheckpointWriter<Real> writer;
+
+  // Minibatches of the training set are shuffled and gathered by the loader's
+  // thread while the network trains on the previous minibatch. All ranks use
+  // the same seed, hence the same minibatches, and each gathers its shard.
+  // A resumed run continues the minibatches of the previous one, checkpoints
+  // without the loader's state start a new sequence:
+  DataLoader<Real>::State start;
+  if (saved.size() == sizeof(start)) memcpy(&start, saved.data(), sizeof(start));
+  else start = {net.gen(), opt.step};
+  DataLoader<Real> loader(train, batchsize, start, 2, rank, nRanks);
+
+  for (int iepoch = first_epoch; iepoch < nepoch; iepoch++)
   {
-    std::vector<std::vector<Real>> INP(batchsize, std::vector<Real>(28*28));
-    std::vector<std::vector<Real>> OUT(batchsize, std::vector<Real>(10));
-
-    std::vector<int> sample_ids(n_train_samp);
-    //fill array: 0, 1, ..., n_train_samp-1
-    std::iota(sample_ids.begin(), sample_ids.end(), 0);
-
-    //shuffle dataset in order to sample random mini batches:
-    std::shuffle(sample_ids.begin(), sample_ids.end(), net.gen );
+    // Rows of the row-major matrices below are the samples of the minibatch:
+    net.getInputBuffer(shardsize);
+    const Real* const OUT = net.getOutputActivation()->output;
+    // labels of the samples of the rank's shard of the test minibatch:
+    std::vector<int> LBL(shardsize);
 
     Real epoch_mse  = 0, epoch_prec = 0;
     const double t0 = omp_get_wtime();
     for (int step = 0; step < steps_in_epoch; step++)
     {
-      // Put `batchsize` samples in the inputs vector-of-vectors. Start from
-      // the end because it's easier to remove entries from a vectors's end.
-#pragma omp parallel for schedule(static)
-      for (int i = 0; i < batchsize; i++)
+      // The network reads the next minibatch from the loader's ring, without
+      // copying it onto the workspace, and runs forward:
+      const DataLoader<Real>::Batch& batch = loader.next();
+      const int* const labels = batch.labels;
+      net.setInput(batch.inputs, shardsize);
+      net.forward(shardsize);
+
+      // Measure precision: predicted label is output with higher probability
+#pragma omp parallel for reduction(+ : epoch_prec) schedule(static)
+      for (int i = 0; i < shardsize; i++)
       {
-        const int sample = sample_ids[sample_ids.size() - 1 - i];
-        prepare_input(dataset.training_images[sample], INP[i]);
+        assert(labels[i] < 10);
+        epoch_prec += (max_index(OUT + i*10, 10) == labels[i]);
       }
 
-      net.forward(OUT, INP);
-
-      // Compute the error = 1/2 \Sum (OUT - INP) ^ 2
-#pragma omp parallel for reduction(+ : epoch_mse, epoch_prec) schedule(static)
-      for (int i = 0; i < batchsize; i++)
-      {
-        // For simplicity here we overwrite OUT with the gradient of the error
-        const int sample = sample_ids[sample_ids.size() - 1 - i];
-        const uint8_t label = dataset.training_labels[sample];
-        assert(label < 10 and OUT[i].size() == 10);
-        std::vector<Real> ret(10 , 0);
-        // predicted label is output with higher probability
-        const uint8_t predicted_label = max_index(OUT[i]);
-        // error is cross-entropy = - sum P(label) * log ( P_predicted (label) )
-        // P(label) == 1 only for the correct label, 0 otherwise
-        ret[label] = - 1 / OUT[i][label]; // - 1 * d/d_output * log(output)
-        epoch_mse -= std::log(OUT[i][label]);
-        epoch_prec += (predicted_label == label);
-        OUT[i] = ret; // overwrite output with grad of err wrt to output
-      }
-
-      net.bckward(OUT);
+      // error is cross-entropy = - sum P(label) * log ( P_predicted (label) )
+      // P(label) == 1 only for the correct label, 0 otherwise. Loss layer
+      // computes it and writes the gradient onto the network's workspace:
+      epoch_mse += net.bckward(labels, shardsize);
 
       opt.update(batchsize);
-
-      // Erase last batchsize randomly shuffled dataset samples:
-      sample_ids.erase(sample_ids.end()-batchsize, sample_ids.end());
     }
     const double elapsed = omp_get_wtime() - t0;
 
     if(iepoch % 1 == 0)
     {
       const int steps_in_test = n_test_samp / batchsize;
+      // Test minibatches are written directly onto the workspace:
+      Real* const INP = net.getInputBuffer(shardsize);
 
       Real test_mse = 0, test_prec = 0;
       for (int step = 0; step < steps_in_test; step++)
       {
+        const int* const batch_ids = test_ids.data() + step*batchsize
+                                                     + rank*shardsize;
+        test.gather(batch_ids, shardsize, INP, LBL.data());
 
-#pragma omp parallel for schedule(static)
-        for (int i = 0; i < batchsize; i++)
-        {
-          const int sample = i + batchsize * step;
-          prepare_input(dataset.test_images[sample], INP[i]);
-        }
-
-        net.forward(OUT, INP);
+        net.forward(shardsize);
 
 #pragma omp parallel for reduction(+ : test_mse, test_prec) schedule(static)
-        for (int i = 0; i < batchsize; i++) {
-          const int sample = i + batchsize * step;
-          const uint8_t label = dataset.test_labels[sample];
-          const uint8_t predicted_label = max_index(OUT[i]);
-          assert(label < 10 and OUT[i].size() == 10);
-          test_mse -= std::log(OUT[i][label]);
+        for (int i = 0; i < shardsize; i++) {
+          const int label = LBL[i];
+          const uint8_t predicted_label = max_index(OUT + i*10, 10);
+          assert(label < 10);
+          test_mse -= std::log(OUT[i*10 + label]);
           test_prec += (predicted_label == label);
         }
       }
-      printf("%f %f %f %f %f\n",
+#ifdef USE_MPI
+      Real sums[4] = {epoch_mse, epoch_prec, test_mse, test_prec};
+      MPI_Allreduce(MPI_IN_PLACE, sums, 4, net.allreduce.datatype(), MPI_SUM,
+                    MPI_COMM_WORLD);
+      epoch_mse = sums[0]; epoch_prec = sums[1];
+      test_mse  = sums[2]; test_prec  = sums[3];
+#endif
+      if (rank == 0) printf("%f %f %f %f %f\n",
         epoch_mse/steps_in_epoch/batchsize, epoch_prec/steps_in_epoch/batchsize,
         test_mse/steps_in_test/batchsize, test_prec/steps_in_test/batchsize,
         elapsed );
     }
+    // per-layer time, flops and bytes of the epoch (with make profile=1):
+    if (rank == 0) net.reportProfile(iepoch);
+    // trained parameters, e.g. for the int8 network of main_quantize.cpp:
+    if (rank == 0) {
+      const DataLoader<Real>::State state = loader.state();
+      opt.save(writer, checkpoint, std::string((const char*) &state,
+                                               sizeof(state)));
+    }
   }
-
+#ifdef USE_MPI
+  MPI_Finalize();
+#endif
   return 0;
 }
@@ -9,143 +9,158 @@
 //
 // 1) Train linear autoencoder on MNIST dataset.
 // 2) Write to file the principal components.
+// Usage: ./exec_linear [schedule [nepoch]], with the learning rate schedule
+// constant (default), cosine or step. The learning rate and the MSE of each
+// epoch are appended to convergence_<schedule>.json, to compare schedules
+// and to catch regressions of the convergence (make bench_convergence).
 
 
 #include "network/Network.h"
+#include "network/Inference.h"
 #include "network/Optimizer.h"
-#include "mnist/mnist_reader.hpp"
+#include "network/DataLoader.h"
 #include <chrono>
 
-static void prepare_input(const std::vector<int>& image, std::vector<Real>& input)
-{
-  static const Real fac = 1/(Real)255;
-  assert(image.size() == input.size());
-  for (size_t j = 0; j < input.size(); j++) input[j] = image[j]*fac;
-}
-
-static Real compute_error(const std::vector<Real>& output, std::vector<Real>& input)
+static Real compute_error(const Real* const output, const Real* const input,
+                          Real* const grad, const int size)
 {
   Real l2err = 0;
-  assert(output.size() == input.size());
-  for (size_t j = 0; j < input.size(); j++) {
+  for (int j = 0; j < size; j++) {
     l2err += std::pow(input[j] - output[j], 2);
     // gradient of l2err/2 wrt to output[j]:
-    input[j] = output[j] - input[j];
+    grad[j] = output[j] - input[j];
   }
   return l2err / 2;
 }
 
 int main (int argc, char** argv)
 {
-  std::cout << "MNIST data directory: ./" << std::endl;
-
-  // Load MNIST data"
-  mnist::MNIST_dataset<std::vector, std::vector<int>, uint8_t> dataset =
-  mnist::read_dataset<std::vector, std::vector, int, uint8_t>("./");
-  assert(dataset.training_labels.size() == dataset.training_images.size());
-  assert(dataset.test_labels.size() == dataset.test_images.size());
-  const int n_train_samp = dataset.training_images.size();
-  const int n_test_samp = dataset.test_images.size();
+  const std::string schedule = argc > 1 ? argv[1] : "constant";
+  printf("MNIST data directory: ./\n");
+
+  // Pack the MNIST idx files (done only once) and map the packed datasets:
+  packIDX("train-images-idx3-ubyte", "train-labels-idx1-ubyte", "train.tdll");
+  packIDX( "t10k-images-idx3-ubyte",  "t10k-labels-idx1-ubyte",  "t10k.tdll");
+  const MappedDataset<Real> train("train.tdll"), test("t10k.tdll");
+  const int n_train_samp = train.nSamples;
+  const int n_test_samp = test.nSamples;
+  // test samples are processed in order:
+  std::vector<int> test_ids(n_test_samp);
+  std::iota(test_ids.begin(), test_ids.end(), 0);
 
   // Training parameters:
-  const int nepoch = 30, batchsize = 512;
+  const int nepoch = argc > 2 ? std::stoi(argv[2]) : 30, batchsize = 512;
   const Real learn_rate = 1e-4;
   // Compression parameter:
   const int Z = 10;
 
   // Create Network:
-  Network net;
+  Network<Real> net;
   // layer 0: input
   net.addInput<28*28*1>();
   // layer 1: linear encoder
   net.addLinear<28*28*1, Z>();
+  net.nameLayer("code"); // compression layer, whose size is Z
   // layer 2: linear decoder
   net.addLinear<Z, 28*28*1>();
 
-  const size_t compressionID = 1; // ID of layer whose size is Z
-
   //Create optimizer:
-  Optimizer<Adam> opt(net, learn_rate);
+  Optimizer<Adam<Real>> opt(net, learn_rate);
 
   const int steps_in_epoch = n_train_samp / batchsize;
   assert(steps_in_epoch > 0);
+  // one epoch of warmup, then decay over the remaining epochs:
+  if (schedule == "cosine")
+    opt.schedule = LearningRateSchedule::cosine(steps_in_epoch,
+      (nepoch-1) * steps_in_epoch, 0.01);
+  else if (schedule == "step")
+    opt.schedule = LearningRateSchedule::stepDecay(steps_in_epoch,
+      std::max(1, nepoch/3) * steps_in_epoch, 0.3);
+  else if (schedule not_eq "constant") {
+    printf("Unknown schedule %s. Aborting.\n", schedule.c_str()); abort();
+  }
+  FILE* const pConv = fopen(("convergence_"+schedule+".json").c_str(), "a");
+
+  // Minibatches of the training set are shuffled and gathered by the loader's
+  // thread while the network trains on the previous minibatch:
+  DataLoader<Real> loader(train, batchsize, net.gen());
 
   for (int iepoch = 0; iepoch < nepoch; iepoch++)
   {
-    std::vector<std::vector<Real>> INP(batchsize, std::vector<Real>(28*28));
-    std::vector<std::vector<Real>> OUT(batchsize, std::vector<Real>(28*28));
-    std::vector<int> sample_ids(n_train_samp);
-    //fill array: 0, 1, ..., n_train_samp-1
-    std::iota(sample_ids.begin(), sample_ids.end(), 0);
-
-    //shuffle dataset in order to sample random mini batches:
-    std::shuffle(sample_ids.begin(), sample_ids.end(), net.gen );
+    // Rows of the row-major matrices below are the samples of the minibatch:
+    net.getInputBuffer(batchsize);
+    const Real* const OUT = net.getOutputActivation()->output;
+    Real* const ERR = net.getOutputErrorBuffer();
 
     Real epoch_mse = 0;
     const double t0 = omp_get_wtime();
     for (int step = 0; step < steps_in_epoch; step++)
     {
-      // Put `batchsize` samples in the inputs vector-of-vectors. Start from
-      // the end because it's easier to remove entries from a vectors's end.
-
-  #pragma omp parallel for schedule(static)
-      for (int i = 0; i < batchsize; i++)
-      {
-        const int sample = sample_ids[sample_ids.size() - 1 - i];
-        prepare_input(dataset.training_images[sample], INP[i]);
-      }
-
-      net.forward(OUT, INP);
+      // The network reads the next minibatch from the loader's ring, without
+      // copying it onto the workspace, and runs forward:
+      const DataLoader<Real>::Batch& batch = loader.next();
+      const Real* const INP = batch.inputs;
+      net.setInput(INP, batchsize);
+      net.forward(batchsize);
 
       // Compute the error = 1/2 \Sum (OUT - INP) ^ 2
 #pragma omp parallel for schedule(static) reduction(+ : epoch_mse)
       for (int i = 0; i < batchsize; i++)
       {
-        // For simplicity here we overwrite INP with the gradient of the error
-        // With respect to the Network's outputs = OUT - INP. OUT and INP have
-        // the same size and that's the size of the net's output
-        const Real error = compute_error(OUT[i], INP[i]); //now INP contains ERR
+        // Write the gradient of the error with respect to the Network's outputs
+        // = OUT - INP directly onto the workspace. OUT and INP have the same
+        // size and that's the size of the net's output
+        const int j = i*28*28;
+        const Real error = compute_error(OUT + j, INP + j, ERR + j, 28*28);
         epoch_mse += error;
       }
 
-      net.bckward(INP);
+      net.bckward();
 
       opt.update(batchsize);
-
-      // Erase last batchsize randomly shuffled dataset samples:
-      sample_ids.erase(sample_ids.end()-batchsize, sample_ids.end());
     }
     const double elapsed = omp_get_wtime() - t0;
 
+    // learning rate of the last step of the epoch:
+    const double lr = opt.eta * opt.schedule.factor(opt.step - 1);
     if(iepoch % 1 == 0)
     {
       const int steps_in_test = n_test_samp / batchsize;
+      // Test minibatches are written directly onto the workspace:
+      Real* const INP = net.getInputBuffer(batchsize);
 
       Real test_mse = 0;
       for (int step = 0; step < steps_in_test; step++)
       {
+        const int* const batch_ids = test_ids.data() + step*batchsize;
+        test.gather(batch_ids, batchsize, INP);
 
-#pragma omp parallel for schedule(static)
-        for (int i = 0; i < batchsize; i++)
-        {
-          const int sample = i + batchsize * step;
-          prepare_input(dataset.test_images[sample], INP[i]);
-        }
-
-        net.forward(OUT, INP);
+        net.forward(batchsize);
 
 #pragma omp parallel for schedule(static) reduction(+ : test_mse)
-        for (int i = 0; i < batchsize; i++)
-          test_mse += compute_error(OUT[i], INP[i]); //now input contains err
+        for (int i = 0; i < batchsize; i++) {
+          const int j = i*28*28;
+          test_mse += compute_error(OUT + j, INP + j, ERR + j, 28*28);
+        }
       }
       printf("Training set MSE:%f, Test set MSE:%f, wclock %f\n",
         epoch_mse/steps_in_epoch/batchsize, test_mse/steps_in_test/batchsize, elapsed);
+      fprintf(pConv, "{\"schedule\": \"%s\", \"epoch\": %d, \"lr\": %e, "
+        "\"train_mse\": %e, \"test_mse\": %e, \"time\": %e}\n",
+        schedule.c_str(), iepoch, lr, epoch_mse/steps_in_epoch/batchsize,
+        test_mse/steps_in_test/batchsize, elapsed);
+      fflush(pConv);
     }
+    // per-layer time, flops and bytes of the epoch (with make profile=1):
+    net.reportProfile(iepoch);
   }
 
+  fclose(pConv);
+
   //extract features:
-  // WARNING: if you change the shape of the net in any way, this will fail.
-  // If you add layers, edit the `compressionID` variable accordingly.
+  // Outputs of the decoder when the compression layer, named "code", has
+  // only one nonzero component, one sample at a time:
+  const InferenceContext<Real> decoder(net);
   for (int z = 0; z < Z; z++)
   {
     // initialize layer output of all zeros:
@@ -153,7 +168,7 @@ int main (int argc, char** argv)
     // turn on only one component in the compression layer
     z_vec[z] = 1;
 
-    const std::vector<Real> OUT = net.forward(z_vec, compressionID);
+    const std::vector<Real> OUT = decoder.forward(z_vec, net.layerID("code"));
     std::vector<float> OUT_float(OUT.size());
 
     std::copy(OUT.begin(), OUT.end(), OUT_float.begin());
@@ -12,40 +12,36 @@
 
 
 #include "network/Network.h"
+#include "network/Inference.h"
 #include "network/Optimizer.h"
-#include "mnist/mnist_reader.hpp"
+#include "network/DataLoader.h"
 #include <chrono>
 
-static void prepare_input(const std::vector<int>& image, std::vector<Real>& input)
-{
-  static const Real fac = 1/(Real)255;
-  assert(image.size() == input.size());
-  for (size_t j = 0; j < input.size(); j++) input[j] = image[j]*fac;
-}
-
-static Real compute_error(const std::vector<Real>& output, std::vector<Real>& input)
+static Real compute_error(const Real* const output, const Real* const input,
+                          Real* const grad, const int size)
 {
   Real l2err = 0;
-  assert(output.size() == input.size());
-  for (size_t j = 0; j < input.size(); j++) {
+  for (int j = 0; j < size; j++) {
     l2err += std::pow(input[j] - output[j], 2);
     // gradient of l2err/2 wrt to output[j]:
-    input[j] = output[j] - input[j];
+    grad[j] = output[j] - input[j];
   }
   return l2err / 2;
 }
 
 int main (int argc, char** argv)
 {
-  std::cout << "MNIST data directory: ./" << std::endl;
-
-  // Load MNIST data"
-  mnist::MNIST_dataset<std::vector, std::vector<int>, uint8_t> dataset =
-  mnist::read_dataset<std::vector, std::vector, int, uint8_t>("./");
-  assert(dataset.training_labels.size() == dataset.training_images.size());
-  assert(dataset.test_labels.size() == dataset.test_images.size());
-  const int n_train_samp = dataset.training_images.size();
-  const int n_test_samp = dataset.test_images.size();
+  printf("MNIST data directory: ./\n");
+
+  // Pack the MNIST idx files (done only once) and map the packed datasets:
+  packIDX("train-images-idx3-ubyte", "train-labels-idx1-ubyte", "train.tdll");
+  packIDX( "t10k-images-idx3-ubyte",  "t10k-labels-idx1-ubyte",  "t10k.tdll");
+  const MappedDataset<Real> train("train.tdll"), test("t10k.tdll");
+  const int n_train_samp = train.nSamples;
+  const int n_test_samp = test.nSamples;
+  // test samples are processed in order:
+  std::vector<int> test_ids(n_test_samp);
+  std::iota(test_ids.begin(), test_ids.end(), 0);
 
   // Training parameters:
   const int nepoch = 30, batchsize = 32;
@@ -54,108 +50,96 @@ int main (int argc, char** argv)
   const int Z = 10;
 
   // Create Network:
-  Network net;
+  Network<Real> net;
   // layer 0: input
   net.addInput<28*28*1>();
   net.addLinear<28*28*1, 100>();
   net.addTanh<100>();
   net.addLinear<100, Z>();
   net.addTanh<Z>();
+  // compression layer, whose size is Z (its Tanh may be fused into Linear):
+  net.nameLayer("code");
   net.addLinear<Z, 100>();
   net.addTanh<100>();
   net.addLinear<100, 28*28*1>();
 
-  const size_t compressionID = 4; // ID of layer whose size is Z
-
   //Create optimizer:
-  Optimizer<Adam> opt(net, learn_rate);
+  Optimizer<Adam<Real>> opt(net, learn_rate);
 
   const int steps_in_epoch = n_train_samp / batchsize;
   assert(steps_in_epoch > 0);
 
+  // Minibatches of the training set are shuffled and gathered by the loader's
+  // thread while the network trains on the previous minibatch:
+  DataLoader<Real> loader(train, batchsize, net.gen());
+
   for (int iepoch = 0; iepoch < nepoch; iepoch++)
   {
-    std::vector<std::vector<Real>> INP(batchsize, std::vector<Real>(28*28));
-    std::vector<std::vector<Real>> OUT(batchsize, std::vector<Real>(28*28));
-
-    std::vector<int> sample_ids(n_train_samp);
-    //fill array: 0, 1, ..., n_train_samp-1
-    std::iota(sample_ids.begin(), sample_ids.end(), 0);
-
-    //shuffle dataset in order to sample random mini batches:
-    std::shuffle(sample_ids.begin(), sample_ids.end(), net.gen );
+    // Rows of the row-major matrices below are the samples of the minibatch:
+    net.getInputBuffer(batchsize);
+    const Real* const OUT = net.getOutputActivation()->output;
+    Real* const ERR = net.getOutputErrorBuffer();
 
     Real epoch_mse = 0;
     const double t0 = omp_get_wtime();
     for (int step = 0; step < steps_in_epoch; step++)
     {
-      // Put `batchsize` samples in the inputs vector-of-vectors. Start from
-      // the end because it's easier to remove entries from a vectors's end.
-      //const double t1 = omp_get_wtime();
- #pragma omp parallel for schedule(static)
-      for (int i = 0; i < batchsize; i++)
-      {
-        const int sample = sample_ids[sample_ids.size() - 1 - i];
-        prepare_input(dataset.training_images[sample], INP[i]);
-      }
-
-      //const double t2 = omp_get_wtime();
-      net.forward(OUT, INP);
+      // The network reads the next minibatch from the loader's ring, without
+      // copying it onto the workspace, and runs forward:
+      const DataLoader<Real>::Batch& batch = loader.next();
+      const Real* const INP = batch.inputs;
+      net.setInput(INP, batchsize);
+      net.forward(batchsize);
 
-      //const double t3 = omp_get_wtime();
       // Compute the error = 1/2 \Sum (OUT - INP) ^ 2
 #pragma omp parallel for schedule(static) reduction(+ : epoch_mse)
       for (int i = 0; i < batchsize; i++)
       {
-        // For simplicity here we overwrite INP with the gradient of the error
-        // With respect to the Network's outputs = OUT - INP. OUT and INP have
-        // the same size and that's the size of the net's output
-        const Real error = compute_error(OUT[i], INP[i]); //now INP contains ERR
+        // Write the gradient of the error with respect to the Network's outputs
+        // = OUT - INP directly onto the workspace. OUT and INP have the same
+        // size and that's the size of the net's output
+        const int j = i*28*28;
+        const Real error = compute_error(OUT + j, INP + j, ERR + j, 28*28);
         epoch_mse += error;
       }
 
-      //const double t4 = omp_get_wtime();
-      net.bckward(INP);
+      net.bckward();
 
-      //const double t5 = omp_get_wtime();
       opt.update(batchsize);
-
-      // Erase last batchsize randomly shuffled dataset samples:
-      sample_ids.erase(sample_ids.end()-batchsize, sample_ids.end());
-      //const double t6 = omp_get_wtime();
-      //printf("pre:%f fwd:%f err:%f bck:%f opt:%f\n", t2-t1, t3-t2, t4-t3, t5-t4, t6-t5);
     }
     const double elapsed = omp_get_wtime() - t0;
 
     if(iepoch % 1 == 0)
     {
       const int steps_in_test = n_test_samp / batchsize;
+      // Test minibatches are written directly onto the workspace:
+      Real* const INP = net.getInputBuffer(batchsize);
 
       Real test_mse = 0;
       for (int step = 0; step < steps_in_test; step++)
       {
+        const int* const batch_ids = test_ids.data() + step*batchsize;
+        test.gather(batch_ids, batchsize, INP);
 
-#pragma omp parallel for schedule(static)
-        for (int i = 0; i < batchsize; i++)
-        {
-          const int sample = i + batchsize * step;
-          prepare_input(dataset.test_images[sample], INP[i]);
-        }
-
-        net.forward(OUT, INP);
+        net.forward(batchsize);
 
 #pragma omp parallel for schedule(static) reduction(+ : test_mse)
-        for (int i = 0; i < batchsize; i++)
-          test_mse += compute_error(OUT[i], INP[i]); //now input contains err
+        for (int i = 0; i < batchsize; i++) {
+          const int j = i*28*28;
+          test_mse += compute_error(OUT + j, INP + j, ERR + j, 28*28);
+        }
       }
       printf("Training set MSE:%f, Test set MSE:%f, wclock %f\n",
         epoch_mse/steps_in_epoch/batchsize, test_mse/steps_in_test/batchsize, elapsed);
     }
+    // per-layer time, flops and bytes of the epoch (with make profile=1):
+    net.reportProfile(iepoch);
   }
 
   //extract features:
-  // WARNING: if you change the shape of the net in any way, this will fail.
-  // If you add layers, edit the `compressionID` variable accordingly.
+  // Outputs of the decoder when the compression layer, named "code", has
+  // only one nonzero component, one sample at a time:
+  const InferenceContext<Real> decoder(net);
   for (int z = 0; z < 2 * Z; z++)
   {
     // initialize layer output of all zeros:
@@ -163,7 +147,7 @@ int main (int argc, char** argv)
     // turn on only one component in the compression layer
     z_vec[z % Z] = z >= Z ? -1 : 1;
 
-    const std::vector<Real> OUT = net.forward(z_vec, compressionID);
+    const std::vector<Real> OUT = decoder.forward(z_vec, net.layerID("code"));
     std::vector<float> OUT_float(OUT.size());
 
     std::copy(OUT.begin(), OUT.end(), OUT_float.begin());
@@ -0,0 +1,102 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+// Int8 inference with the MNIST classifier trained by main_classify.cpp.
+// Loads its parameters, calibrates the quantized network on a sample of the
+// training set, and compares accuracy and speed of both on the test set.
+
+#include "network/Quantized.h"
+#include "network/Dataset.h"
+
+static inline int max_index(const Real* const O, const int size) {
+  return std::distance(O, std::max_element(O, O + size));
+}
+
+int main (int argc, char** argv)
+{
+  // Number of training samples used to calibrate the activation scales:
+  const int nCalib = argc > 1 ? std::stoi(argv[1]) : 1024;
+  const int batchsize = 512;
+  printf("MNIST data directory: ./\n");
+
+  packIDX("train-images-idx3-ubyte", "train-labels-idx1-ubyte", "train.tdll");
+  packIDX( "t10k-images-idx3-ubyte",  "t10k-labels-idx1-ubyte",  "t10k.tdll");
+  const MappedDataset<Real> train("train.tdll"), test("t10k.tdll");
+
+  // Same network as main_classify.cpp:
+  Network<Real> net;
+  net.addInput<28*28*1>();
+  net.addConv2D< 28, 28,  1,   8,   8,   4,   2,2,    0,0>();
+  net.addLReLu< 11 * 11 * 4 >();
+  net.addConv2D< 11, 11,  4,   6,   6,   8,   1,1,    0,0>();
+  net.addLReLu< 6 * 6 * 8 >();
+  net.addConv2D<  6,  6,  8,   4,   4,  16,   1,1,    0,0>();
+  net.addLReLu< 3 * 3 * 16 >();
+  net.addConv2D<  3,  3, 16,   3,   3,  10,   1,1,    0,0>();
+  net.addSoftMaxCrossEntropy<10>();
+  // parameters written by exec_classify:
+  net.restart("classify.ckpt");
+  net.setInferenceOnly(true);
+
+  // Calibrate on random samples of the training set:
+  std::vector<int> calib_ids(std::min(nCalib, train.nSamples));
+  std::uniform_int_distribution<int> dis(0, train.nSamples-1);
+  std::generate(calib_ids.begin(), calib_ids.end(), [&]() {return dis(net.gen);});
+  std::vector<Real> calib(calib_ids.size() * train.sampleSize);
+  train.gather(calib_ids.data(), calib_ids.size(), calib.data());
+  QuantizedNetwork<Real> qnet(net, calib.data(), calib_ids.size());
+
+  const int steps_in_test = test.nSamples / batchsize;
+  std::vector<int> test_ids(batchsize), LBL(batchsize);
+  std::vector<Real> INP(batchsize * test.sampleSize);
+  std::vector<Real> OUT(batchsize * 10), QOUT(batchsize * 10);
+
+  double timeRef = 0, timeQ = 0, maxDiff = 0, sumDiff = 0;
+  long nRef = 0, nQ = 0, nAgree = 0, nTested = 0;
+  for (int step = 0; step < steps_in_test; step++)
+  {
+    std::iota(test_ids.begin(), test_ids.end(), step * batchsize);
+    test.gather(test_ids.data(), batchsize, INP.data(), LBL.data());
+
+    const double t0 = omp_get_wtime();
+    net.forward(OUT.data(), INP.data(), batchsize);
+    const double t1 = omp_get_wtime();
+    qnet.forward(QOUT.data(), INP.data(), batchsize);
+    const double t2 = omp_get_wtime();
+    timeRef += t1 - t0;
+    timeQ   += t2 - t1;
+
+    for (int i = 0; i < batchsize; i++)
+    {
+      const int predRef = max_index(OUT.data() + i*10, 10);
+      const int predQ  = max_index(QOUT.data() + i*10, 10);
+      nRef += predRef == LBL[i];
+      nQ   += predQ  == LBL[i];
+      nAgree += predRef == predQ;
+      for (int j = 0; j < 10; j++) {
+        const double diff = std::fabs(OUT[i*10 + j] - QOUT[i*10 + j]);
+        maxDiff = std::max(maxDiff, diff);
+        sumDiff += diff;
+      }
+    }
+    nTested += batchsize;
+  }
+
+  printf("Accuracy on %ld test samples (calibrated on %lu):\n", nTested,
+    calib_ids.size());
+  printf("  %s precision: %.4f, %.3f us/sample\n",
+    sizeof(Real)==4 ? "single" : "double", nRef/(double)nTested,
+    1e6 * timeRef / nTested);
+  printf("  int8:             %.4f, %.3f us/sample\n", nQ/(double)nTested,
+    1e6 * timeQ / nTested);
+  printf("  same prediction for %.4f of the samples, probabilities differ by "
+    "%.2e on average, %.2e at most\n", nAgree/(double)nTested,
+    sumDiff / nTested / 10, maxDiff);
+  return 0;
+}
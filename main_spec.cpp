@@ -0,0 +1,81 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+// Builds the network described by a spec file (see network/NetworkSpec.h),
+// which checks its shapes, and prints its layers. With --bench, times forward
+// and bckward of the network on random data at several batch sizes, e.g.
+// `./exec_spec specs/classify.net --bench 1 32 256`.
+
+#include "network/NetworkSpec.h"
+#include <functional>
+
+// Average time of one call of f, after one warm-up call:
+static double timeIt(const std::function<void()>& f, const double minTime)
+{
+  f();
+  for (size_t iters = 1; ; iters *= 2)
+  {
+    const double t0 = omp_get_wtime();
+    for (size_t i = 0; i < iters; i++) f();
+    const double elapsed = omp_get_wtime() - t0;
+    if (elapsed >= minTime || iters >= (1<<20)) return elapsed / iters;
+  }
+}
+
+static void bench(Network<Real>& net, const std::vector<int>& batchSizes)
+{
+  // networks ending with a loss layer are trained with labels, others with
+  // a random gradient of the error wrt to the output:
+  const bool bLoss = strcmp(net.layers.back()->name(), "SoftMaxCrossEntropy")==0;
+  std::normal_distribution<Real> dis(0, 1);
+  std::uniform_int_distribution<int> disLabel(0, net.nOutputs-1);
+
+  printf("%5s %12s %12s %14s\n", "batch", "fwd[ms]", "bck[ms]", "samples/s");
+  for (const int batchSize : batchSizes)
+  {
+    Real* const INP = net.getInputBuffer(batchSize);
+    Real* const ERR = net.getOutputErrorBuffer();
+    std::generate(INP, INP + batchSize * net.nInputs, [&]() {return dis(net.gen);});
+    std::generate(ERR, ERR + batchSize * net.nOutputs,[&]() {return dis(net.gen);});
+    std::vector<int> labels(batchSize);
+    std::generate(labels.begin(), labels.end(), [&]() {return disLabel(net.gen);});
+
+    const double tF = timeIt([&]() { net.forward(batchSize); }, 0.2);
+    const double tB = timeIt([&]() {
+      if (bLoss) net.bckward(labels.data(), batchSize);
+      else       net.bckward();
+    }, 0.2);
+    printf("%5d %12.4f %12.4f %14.1f\n", batchSize, 1e3 * tF, 1e3 * tB,
+           batchSize / (tF + tB));
+  }
+}
+
+int main (int argc, char** argv)
+{
+  if (argc < 2) {
+    printf("Usage: %s <spec file> [--bench [batch sizes]]\n", argv[0]);
+    abort();
+  }
+
+  Network<Real> net;
+  buildNetwork(net, std::string(argv[1]));
+  printf("%s: %lu layers, %d inputs, %d outputs, %lu parameters.\n", argv[1],
+         net.layers.size(), net.nInputs, net.nOutputs, net.flatSize);
+  for (const auto& named : net.layerNames)
+    printf("  layer %lu is named %s\n", named.second, named.first.c_str());
+
+  if (argc > 2 && strcmp(argv[2], "--bench") == 0)
+  {
+    std::vector<int> batchSizes;
+    for (int i = 3; i < argc; i++) batchSizes.push_back(std::stoi(argv[i]));
+    if (batchSizes.empty()) batchSizes = {1, 32, 256};
+    bench(net, batchSizes);
+  }
+  return 0;
+}
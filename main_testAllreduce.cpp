@@ -0,0 +1,72 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+// Compare the grads of a minibatch computed by one process with the grads
+// summed over MPI ranks, each computing its shard of the minibatch. Run with
+// `make mpi=1 exec_testAllreduce` and `mpirun -np 2 ./exec_testAllreduce`.
+
+#include "network/Network.h"
+
+int main (int argc, char * argv[])
+{
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  int rank, nRanks;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &nRanks);
+  static constexpr int nInputs = 8*8*2, nClasses = 10, shardsize = 4;
+  const int batchsize = shardsize * nRanks;
+
+  // Replicas are initialized differently: distribute copies rank 0's params.
+  Network<Real> NET(rank);
+  NET.addInput<nInputs>();
+  NET.addConv2D<8,8,2, 3,3,4>();
+  NET.addLReLu<8*8*4>();
+  NET.addConv2D<8,8,4, 4,4,4, 2,2, 1,1>();
+  NET.addTanh<4*4*4>();
+  NET.addLinear<4*4*4, nClasses>();
+  NET.addSoftMaxCrossEntropy<nClasses>();
+  NET.distribute(MPI_COMM_WORLD);
+  // several buckets per bckward:
+  NET.allreduce.bucketSize = 100;
+
+  // same minibatch on all ranks:
+  std::mt19937 gen(0);
+  std::normal_distribution<Real> dis(0, 1);
+  std::uniform_int_distribution<int> disLabel(0, nClasses-1);
+  std::vector<Real> input(batchsize * nInputs);
+  std::vector<int> labels(batchsize);
+  std::generate(input.begin(), input.end(), [&]() { return dis(gen); });
+  std::generate(labels.begin(), labels.end(), [&]() { return disLabel(gen); });
+
+  // grads of the whole minibatch, without communication:
+  NET.allreduce.nRanks = 1;
+  NET.forward(nullptr, input.data(), batchsize);
+  NET.bckward(labels.data(), batchsize);
+  const std::vector<Real> reference(NET.flatGrads, NET.flatGrads+NET.flatSize);
+  NET.allreduce.nRanks = nRanks;
+
+  // grads of the rank's shard, summed over ranks:
+  NET.forward(nullptr, input.data() + rank * shardsize * nInputs, shardsize);
+  NET.bckward(labels.data() + rank * shardsize, shardsize);
+
+  Real maxerr = 0;
+  for (size_t i = 0; i < NET.flatSize; i++)
+    maxerr = std::max(maxerr, std::fabs(NET.flatGrads[i] - reference[i]));
+  MPI_Allreduce(MPI_IN_PLACE, &maxerr, 1, NET.allreduce.datatype(), MPI_MAX,
+                MPI_COMM_WORLD);
+
+  const Real tol = std::sqrt(std::numeric_limits<Real>::epsilon());
+  if (rank == 0) {
+    printf("%d ranks, max abs error of summed grads: %e\n", nRanks, maxerr);
+    printf(maxerr < tol ? "Test PASSED!\n" : "Test FAILED!\n");
+  }
+  MPI_Finalize();
+  return maxerr < tol ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+// Checks the statistics of batch normalization, merged from the threads'
+// rows, against two passes over the minibatch. Then trains a network with
+// batch normalization, and checks that its inference is the same after a
+// checkpoint, which saves the running statistics, after folding the
+// normalization into the preceding layers, and after a checkpoint of the
+// folded network.
+
+#include "network/Optimizer.h"
+#include "network/Inference.h"
+
+static constexpr int nClasses = 10, batchsize = 16;
+static const Real tol = std::sqrt(std::numeric_limits<Real>::epsilon());
+
+static bool close(const Real a, const Real b) {
+  return std::fabs(a - b) <= tol * std::max((Real) 1, std::fabs(b));
+}
+
+// Channels with large mean wrt their std, where one-pass sums of squares
+// would lose the variance:
+static bool testStatistics()
+{
+  static constexpr int nPixels = 5*5, C = 3, nRows = batchsize * nPixels;
+  Network<Real> net;
+  net.verbose = false;
+  net.addInput<nPixels * C>();
+  net.addBatchNorm<C>();
+  net.addLinear<nPixels * C, nClasses>();
+  net.addSoftMaxCrossEntropy<nClasses>();
+  const auto& BN = * (const RuntimeBatchNormLayer<Real>*) net.layers[1];
+
+  std::normal_distribution<Real> dis(0, 1);
+  Real* const X = net.getInputBuffer(batchsize);
+  for (int r = 0; r < nRows; r++)
+    for (int c = 0; c < C; c++)
+      X[r*C + c] = 1000 * (c+1) + (c+1) * dis(net.gen);
+  net.forward(batchsize);
+
+  bool pass = true;
+  const Real* const Y = net.workspace[1]->output;
+  for (int c = 0; c < C; c++) {
+    double mean = 0, var = 0, meanY = 0, varY = 0;
+    for (int r = 0; r < nRows; r++) mean += X[r*C + c] / nRows;
+    for (int r = 0; r < nRows; r++) var += std::pow(X[r*C + c] - mean, 2) / nRows;
+    for (int r = 0; r < nRows; r++) meanY += Y[r*C + c] / nRows;
+    for (int r = 0; r < nRows; r++) varY += std::pow(Y[r*C + c] - meanY, 2) / nRows;
+    pass = pass && close(BN.batchMean[c], mean) &&
+      close(BN.batchInvStd[c], 1 / std::sqrt(var + BN.EPS)) &&
+      close(BN.running[c], BN.momentum * mean) &&
+      close(BN.running[C + c],
+            1 - BN.momentum + BN.momentum * var * nRows / (nRows-1)) &&
+      close(varY, var / (var + BN.EPS)) &&
+      // up to the rounding of mean, in units of the std:
+      std::fabs(meanY) < 16 * std::numeric_limits<Real>::epsilon() *
+                         std::fabs(mean) / std::sqrt(var);
+  }
+  printf("Statistics with %d threads: %s\n", omp_get_max_threads(),
+         pass ? "PASSED" : "FAILED");
+  return pass;
+}
+
+static void build(Network<Real>& net)
+{
+  net.verbose = false;
+  net.addInput<6*6*2>();
+  net.addConv2D<6,6,2, 3,3,4>();
+  net.addBatchNorm<4>();
+  net.addLReLu<6*6*4>();
+  net.addLinear<6*6*4, 32>();
+  net.addBatchNorm<32>();
+  net.addTanh<32>();
+  net.addLinear<32, nClasses>();
+  net.addSoftMaxCrossEntropy<nClasses>();
+}
+
+// Outputs of the network's inference on the samples I:
+static std::vector<Real> infer(const Network<Real>& net,
+                               const std::vector<Real>& I)
+{
+  const InferenceContext<Real> context(net);
+  const int nInputs = net.nInputs, n = I.size() / nInputs;
+  std::vector<Real> O(n * nClasses);
+  for (int i = 0; i < n; i++) {
+    const Real* const out = context.forward(I.data() + i * nInputs);
+    std::copy(out, out + nClasses, O.begin() + i * nClasses);
+  }
+  return O;
+}
+
+static bool equal(const std::vector<Real>& A, const std::vector<Real>& B)
+{
+  bool pass = A.size() == B.size();
+  for (size_t i = 0; pass && i < A.size(); i++) pass = close(A[i], B[i]);
+  return pass;
+}
+
+static bool testInference()
+{
+  const std::string fname = "testBatchNorm.ckpt";
+  Network<Real> A;
+  build(A);
+  Optimizer<Adam<Real>> opt(A, 1e-2);
+  std::normal_distribution<Real> dis(0, 1);
+  std::uniform_int_distribution<int> disLabel(0, nClasses-1);
+  std::vector<Real> input(batchsize * A.nInputs);
+  std::vector<int> labels(batchsize);
+  for (int s = 0; s < 20; s++) {
+    // inputs whose statistics differ from those of a standard normal:
+    std::generate(input.begin(), input.end(), [&]() {
+      return 3 + 2 * dis(A.gen); });
+    std::generate(labels.begin(), labels.end(), [&]() {
+      return disLabel(A.gen); });
+    A.forward(nullptr, input.data(), batchsize);
+    A.bckward(labels.data(), batchsize);
+    opt.update(batchsize);
+  }
+  A.save(fname);
+
+  // in evaluation mode, the training workspace uses the running statistics,
+  // as does the inference context:
+  A.setTraining(false);
+  A.forward(nullptr, input.data(), batchsize);
+  const Real* const O = A.getOutputActivation()->output;
+  const std::vector<Real> evaluated(O, O + batchsize * nClasses);
+  const std::vector<Real> unfolded = infer(A, input);
+  bool pass = equal(evaluated, unfolded);
+
+  Network<Real> B;
+  build(B);
+  B.restart(fname);
+  pass = pass && equal(infer(B, input), unfolded);
+
+  pass = A.foldBatchNorm() == 2 && pass;
+  pass = pass && equal(infer(A, input), unfolded);
+  // the fold is part of the state: restarted, the network is already folded
+  A.save(fname);
+  Network<Real> C;
+  build(C);
+  C.restart(fname);
+  C.setTraining(false);
+  pass = pass && equal(infer(C, input), unfolded) && C.foldBatchNorm() == 0;
+  pass = pass && equal(infer(C, input), unfolded);
+  // folded layers run in place:
+  const WorkspacePlan<Real> plan = A.planWorkspace(1, false);
+  pass = pass && plan.outOffset[2] == plan.outOffset[1] &&
+                 plan.outOffset[5] == plan.outOffset[4];
+  remove(fname.c_str());
+  printf("Inference after checkpoint, folding and checkpoint: %s\n",
+         pass ? "PASSED" : "FAILED");
+  return pass;
+}
+
+int main (int argc, char * argv[])
+{
+  // threads merge the statistics of their rows:
+  omp_set_num_threads(argc > 1 ? std::stoi(argv[1]) : 3);
+  bool pass = testStatistics();
+  pass = testInference() && pass;
+  printf(pass ? "Test PASSED!\n" : "Test FAILED!\n");
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+// Train a few steps, write a checkpoint while training continues, restart a
+// new network, optimizer and data loader from it, and check that both then
+// take the same steps, on the same minibatches.
+
+#include "network/Optimizer.h"
+#include "network/DataLoader.h"
+
+// epochs of 3 minibatches: the steps after the checkpoint start a new epoch
+static constexpr int nInputs = 6*6*2, nClasses = 10, batchsize = 8;
+static constexpr int nSamples = 3 * batchsize + 5;
+
+static void build(Network<Real>& net, const int seed)
+{
+  net.gen.seed(seed);
+  net.addInput<nInputs>();
+  net.addConv2D<6,6,2, 3,3,4>();
+  net.addLReLu<6*6*4>();
+  net.addLinear<6*6*4, nClasses>();
+  net.addSoftMaxCrossEntropy<nClasses>();
+}
+
+// Dataset of random samples and labels:
+static void writeData(const std::string fname)
+{
+  std::mt19937 gen(42);
+  std::normal_distribution<float> dis(0, 1);
+  std::uniform_int_distribution<int32_t> disLabel(0, nClasses-1);
+  std::vector<float> rows(nSamples * nInputs);
+  std::vector<int32_t> labels(nSamples);
+  std::generate(rows.begin(), rows.end(), [&]() { return dis(gen); });
+  std::generate(labels.begin(), labels.end(), [&]() { return disLabel(gen); });
+  writeDataset<float>(fname, nSamples, nInputs, rows.data(), labels.data(), 1);
+}
+
+// One step of training on the next minibatch of the loader:
+static void train(Network<Real>& net, Optimizer<Adam<Real>>& opt,
+                  DataLoader<Real>& loader)
+{
+  const DataLoader<Real>::Batch& batch = loader.next();
+  net.setInput(batch.inputs, batchsize);
+  net.forward(batchsize);
+  net.bckward(batch.labels, batchsize);
+  opt.update(batchsize);
+}
+
+int main (int argc, char * argv[])
+{
+  const std::string fname = "testCheckpoint.ckpt", dname = "testCheckpoint.data";
+  writeData(dname);
+  const MappedDataset<Real> data(dname);
+
+  Network<Real> A;
+  build(A, 0);
+  Optimizer<Adam<Real>> optA(A, 1e-3);
+  DataLoader<Real> loaderA(data, batchsize, A.gen());
+  for (int i = 0; i < 5; i++) train(A, optA, loaderA);
+
+  // snapshot is taken by save, the params change while the file is written:
+  {
+    CheckpointWriter<Real> writer;
+    const DataLoader<Real>::State state = loaderA.state();
+    optA.save(writer, fname, std::string((const char*) &state, sizeof(state)));
+    train(A, optA, loaderA);
+    train(A, optA, loaderA);
+  }
+
+  // differently initialized network, resumed at the checkpoint:
+  Network<Real> B;
+  build(B, 1);
+  Optimizer<Adam<Real>> optB(B, 1e-3);
+  const std::string saved = optB.restart(fname);
+  DataLoader<Real>::State state = {0, 0};
+  if (saved.size() == sizeof(state)) memcpy(&state, saved.data(), sizeof(state));
+  DataLoader<Real> loaderB(data, batchsize, state);
+  train(B, optB, loaderB);
+  train(B, optB, loaderB);
+
+  Real maxerr = 0;
+  for (size_t i = 0; i < A.flatSize; i++) {
+    maxerr = std::max(maxerr, std::fabs(A.flatParams[i] - B.flatParams[i]));
+    maxerr = std::max(maxerr, std::fabs(optA.momentum_1st[i] - optB.momentum_1st[i]));
+    maxerr = std::max(maxerr, std::fabs(optA.momentum_2nd[i] - optB.momentum_2nd[i]));
+  }
+  const bool pass = maxerr <= 0 && optA.step == optB.step && A.gen == B.gen &&
+    loaderB.state().step == optB.step && saved.size() == sizeof(state);
+  printf("Max abs difference after resuming: %e, steps %lu %lu\n", maxerr,
+         optA.step, optB.step);
+  printf(pass ? "Test PASSED!\n" : "Test FAILED!\n");
+  remove(fname.c_str());
+  remove(dname.c_str());
+  return pass ? 0 : 1;
+}
@@ -7,170 +7,220 @@
 //
 //  Created by Guido Novati (novatig@gmail.com).
 //
-// Compare finite differences and analytical backprop.
+// Compare finite differences and analytical backprop (see GradCheck.h).
 
 
-#include "network/Network.h"
+#include "network/GradCheck.h"
+#include "network/NetworkSpec.h"
+
+static constexpr const char* options = "lrelu, tanh, inplace, fused, "
+  "unfused, linear, conv, conv_f2, conv_s2, im2mat, im2mat_s2, runtime, "
+  "spec, deconv, softmax, xent, batchnorm, classify.";
 
 int main (int argc, char * argv[])
 {
   printf("Checking gradients\n");
   static constexpr int nOutputs = 1;
   static constexpr int nInputs  = 36;
-
-  const Real incr = std::cbrt( std::numeric_limits<Real>::epsilon() );
-  const Real tol = incr;
-
-  Network NET;
+  static constexpr int nClasses = 10;
 
   // prepare the network
-  if(argc not_eq 2) {
-    printf("Requires one arg to specify test.\n Options: lrelu, tanh, linear, conv, deconv, softmax. \n");
+  if(argc < 2) {
+    printf("Requires one arg to specify test, and optionally the number of "
+      "parameters checked per layer (default all).\n Options: %s\n", options);
     abort();
   }
 
-  if(strcmp ("lrelu", argv[1]) == 0)
-  {
-    NET.addInput<nInputs>();
-    const int nHidden  = 32;
-    NET.addLinear<nInputs, nHidden>();
-    NET.addLReLu<nHidden>(); // addTanh
-
-    NET.addLinear<nHidden, nOutputs>();
-  }
-  else if(strcmp ("tanh", argv[1]) == 0)
-  {
-    NET.addInput<nInputs>();
-    const int nHidden  = 32;
-    NET.addLinear<nInputs, nHidden>();
-    NET.addTanh<nHidden>();
-    NET.addLinear<nHidden, nOutputs>();
-  }
-  else if (strcmp ("conv", argv[1]) == 0)
-  {
-    NET.addInput<nInputs>();
-    NET.addConv2D<6,6,1, 3,3,3>();
-    NET.addLinear<6*6*3, nOutputs>();
-  }
-  else if (strcmp ("deconv", argv[1]) == 0)
-  {
-    NET.addInput<nInputs>();
-    NET.addDeConv2D<6,6,1, 3,3,3>();
-    NET.addLinear<6*6*3, nOutputs>();
-  }
-  else if (strcmp ("linear", argv[1]) == 0)
-  {
-    NET.addInput<nInputs>();
-    NET.addLinear<nInputs, nOutputs>();
-  }
-  else if (strcmp ("softmax", argv[1]) == 0)
-  {
-    NET.addInput<nInputs>();
-    NET.addSoftMax<nInputs>();
-    NET.addLinear<nInputs, nOutputs>();
-  }
-  else
-  {
-    printf("Argument not recognized.\n Options: lrelu, tanh, linear, conv, deconv, softmax. \n");
-    abort();
-  }
-
-  // fetch and init network gradients
-  const std::vector<Params*>& grads = NET.grads;
-  for(auto& p: grads) if(p not_eq nullptr) { p->clearBias(); p->clearWeight(); }
-
-  // prepare some input
-  std::vector<Real> input(nInputs);
-  {
-    std::normal_distribution<Real> dis_inp(0, 1);
-    for(int j=0; j<nInputs; j++) input[j] = dis_inp(NET.gen);
-  }
-
-  // compute network output for given input:
-  const std::vector<Real> output = NET.forward(input);
-
-  // Compute gradients for dErr / dOut = 1 . This is equivalent to saying
-  // compute the gradient of the output wrt to the network parameters.
-  std::vector<Real> dErrdOut(nOutputs, 1);
-  NET.bckward(dErrdOut);
-
-  // fetch vector of layers from network:
-  const std::vector<Layer *>& layers = NET.layers;
-  // fetch vector of parameters arrays from network:
-  const std::vector<Params*>& params = NET.params;
-
-  // define function to perform finite differences:
-  auto finDiff = [&](int outputID, int paramID, Real*paramArray, Real*gradArray)
-  {
-    const Real backup = paramArray[paramID];
-    //1) compute output after increasing network parameter by incr
-    paramArray[paramID] = backup + incr;
-    const std::vector<Real> resP = NET.forward(input);
-
-    //2) compute output after decreasing network parameter by incr
-    paramArray[paramID] = backup - incr;
-    const std::vector<Real> resM = NET.forward(input);
-
-    //0) restore parameter to initial value
-    paramArray[paramID] = backup;
+  // Called by the checker once for the tested network and once for each of
+  // its threads' copies:
+  const auto build = [&] (Network<Real>& NET) {
+    if(strcmp ("lrelu", argv[1]) == 0)
+    {
+      NET.addInput<nInputs>();
+      const int nHidden  = 32;
+      NET.addLinear<nInputs, nHidden>();
+      NET.addLReLu<nHidden>(); // addTanh
 
-    // Compute finite differences gradient:
-    const Real diff = (resP[outputID] - resM[outputID]) / (2*incr);
-    const Real err = std::fabs(gradArray[paramID]-diff); // absolute error
-    if (err > tol)
-      printf("Param %d - absolute error is %f (dO:%f G:%f, out:%f)\n",
-          paramID, err, diff, gradArray[paramID], resP[0]);
-    return err;
+      NET.addLinear<nHidden, nOutputs>();
+    }
+    else if(strcmp ("tanh", argv[1]) == 0)
+    {
+      NET.addInput<nInputs>();
+      const int nHidden  = 32;
+      NET.addLinear<nInputs, nHidden>();
+      NET.addTanh<nHidden>();
+      NET.addLinear<nHidden, nOutputs>();
+    }
+    else if(strcmp ("inplace", argv[1]) == 0)
+    {
+      // Chain of element-wise layers sharing the workspace of their inputs:
+      NET.addInput<nInputs>();
+      const int nHidden  = 32;
+      NET.addLinear<nInputs, nHidden>();
+      NET.addLReLu<nHidden>();
+      NET.addTanh<nHidden>();
+      NET.addLReLu<nHidden>();
+      NET.addLinear<nHidden, nOutputs>();
+    }
+    else if (strcmp ("fused", argv[1]) == 0)
+    {
+      // Activations applied in the epilogue of each type of conv and of the
+      // last layer:
+      NET.addInput<nInputs>();
+      NET.addConv2D<6,6,1, 3,3,3>(); // Winograd
+      NET.addLReLu<6*6*3>();
+      NET.addConv2D<6,6,3, 4,4,2, 2,2, 1,1>(); // implicit im2col
+      NET.addTanh<3*3*2>();
+      NET.addIm2MatConv2D<3,3,2, 3,3,2>();
+      NET.addLReLu<3*3*2>();
+      NET.addLinear<3*3*2, nOutputs>();
+      NET.addTanh<nOutputs>();
+    }
+    else if (strcmp ("unfused", argv[1]) == 0)
+    {
+      // Same activations as separate layers:
+      NET.fuseActivations = false;
+      NET.addInput<nInputs>();
+      NET.addConv2D<6,6,1, 3,3,3>();
+      NET.addLReLu<6*6*3>();
+      NET.addConv2D<6,6,3, 4,4,2, 2,2, 1,1>();
+      NET.addTanh<3*3*2>();
+      NET.addLinear<3*3*2, nOutputs>();
+      NET.addTanh<nOutputs>();
+    }
+    else if (strcmp ("conv", argv[1]) == 0)
+    {
+      NET.addInput<nInputs>();
+      NET.addConv2D<6,6,1, 3,3,3>();
+      NET.addLinear<6*6*3, nOutputs>();
+    }
+    else if (strcmp ("conv_f2", argv[1]) == 0)
+    {
+      NET.addInput<nInputs>();
+      NET.addConv2D<3,3,4, 3,3,2>();
+      NET.addLinear<3*3*2, nOutputs>();
+    }
+    else if (strcmp ("conv_s2", argv[1]) == 0)
+    {
+      NET.addInput<nInputs>();
+      NET.addConv2D<6,6,1, 4,4,2, 2,2, 1,1>();
+      NET.addLinear<3*3*2, nOutputs>();
+    }
+    else if (strcmp ("im2mat", argv[1]) == 0)
+    {
+      NET.addInput<nInputs>();
+      NET.addIm2MatConv2D<6,6,1, 3,3,3>();
+      NET.addLinear<6*6*3, nOutputs>();
+    }
+    else if (strcmp ("im2mat_s2", argv[1]) == 0)
+    {
+      NET.addInput<nInputs>();
+      NET.addLinear<nInputs, nInputs>(); // checks gradient wrt to conv input
+      NET.addIm2MatConv2D<6,6,1, 4,4,2, 2,2, 1,1>();
+      NET.addLinear<3*3*2, nOutputs>();
+    }
+    else if (strcmp ("runtime", argv[1]) == 0)
+    {
+      // Same layers with shapes given at runtime:
+      NET.addInput(nInputs);
+      NET.addConv2D(6,6,1, 3,3,3);
+      NET.addLReLu(6*6*3);
+      NET.addConv2D(6,6,3, 4,4,2, 2,2, 1,1);
+      NET.addTanh(3*3*2);
+      NET.addIm2MatConv2D(3,3,2, 3,3,2, 2,2, 1,1);
+      NET.addDeConv2D(2,2,2, 3,3,2, 2,2, 0,0);
+      NET.addLinear(5*5*2, nClasses);
+      NET.addSoftMax(nClasses);
+      NET.addLinear(nClasses, nOutputs);
+    }
+    else if (strcmp ("spec", argv[1]) == 0)
+    {
+      // Network read from a spec (see NetworkSpec.h), ending with a loss:
+      std::istringstream spec(
+        "input   6 6 1            \n"
+        "conv2d  4 4 2  stride=2  \n"
+        "tanh    name=features    \n"
+        "linear  8                \n"
+        "reshape 2 2 2            \n"
+        "deconv2d 3 3 2 pad=0     \n"
+        "lrelu                    \n"
+        "linear  10               \n"
+        "softmax_xent             \n");
+      buildNetwork(NET, spec);
+    }
+    else if (strcmp ("deconv", argv[1]) == 0)
+    {
+      NET.addInput<nInputs>();
+      NET.addDeConv2D<6,6,1, 3,3,3>();
+      NET.addLinear<6*6*3, nOutputs>();
+    }
+    else if (strcmp ("linear", argv[1]) == 0)
+    {
+      NET.addInput<nInputs>();
+      NET.addLinear<nInputs, nOutputs>();
+    }
+    else if (strcmp ("softmax", argv[1]) == 0)
+    {
+      NET.addInput<nInputs>();
+      NET.addSoftMax<nInputs>();
+      NET.addLinear<nInputs, nOutputs>();
+    }
+    else if (strcmp ("xent", argv[1]) == 0)
+    {
+      NET.addInput<nInputs>();
+      NET.addLinear<nInputs, nClasses>();
+      NET.addSoftMaxCrossEntropy<nClasses>();
+    }
+    else if (strcmp ("batchnorm", argv[1]) == 0)
+    {
+      // Normalization with the statistics of the minibatch, which depend on
+      // all its samples, of the channels of an image and of a Linear layer:
+      NET.addInput<nInputs>();
+      NET.addConv2D<6,6,1, 3,3,3>();
+      NET.addBatchNorm<3>();
+      NET.addLReLu<6*6*3>();
+      NET.addLinear<6*6*3, nClasses>();
+      NET.addBatchNorm(nClasses);
+      NET.addSoftMaxCrossEntropy<nClasses>();
+    }
+    else if (strcmp ("classify", argv[1]) == 0)
+    {
+      // The MNIST classifier of main_classify.cpp, e.g. check 100 parameters
+      // per layer with `./exec_testGrad classify 100`:
+      NET.addInput<28*28*1>();
+      NET.addConv2D< 28, 28,  1,   8,   8,  16,   2,2,    0,0>();
+      NET.addLReLu< 11 * 11 * 16>();
+      NET.addConv2D< 11, 11, 16,   6,   6,  32,   1,1,    0,0>();
+      NET.addLReLu< 6 * 6 * 32>();
+      NET.addConv2D<  6,  6, 32,   4,   4,  64,   1,1,    0,0>();
+      NET.addLReLu< 3 * 3 * 64 >();
+      NET.addLinear<3 * 3 * 64, 96>();
+      NET.addTanh<96>();
+      NET.addLinear<96, nClasses>();
+      NET.addSoftMaxCrossEntropy<nClasses>();
+    }
+    else
+    {
+      printf("Argument not recognized.\n Options: %s\n", options);
+      abort();
+    }
   };
 
+  GradCheck<Real> check(build, strcmp ("xent", argv[1]) == 0 ||
+                               strcmp ("batchnorm", argv[1]) == 0 ||
+                               strcmp ("classify", argv[1]) == 0 ||
+                               strcmp ("spec", argv[1]) == 0);
+  if(argc > 2) check.maxPerLayer = std::stoul(argv[2]);
 
-  long double meanerr = 0, squarederr = 0, cnterr = 0;
-  for (int o=0; o < nOutputs; o++) // loop over all network outputs
-  {
-    // loop over all layers:
-    for (size_t j=0; j < layers.size(); j++)
-    {
-      if(params[j] == nullptr) {
-        printf("Layer %lu has no parameters ... \n", j);
-        continue;
-      } else printf("Testing Layer %lu ... \n", j);
-      // loop over all parameters of the layer:
-      for (int i=0; i < params[j]->nWeights + params[j]->nBiases; i++)
-      {
-        int paramID;
-        Real* gradArray;
-        Real* paramArray;
-
-        // if loop counter >= num weights of layer then we consider biases
-        if(i < params[j]->nWeights) {
-          paramArray = params[j]->weights;
-          gradArray = grads[j]->weights;
-          paramID = i; // goes from 0 to nWeights-1
-        } else {
-          paramArray = params[j]->biases;
-          gradArray = grads[j]->biases;
-          paramID = i - params[j]->nWeights; // goes from 0 to nBiases-1
-        }
-
-        //printf("W:%f G:%f\n", paramArray[paramID], gradArray[paramID]);
-        const Real err = finDiff(o, paramID, paramArray, gradArray);
-
-        cnterr += 1;
-        meanerr += err;
-        squarederr += err*err;
-      }
-    }
-  }
-
-  // Compute mean and stdef of errors:
-  const Real stdef= std::sqrt((squarederr -meanerr*meanerr/cnterr)/cnterr);
-  const Real mean = meanerr/cnterr;
+  const double t0 = omp_get_wtime();
+  const double mean = check.run();
+  printf("Gradients checked in %f seconds.\n", omp_get_wtime() - t0);
+  check.print();
 
-  printf("Mean err:%g std:%g count:%LG.\n", mean, stdef, cnterr);
-  if(mean > tol) {
-    printf("Test FAILED!\n");
+  if(mean > check.tol) {
+    printf("Mean err:%g. Test FAILED!\n", mean);
   } else {
-    printf("Test PASSED!\n");
+    printf("Mean err:%g. Test PASSED!\n", mean);
   }
-  return mean > tol;
+  return mean > check.tol;
 }
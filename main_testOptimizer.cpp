@@ -0,0 +1,162 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+// Checks the updates of each optimizer, computed by threads over parts of the
+// flat arrays that split the layers' tensors, against plain loops over each
+// tensor, with and without clipping of the grads, with a learning rate
+// schedule. Then checks the powers of the bias correction and the schedules.
+
+#include "network/Optimizer.h"
+
+static constexpr int batchsize = 8, nSteps = 6;
+static constexpr Real eta = 1e-2, lambda = 1e-3, b1 = .9, b2 = .999;
+
+// layers whose tensors are not multiples of the threads' parts:
+static void build(Network<Real>& net)
+{
+  net.addInput<7*7*3>();
+  net.addConv2D<7,7,3, 3,3,5>();
+  net.addLReLu<7*7*5>();
+  net.addLinear<7*7*5, 13>();
+  net.addLinear<13, 3>();
+}
+
+// Reference update of the params of one tensor, of size n, with grads G
+// already averaged and clipped, and learning rate lr of the step:
+template<typename Algorithm>
+static void reference(const int n, Real* const W, const Real* const G,
+  Real* const M1, Real* const M2, const Real lr, const Real b1t,
+  const Real b2t)
+{
+  const Real corr = std::sqrt(1-b2t) / (1-b1t);
+  if (std::is_same<Algorithm, MomentumSGD<Real>>::value)
+    for (int i = 0; i < n; i++) {
+      M1[i] = b1 * M1[i] - lr * (G[i] + lambda * W[i]);
+      W[i] += M1[i];
+    }
+  else if (std::is_same<Algorithm, Adam<Real>>::value)
+    for (int i = 0; i < n; i++) {
+      const Real g = G[i] + lambda * W[i];
+      M1[i] = b1 * M1[i] + (1-b1) * g;
+      M2[i] = b2 * M2[i] + (1-b2) * g * g;
+      W[i] -= lr * corr * M1[i] / (std::sqrt(M2[i]) + Adam<Real>::EPS);
+    }
+  else if (std::is_same<Algorithm, AdamW<Real>>::value)
+    for (int i = 0; i < n; i++) {
+      M1[i] = b1 * M1[i] + (1-b1) * G[i];
+      M2[i] = b2 * M2[i] + (1-b2) * G[i] * G[i];
+      W[i] -= lr * corr * M1[i] / (std::sqrt(M2[i]) + AdamW<Real>::EPS)
+              + lr * lambda * W[i];
+    }
+  else {
+    std::vector<Real> R(n);
+    Real normW = 0, normR = 0;
+    for (int i = 0; i < n; i++) {
+      M1[i] = b1 * M1[i] + (1-b1) * G[i];
+      M2[i] = b2 * M2[i] + (1-b2) * G[i] * G[i];
+      R[i] = corr * M1[i] / (std::sqrt(M2[i]) + LAMB<Real>::EPS) + lambda*W[i];
+      normW += W[i] * W[i];
+      normR += R[i] * R[i];
+    }
+    const Real ratio = normW > 0 && normR > 0 ? std::sqrt(normW/normR) : 1;
+    for (int i = 0; i < n; i++) W[i] -= lr * ratio * R[i];
+  }
+}
+
+template<typename Algorithm>
+static bool test(const char* const name, const Real clipNorm)
+{
+  Network<Real> net;
+  build(net);
+  Optimizer<Algorithm> opt(net, eta, lambda, b1, b2);
+  opt.clipNorm = clipNorm;
+  opt.schedule = LearningRateSchedule::cosine(2, 3, 0.1);
+  const size_t N = net.flatSize;
+  std::vector<Real> W(net.flatParams, net.flatParams + N), M1(N, 0), M2(N, 0);
+  std::normal_distribution<Real> dis(0, 1);
+
+  for (int s = 0; s < nSteps; s++)
+  {
+    // grads of the padding between tensors stay zero, as set by bckward:
+    for (size_t j = 0; j < net.layers.size(); j++) if (net.grads[j]) {
+      Params<Real>* const P = net.grads[j];
+      std::generate(P->weights, P->weights + P->nWeights, [&]() {
+        return dis(net.gen); });
+      std::generate(P->biases, P->biases + P->nBiases, [&]() {
+        return dis(net.gen); });
+    }
+    Real sumsq = 0;
+    for (size_t i = 0; i < N; i++) sumsq += net.flatGrads[i] * net.flatGrads[i];
+    const Real norm = std::sqrt(sumsq) / batchsize;
+    const Real fac = clipNorm > 0 && norm > clipNorm ?
+                     clipNorm / norm / batchsize : (Real) 1 / batchsize;
+    std::vector<Real> G(N);
+    for (size_t i = 0; i < N; i++) G[i] = fac * net.flatGrads[i];
+
+    const Real lr = opt.learningRate(), b1t = opt.beta_1t, b2t = opt.beta_2t;
+    for (size_t j = 0; j < net.layers.size(); j++) {
+      const Params<Real>* const P = net.params[j];
+      if (P == nullptr) continue;
+      for (const Real* const T : {P->weights, P->biases}) {
+        const size_t o = T - net.flatParams;
+        const int n = T == P->weights ? P->nWeights : P->nBiases;
+        reference<Algorithm>(n, &W[o], &G[o], &M1[o], &M2[o], lr, b1t, b2t);
+      }
+    }
+    opt.update(batchsize);
+  }
+
+  Real maxerr = 0;
+  for (size_t i = 0; i < N; i++)
+    maxerr = std::max(maxerr, std::fabs(W[i] - net.flatParams[i]));
+  const bool pass = maxerr < 100 * std::numeric_limits<Real>::epsilon();
+  printf("%-12s clip %4.2f: max abs difference %e %s\n", name, clipNorm,
+         maxerr, pass ? "PASSED" : "FAILED");
+  return pass;
+}
+
+// Bias correction after some steps, and factors of the schedules:
+static bool testSchedule()
+{
+  Network<Real> net;
+  build(net);
+  Optimizer<Adam<Real>> opt(net, eta, lambda, b1, b2);
+  for (int s = 0; s < 50; s++) opt.update(batchsize);
+  const auto close = [] (const double a, const double b) {
+    return std::fabs(a - b) <= 1e-12 * std::fabs(b);
+  };
+  bool pass = close(opt.beta_1t, std::pow((double) b1, 51)) &&
+              close(opt.beta_2t, std::pow((double) b2, 51));
+
+  const LearningRateSchedule C = LearningRateSchedule::cosine(4, 10, 0.1);
+  const LearningRateSchedule S = LearningRateSchedule::stepDecay(0, 10, 0.5);
+  pass = pass && close(C.factor(0), .25) && close(C.factor(3), 1) &&
+    close(C.factor(4), 1) && close(C.factor(9), .55) &&
+    close(C.factor(14), .1) && close(C.factor(100), .1) &&
+    close(S.factor(9), 1) && close(S.factor(10), .5) &&
+    close(S.factor(25), .25) && close(LearningRateSchedule().factor(7), 1);
+  printf("Bias correction and schedules: %s\n", pass ? "PASSED" : "FAILED");
+  return pass;
+}
+
+int main (int argc, char * argv[])
+{
+  // threads' parts of the flat arrays split tensors:
+  omp_set_num_threads(argc > 1 ? std::stoi(argv[1]) : 3);
+  bool pass = true;
+  for (const Real clip : {(Real) 0, (Real) 0.5}) {
+    pass = test<MomentumSGD<Real>>("MomentumSGD", clip) && pass;
+    pass = test<Adam<Real>>("Adam", clip) && pass;
+    pass = test<AdamW<Real>>("AdamW", clip) && pass;
+    pass = test<LAMB<Real>>("LAMB", clip) && pass;
+  }
+  pass = testSchedule() && pass;
+  printf(pass ? "Test PASSED!\n" : "Test FAILED!\n");
+  return pass ? 0 : 1;
+}
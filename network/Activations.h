@@ -13,46 +13,77 @@
 
 #include "Utils.h"
 
+template<typename Real>
 struct Activation
 {
-  const int batchSize, layersSize;
-  //matrix of size batchSize * layersSize with layer outputs:
-  Real* const output;
+  // Rows in use: a view onto a workspace may have room for more, the network
+  // sets the rows of its views in getInputBuffer.
+  int batchSize;
+  const int layersSize;
+  //matrix of size batchSize * layersSize with layer outputs. The view of the
+  //input layer may point to the caller's minibatch, see Network::setInput:
+  Real* output;
   //matrix of same size containing:
   Real* const dError_dOutput;
 
+  //whether output and dError_dOutput are freed by the destructor:
+  const bool ownsMemory;
+
   Activation(const int bs, const int ls) : batchSize(bs), layersSize(ls),
-    output(_myalloc(bs*ls)), dError_dOutput(_myalloc(bs*ls))
+    output(_myalloc<Real>(bs*ls)), dError_dOutput(_myalloc<Real>(bs*ls)),
+    ownsMemory(true)
   {
     clearErrors();
     clearOutput();
     assert(batchSize>0 && layersSize>0);
   }
 
-  ~Activation() { _myfree(output); _myfree(dError_dOutput); }
+  // View onto memory owned by someone else (e.g. the arena of the network's
+  // workspace). dError_dOutput is null if the workspace is for inference.
+  Activation(const int bs, const int ls, Real* const out, Real* const err) :
+    batchSize(bs), layersSize(ls), output(out), dError_dOutput(err),
+    ownsMemory(false)
+  {
+    assert(batchSize>0 && layersSize>0 && output not_eq nullptr);
+  }
+
+  ~Activation() {
+    if(ownsMemory) { _myfree(output); _myfree(dError_dOutput); }
+  }
 
   inline void clearOutput() {
     memset(output,         0, batchSize*layersSize*sizeof(Real));
   }
   inline void clearErrors() {
+    if(dError_dOutput == nullptr) return;
     memset(dError_dOutput, 0, batchSize*layersSize*sizeof(Real));
   }
 };
 
+template<typename Real>
 struct Params
 {
   const int nWeights, nBiases;
   Real* const weights; // size is nWeights
   Real* const biases;  // size is nBiases
 
+  //whether weights and biases are freed by the destructor:
+  const bool ownsMemory;
+
   Params(const int _nW, const int _nB): nWeights(_nW), nBiases(_nB),
-    weights(_myalloc(_nW)), biases(_myalloc(_nB))
+    weights(_myalloc<Real>(_nW)), biases(_myalloc<Real>(_nB)), ownsMemory(true)
   {
     clearBias();
     clearWeight();
   }
 
-  ~Params() { _myfree(weights); _myfree(biases); }
+  // View onto memory owned by someone else (e.g. the network's flat arrays):
+  Params(const int _nW, const int _nB, Real* const W, Real* const B):
+    nWeights(_nW), nBiases(_nB), weights(W), biases(B), ownsMemory(false) {}
+
+  ~Params() {
+    if(ownsMemory) { _myfree(weights); _myfree(biases); }
+  }
 
   inline void clearBias() const {
     memset(biases, 0, nBiases * sizeof(Real) );
@@ -71,34 +102,4 @@ struct Params
     for (int i=0; i<nBiases; i++) ret += biases[i];
     return ret;
   }
-
-  void save(const std::string fname) const
-  {
-    FILE* wFile=fopen(("W_"+fname+".raw").c_str(),"wb");
-    FILE* bFile=fopen(("b_"+fname+".raw").c_str(),"wb");
-    fwrite(weights, sizeof(Real), nWeights, wFile);
-    fwrite(biases,  sizeof(Real),  nBiases, bFile);
-    fflush(wFile); fflush(bFile);
-    fclose(wFile); fclose(bFile);
-  }
-
-  void restart(const std::string fname)
-  {
-    FILE* wFile=fopen(("W_"+fname+".raw").c_str(),"rb");
-    FILE* bFile=fopen(("b_"+fname+".raw").c_str(),"rb");
-
-    size_t wsize = fread(weights, sizeof(Real), nWeights, wFile);
-    fclose(wFile);
-    if((int)wsize not_eq nWeights){
-      printf("Mismatch in restarted weight file %s; container:%lu read:%d. Aborting.\n", fname.c_str(), wsize, nWeights);
-      abort();
-    }
-
-    size_t bsize = fread(biases, sizeof(Real),  nBiases, bFile);
-    fclose(bFile);
-    if((int)bsize not_eq nBiases){
-      printf("Mismatch in restarted biases file %s; container:%lu read:%d. Aborting.\n", fname.c_str(), bsize, nBiases);
-      abort();
-    }
-  }
 };
@@ -0,0 +1,77 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include <atomic>
+
+#ifdef USE_MKL
+#include "mkl_cblas.h"
+#include "mkl_service.h"
+#else
+#ifndef __STDC_VERSION__ //it should never be defined with g++
+#define __STDC_VERSION__ 0
+#endif
+#include "cblas.h"
+#endif
+
+// Number of threads used by the BLAS library for the following calls. The
+// library is only called if the number changes. Not to be called by more
+// than one thread at the time (see ExecutionContext::blasFor):
+inline void setBlasThreads(const int nThreads)
+{
+  static std::atomic<int> current(0);
+  if (current.exchange(nThreads) == nThreads) return;
+#ifdef USE_MKL
+  mkl_set_num_threads(nThreads);
+#else
+  openblas_set_num_threads(nThreads);
+#endif
+}
+
+// Type-dispatched BLAS wrappers: the floating point type of the arguments
+// selects the single (cblas_s*) or double (cblas_d*) precision routine.
+
+inline void gemm(const CBLAS_ORDER Order,
+  const CBLAS_TRANSPOSE TransA, const CBLAS_TRANSPOSE TransB,
+  const int M, const int N, const int K,
+  const double alpha, const double* const A, const int lda,
+                      const double* const B, const int ldb,
+  const double beta,        double* const C, const int ldc)
+{
+  cblas_dgemm(Order, TransA, TransB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+}
+
+inline void gemm(const CBLAS_ORDER Order,
+  const CBLAS_TRANSPOSE TransA, const CBLAS_TRANSPOSE TransB,
+  const int M, const int N, const int K,
+  const float alpha, const float* const A, const int lda,
+                     const float* const B, const int ldb,
+  const float beta,        float* const C, const int ldc)
+{
+  cblas_sgemm(Order, TransA, TransB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+}
+
+inline void gemv(const CBLAS_ORDER Order, const CBLAS_TRANSPOSE TransA,
+  const int M, const int N,
+  const double alpha, const double* const A, const int lda,
+                      const double* const X, const int incX,
+  const double beta,        double* const Y, const int incY)
+{
+  cblas_dgemv(Order, TransA, M, N, alpha, A, lda, X, incX, beta, Y, incY);
+}
+
+inline void gemv(const CBLAS_ORDER Order, const CBLAS_TRANSPOSE TransA,
+  const int M, const int N,
+  const float alpha, const float* const A, const int lda,
+                     const float* const X, const int incX,
+  const float beta,        float* const Y, const int incY)
+{
+  cblas_sgemv(Order, TransA, M, N, alpha, A, lda, X, incX, beta, Y, incY);
+}
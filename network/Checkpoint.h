@@ -0,0 +1,344 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Dataset.h"
+#include "Execution.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+template<typename Real> struct Network;
+
+// Checkpoint file: header, then the number of weights and biases of each
+// layer, the state of the network's generator as text, and the flat arrays of
+// params and, if saved by an optimizer, of the 1st and 2nd moments of the
+// grads, then the states: the number of values of the state of the layers
+// (see Layer::state) as uint64, the states of the layers one after the other,
+// and the bytes of the caller's state (e.g. of a DataLoader), if any.
+// Sections start at aligned offsets. The CRC-32 is computed over the
+// whole file, with the field crc set to zero.
+struct CheckpointHeader
+{
+  char magic[8];
+  uint32_t version, realSize, nMoments, crc;
+  uint64_t nLayers, flatSize, step, fileSize;
+  uint64_t shapesOffset, rngOffset, rngSize, paramsOffset, momentsOffset;
+  // optimizer's powers of its coefficients beta_1 and beta_2:
+  double beta1t, beta2t;
+  // states section, of statesSize bytes. Zero in older versions, whose header
+  // ended with the zeros that aligned the next section:
+  uint64_t statesOffset, statesSize;
+};
+
+static constexpr char CHECKPOINT_MAGIC[8] = {'T','D','L','L','C','K','P','T'};
+// Version 2: the powers of beta_1 and beta_2 of Optimizer are multiplied by
+// beta_1 and beta_2 at each step (version 1 squared them). Same layout.
+// Version 3: state of the layers, e.g. running statistics of BatchNorm, and
+// of the caller, e.g. the minibatches of the DataLoader.
+static constexpr uint32_t CHECKPOINT_VERSION = 3;
+
+// CRC-32 (polynomial of zlib and PNG) of n bytes, continuing from crc:
+inline uint32_t crc32(const void* const data, const size_t n, uint32_t crc = 0)
+{
+  static const std::vector<uint32_t> table = [] () {
+    std::vector<uint32_t> T(256);
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      T[i] = c;
+    }
+    return T;
+  } ();
+  const unsigned char* const D = (const unsigned char*) data;
+  crc = ~crc;
+  for (size_t i = 0; i < n; i++) crc = table[(crc ^ D[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+// Writes checkpoints with a background thread. write() copies the state into
+// a snapshot and returns, the thread then computes the CRC and writes the
+// file as fname.tmp, which is renamed to fname once complete: an interrupted
+// write never leaves a truncated checkpoint. A write waits for the previous
+// one to finish, and the destructor for the last one.
+template<typename Real>
+struct CheckpointWriter
+{
+  CheckpointHeader H;
+  std::vector<uint64_t> shapes;
+  std::string rng, fname;
+  std::vector<Real> params, moments;
+  std::vector<char> states;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool bPending = false, bStop = false;
+  std::thread writer;
+
+  CheckpointWriter() { writer = std::thread([this] () { run(); }); }
+
+  ~CheckpointWriter()
+  {
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [&] () { return not bPending; });
+      bStop = true;
+    }
+    cv.notify_all();
+    writer.join();
+  }
+
+  // Waits until the last checkpoint is on disk:
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [&] () { return not bPending; });
+  }
+
+  // Snapshot of the params of net and, if mom1st and mom2nd are not null, of
+  // the optimizer's moments (same layout as the params), step and coefficients.
+  // userState are bytes returned by CheckpointFile::userState on restart:
+  void write(const Network<Real>& net, const std::string _fname,
+    const Real* const mom1st = nullptr, const Real* const mom2nd = nullptr,
+    const size_t step = 0, const double beta1t = 0, const double beta2t = 0,
+    const std::string& userState = std::string())
+  {
+    wait();
+    static constexpr size_t align = 2 * ALIGNBYTES;
+    const auto alignUp = [](const size_t s) { return (s+align-1)/align*align; };
+    const size_t N = net.flatSize;
+
+    memset(&H, 0, sizeof(CheckpointHeader));
+    std::copy(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + 8, H.magic);
+    H.version = CHECKPOINT_VERSION;
+    H.realSize = sizeof(Real);
+    H.nMoments = mom1st not_eq nullptr && mom2nd not_eq nullptr ? 2 : 0;
+    H.nLayers = net.layers.size();
+    H.flatSize = N;
+    H.step = step;
+    H.beta1t = beta1t;
+    H.beta2t = beta2t;
+
+    shapes.assign(2 * H.nLayers, 0);
+    for (size_t j = 0; j < H.nLayers; j++) if (net.params[j] not_eq nullptr) {
+      shapes[2*j +0] = net.params[j]->nWeights;
+      shapes[2*j +1] = net.params[j]->nBiases;
+    }
+    std::ostringstream oss;
+    oss << net.gen;
+    rng = oss.str();
+
+    H.shapesOffset  = alignUp(sizeof(CheckpointHeader));
+    H.rngOffset     = alignUp(H.shapesOffset + shapes.size()*sizeof(uint64_t));
+    H.rngSize       = rng.size();
+    H.paramsOffset  = alignUp(H.rngOffset + H.rngSize);
+    H.momentsOffset = alignUp(H.paramsOffset + N * sizeof(Real));
+    const size_t endMoments = H.momentsOffset + H.nMoments * N * sizeof(Real);
+    uint64_t nStates = 0;
+    for (const auto& l : net.layers) nStates += l->stateSize();
+    H.statesSize = nStates == 0 && userState.empty() ? 0 : sizeof(uint64_t)
+                   + nStates * sizeof(Real) + userState.size();
+    H.statesOffset  = H.statesSize ? alignUp(endMoments) : endMoments;
+    H.fileSize      = H.statesOffset + H.statesSize;
+
+    params.assign(net.flatParams, net.flatParams + N);
+    moments.resize(H.nMoments * N);
+    if (H.nMoments) {
+      std::copy(mom1st, mom1st + N, moments.begin());
+      std::copy(mom2nd, mom2nd + N, moments.begin() + N);
+    }
+    states.resize(H.statesSize);
+    if (H.statesSize) {
+      memcpy(states.data(), &nStates, sizeof(uint64_t));
+      Real* S = (Real*) (states.data() + sizeof(uint64_t));
+      for (const auto& l : net.layers)
+        S = std::copy(l->state(), l->state() + l->stateSize(), S);
+      std::copy(userState.begin(), userState.end(), (char*) S);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      fname = _fname;
+      bPending = true;
+    }
+    cv.notify_all();
+  }
+
+  void run()
+  {
+    // not pinned to the CPU of the master thread that created it:
+    ExecutionContext::unpin();
+    while (true)
+    {
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] () { return bStop || bPending; });
+        if (bStop) return;
+      }
+      writeFile();
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        bPending = false;
+      }
+      cv.notify_all();
+    }
+  }
+
+  // Sections of the file in order, with the zeros that align them:
+  template<typename Func> void forEachSection(const Func& f) const
+  {
+    static const std::vector<char> zeros(2 * ALIGNBYTES, 0);
+    size_t offset = 0;
+    const auto section = [&] (const size_t start, const void* ptr, size_t n) {
+      f(zeros.data(), start - offset);
+      f(ptr, n);
+      offset = start + n;
+    };
+    section(0, &H, sizeof(CheckpointHeader));
+    section(H.shapesOffset, shapes.data(), shapes.size() * sizeof(uint64_t));
+    section(H.rngOffset, rng.data(), rng.size());
+    section(H.paramsOffset, params.data(), params.size() * sizeof(Real));
+    section(H.momentsOffset, moments.data(), moments.size() * sizeof(Real));
+    section(H.statesOffset, states.data(), states.size());
+    assert(offset == H.fileSize);
+  }
+
+  void writeFile()
+  {
+    uint32_t crc = 0;
+    forEachSection([&] (const void* p, size_t n) { crc = crc32(p, n, crc); });
+    H.crc = crc;
+
+    const std::string tmp = fname + ".tmp";
+    FILE* pFile = fopen(tmp.c_str(), "wb");
+    if(pFile == nullptr) {
+      printf("Unable to write checkpoint %s. Aborting.\n", tmp.c_str()); abort();
+    }
+    size_t written = 0, total = 0;
+    forEachSection([&] (const void* p, size_t n) {
+      written += fwrite(p, 1, n, pFile);
+      total += n;
+    });
+    if(fflush(pFile) not_eq 0 || fclose(pFile) not_eq 0 || written not_eq total
+       || rename(tmp.c_str(), fname.c_str()) not_eq 0) {
+      printf("Failed writing checkpoint %s. Aborting.\n", fname.c_str()); abort();
+    }
+  }
+};
+
+// Checkpoint file mapped in memory, checked at construction. Pages are read
+// from disk when the CRC is computed, and when restored if it is not.
+template<typename Real>
+struct CheckpointFile
+{
+  const MappedFile file;
+  const CheckpointHeader& H = * (const CheckpointHeader*) file.data;
+
+  CheckpointFile(const std::string fname, const bool verify = true) :
+    file(fname)
+  {
+    if(file.size < sizeof(CheckpointHeader) ||
+       not std::equal(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + 8, H.magic) ||
+       H.version < 1 || H.version > CHECKPOINT_VERSION || file.size not_eq H.fileSize ||
+       H.statesOffset + H.statesSize > H.fileSize || (H.statesSize &&
+       (H.statesSize < sizeof(uint64_t) ||
+        H.statesSize < sizeof(uint64_t) + nStates() * sizeof(Real)))) {
+      printf("Invalid checkpoint file %s. Aborting.\n", fname.c_str()); abort();
+    }
+    if(H.realSize not_eq sizeof(Real)) {
+      printf("Checkpoint %s has %u-byte params, expected %lu. Aborting.\n",
+        fname.c_str(), H.realSize, sizeof(Real)); abort();
+    }
+    if(verify) {
+      CheckpointHeader header = H;
+      header.crc = 0;
+      const uint32_t crc = crc32(file.data + sizeof(CheckpointHeader),
+        file.size - sizeof(CheckpointHeader),
+        crc32(&header, sizeof(CheckpointHeader)));
+      if(crc not_eq H.crc) {
+        printf("Corrupted checkpoint %s. Aborting.\n", fname.c_str()); abort();
+      }
+    }
+  }
+
+  const Real* params() const {
+    return (const Real*) (file.data + H.paramsOffset);
+  }
+  const Real* moment(const int i) const {
+    assert(i < (int) H.nMoments);
+    return (const Real*) (file.data + H.momentsOffset) + i * H.flatSize;
+  }
+  // Number of values of the layers' state, zero if not saved:
+  uint64_t nStates() const {
+    return H.statesSize ? * (const uint64_t*) (file.data + H.statesOffset) : 0;
+  }
+  const Real* states() const {
+    return (const Real*) (file.data + H.statesOffset + sizeof(uint64_t));
+  }
+  // Bytes of the caller's state, given to CheckpointWriter::write:
+  std::string userState() const {
+    if (H.statesSize == 0) return std::string();
+    const char* const begin = (const char*) (states() + nStates());
+    return std::string(begin, (const char*) file.data + H.statesOffset
+                                                      + H.statesSize);
+  }
+
+  // Copies the params, the layers' state and the generator's state onto net,
+  // whose layers must have the same number of weights and biases as those
+  // saved, and, if not null, the moments onto mom1st and mom2nd. Checkpoints
+  // without layers' state leave it as it is:
+  void restore(Network<Real>& net, Real* const mom1st = nullptr,
+               Real* const mom2nd = nullptr) const
+  {
+    const uint64_t* const shapes =
+      (const uint64_t*) (file.data + H.shapesOffset);
+    bool match = H.nLayers == net.layers.size() && H.flatSize == net.flatSize;
+    for (size_t j = 0; match && j < H.nLayers; j++) {
+      const Params<Real>* const P = net.params[j];
+      match = shapes[2*j +0] == (P == nullptr ? 0 : (uint64_t) P->nWeights) &&
+              shapes[2*j +1] == (P == nullptr ? 0 : (uint64_t) P->nBiases);
+    }
+    size_t statesSize = 0;
+    for (const auto& l : net.layers) statesSize += l->stateSize();
+    match = match && (nStates() == 0 || nStates() == statesSize);
+    if(not match) {
+      printf("Checkpoint does not match the network's layers. Aborting.\n");
+      abort();
+    }
+    const bool bMoments = mom1st not_eq nullptr && mom2nd not_eq nullptr;
+    if(bMoments && H.nMoments < 2) {
+      printf("Checkpoint has no optimizer state. Aborting.\n"); abort();
+    }
+
+    const size_t N = H.flatSize;
+    const Real* const P = params();
+    // copied in parallel: threads fault in different pages of the mapping
+    #pragma omp parallel for simd schedule(static)
+    for (size_t i = 0; i < N; i++) net.flatParams[i] = P[i];
+    net.paramsChanged();
+    if(bMoments) {
+      const Real* const M1 = moment(0), * const M2 = moment(1);
+      #pragma omp parallel for simd schedule(static)
+      for (size_t i = 0; i < N; i++) { mom1st[i] = M1[i]; mom2nd[i] = M2[i]; }
+    }
+    if(nStates()) {
+      const Real* S = states();
+      for (const auto& l : net.layers) {
+        std::copy(S, S + l->stateSize(), l->state());
+        S += l->stateSize();
+      }
+      // the workspace is planned again: the state may change which layers
+      // run in place, e.g. that of folded batch normalizations
+      net.clearWorkspace();
+    }
+    std::istringstream iss(std::string(
+      (const char*) file.data + H.rngOffset, H.rngSize));
+    iss >> net.gen;
+  }
+};
@@ -0,0 +1,144 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Dataset.h"
+#include "Execution.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Prepares minibatches of a dataset with a dedicated thread, while the caller
+// trains on the previous ones. The thread shuffles the samples at the start of
+// each epoch (an epoch is nSamples/batchSize minibatches, remaining samples
+// are skipped) and gathers them in a ring of nBuffers minibatches. The thread
+// does not use the OpenMP team of the caller: it gathers serially.
+// The permutation of each epoch depends only on the seed and on the epoch:
+// a loader created from the state() of another, e.g. saved with a checkpoint,
+// returns the same minibatches that the other would have returned next.
+// With data parallelism, each of nShards ranks creates a loader with the same
+// seed, hence the same minibatches, and gathers only the batchSize/nShards
+// samples of its shard of each minibatch.
+template<typename Real>
+struct DataLoader
+{
+  struct Batch
+  {
+    // row-major matrix of size [shardSize]x[sampleSize]:
+    Real* const inputs;
+    // one label per sample of the shard:
+    int* const labels;
+  };
+
+  // Seed of the permutations and number of minibatches returned by next,
+  // counting those of previous runs. All that is needed to resume:
+  struct State { uint64_t seed, step; };
+
+  const MappedDataset<Real>& data;
+  const int batchSize, nBuffers, stepsPerEpoch;
+  // Samples of each minibatch gathered by this loader:
+  const int shardSize, shardBegin;
+  const State start;
+  std::vector<Batch> ring;
+
+  std::mutex mtx;
+  std::condition_variable produced, released;
+  // Counters of batches written by the thread, handed to the caller by next,
+  // and released by the caller (by calling next again):
+  size_t nProduced = 0, nReturned = 0, nReleased = 0;
+  bool bStop = false;
+  std::thread producer;
+
+  DataLoader(const MappedDataset<Real>& _data, const int _batchSize,
+             const int seed, const int _nBuffers = 2, const int shard = 0,
+             const int nShards = 1) : DataLoader(_data, _batchSize,
+    State{(uint64_t) seed, 0}, _nBuffers, shard, nShards) {}
+
+  // Resumes the minibatches of the loader whose state() was _start:
+  DataLoader(const MappedDataset<Real>& _data, const int _batchSize,
+             const State _start, const int _nBuffers = 2, const int shard = 0,
+             const int nShards = 1) : data(_data),
+    batchSize(_batchSize), nBuffers(_nBuffers),
+    stepsPerEpoch(_data.nSamples / _batchSize),
+    shardSize(_batchSize / nShards), shardBegin(shard * shardSize),
+    start(_start)
+  {
+    assert(stepsPerEpoch > 0 && nBuffers > 0);
+    assert(batchSize % nShards == 0 && shard >= 0 && shard < nShards);
+    for (int i = 0; i < nBuffers; i++)
+      ring.push_back({_myalloc<Real>(shardSize * data.sampleSize),
+                      _myalloc<int>(shardSize)});
+    producer = std::thread([this] () { produce(); });
+  }
+
+  ~DataLoader()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      bStop = true;
+    }
+    released.notify_one();
+    producer.join();
+    for (auto& b : ring) { _myfree(b.inputs); _myfree(b.labels); }
+  }
+
+  // Returns the next minibatch. It remains valid until the next call.
+  const Batch& next()
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    // the batch returned by the previous call can be overwritten:
+    if (nReleased < nReturned) {
+      nReleased = nReturned;
+      released.notify_one();
+    }
+    produced.wait(lock, [&] () { return nProduced > nReturned; });
+    return ring[nReturned++ % nBuffers];
+  }
+
+  // Called by the thread that calls next:
+  State state() const { return {start.seed, start.step + nReturned}; }
+
+  void produce()
+  {
+    // one thread: OpenMP regions of gather do not compete with the caller's,
+    // and not pinned to the CPU of the caller's master thread:
+    omp_set_num_threads(1);
+    ExecutionContext::unpin();
+    std::vector<int> sample_ids(data.nSamples);
+
+    for (size_t i = 0; ; i++)
+    {
+      const size_t step = start.step + i;
+      if (i == 0 || step % stepsPerEpoch == 0) {
+        std::seed_seq seq{start.seed, (uint64_t) (step / stepsPerEpoch)};
+        std::mt19937 gen(seq);
+        std::iota(sample_ids.begin(), sample_ids.end(), 0);
+        std::shuffle(sample_ids.begin(), sample_ids.end(), gen);
+      }
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        released.wait(lock, [&] () {
+          return bStop || nProduced - nReleased < (size_t) nBuffers;
+        });
+        if (bStop) return;
+      }
+      // memory of batch nProduced is not accessed by the caller:
+      const Batch& B = ring[i % nBuffers];
+      const int* const ids = & sample_ids[(step % stepsPerEpoch) * batchSize
+                                          + shardBegin];
+      data.gather(ids, shardSize, B.inputs, B.labels);
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        nProduced++;
+      }
+      produced.notify_one();
+    }
+  }
+};
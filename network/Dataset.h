@@ -0,0 +1,196 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Utils.h"
+#include <cstdint>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Read-only memory map of a whole file. Pages are read from disk only when
+// touched, and the OS can drop them when memory is needed.
+struct MappedFile
+{
+  size_t size = 0;
+  const unsigned char* data = nullptr;
+
+  MappedFile(const std::string fname)
+  {
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if(fd < 0) {
+      printf("Unable to open file %s. Aborting.\n", fname.c_str()); abort();
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size = st.st_size;
+    void* const ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // mapping stays valid
+    if(ptr == MAP_FAILED) {
+      printf("Unable to map file %s. Aborting.\n", fname.c_str()); abort();
+    }
+    data = (const unsigned char*) ptr;
+  }
+
+  ~MappedFile() { munmap((void*) data, size); }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+};
+
+// Packed dataset file: header, then one int32 label per sample, then one row
+// per sample. Rows have fixed stride and start at aligned offsets. Values are
+// either uint8 or float, and are multiplied by `scale` when gathered (e.g.
+// 1/255 to map pixels to [0, 1]).
+struct DatasetHeader
+{
+  char magic[8];
+  uint32_t version, type; // type 0: uint8, type 1: float
+  uint64_t nSamples, sampleSize, rowStride, labelsOffset, rowsOffset;
+  double scale;
+};
+
+static constexpr char DATASET_MAGIC[8] = {'T','D','L','L','D','A','T','A'};
+static constexpr uint32_t DATASET_VERSION = 1;
+
+template<typename T> struct DatasetType;
+template<> struct DatasetType<uint8_t> { static constexpr uint32_t id = 0; };
+template<> struct DatasetType<float>   { static constexpr uint32_t id = 1; };
+
+// Writes nSamples rows of sampleSize values, with their labels, to fname. The
+// file is written as fname.tmp and renamed once complete: a process that finds
+// fname never maps a file still being written.
+template<typename T>
+void writeDataset(const std::string fname, const size_t nSamples,
+  const size_t sampleSize, const T* const rows, const int32_t* const labels,
+  const double scale)
+{
+  static constexpr size_t align = 2 * ALIGNBYTES;
+  const auto alignUp = [](const size_t s) { return (s+align-1)/align*align; };
+
+  DatasetHeader H;
+  std::copy(DATASET_MAGIC, DATASET_MAGIC + 8, H.magic);
+  H.version = DATASET_VERSION;
+  H.type = DatasetType<T>::id;
+  H.nSamples = nSamples;
+  H.sampleSize = sampleSize;
+  H.rowStride = alignUp(sampleSize * sizeof(T));
+  H.labelsOffset = alignUp(sizeof(DatasetHeader));
+  H.rowsOffset = alignUp(H.labelsOffset + nSamples * sizeof(int32_t));
+  H.scale = scale;
+
+  const std::string tmp = fname + ".tmp";
+  FILE* pFile = fopen(tmp.c_str(), "wb");
+  if(pFile == nullptr) {
+    printf("Unable to write dataset %s. Aborting.\n", tmp.c_str()); abort();
+  }
+  const std::vector<char> zeros(align, 0);
+  fwrite(&H, sizeof(DatasetHeader), 1, pFile);
+  fwrite(zeros.data(), 1, H.labelsOffset - sizeof(DatasetHeader), pFile);
+  fwrite(labels, sizeof(int32_t), nSamples, pFile);
+  fwrite(zeros.data(), 1, H.rowsOffset - H.labelsOffset
+                          - nSamples * sizeof(int32_t), pFile);
+  for (size_t i = 0; i < nSamples; i++) {
+    fwrite(rows + i * sampleSize, sizeof(T), sampleSize, pFile);
+    fwrite(zeros.data(), 1, H.rowStride - sampleSize * sizeof(T), pFile);
+  }
+  if(ferror(pFile) || fflush(pFile) not_eq 0 || fclose(pFile) not_eq 0 ||
+     rename(tmp.c_str(), fname.c_str()) not_eq 0) {
+    printf("Failed writing dataset %s. Aborting.\n", fname.c_str()); abort();
+  }
+}
+
+// Packs a pair of images and labels files in the idx format (e.g. MNIST) into
+// a uint8 dataset with scale 1/255. Nothing is done if fname already exists.
+// With several MPI ranks, one rank packs and the others wait before mapping.
+inline void packIDX(const std::string images, const std::string labels,
+                    const std::string fname)
+{
+  if(access(fname.c_str(), F_OK) == 0) return;
+
+  const MappedFile IMG(images), LBL(labels);
+  // idx header: magic number and sizes, as big-endian uint32
+  const auto readU32 = [](const unsigned char* const p) {
+    return (uint32_t) p[0]<<24 | (uint32_t) p[1]<<16 | (uint32_t) p[2]<<8 | p[3];
+  };
+  if(IMG.size < 16 || readU32(IMG.data) not_eq 0x803 ||
+     LBL.size <  8 || readU32(LBL.data) not_eq 0x801) {
+    printf("Invalid idx files %s %s. Aborting.\n", images.c_str(), labels.c_str());
+    abort();
+  }
+  const size_t nSamples = readU32(IMG.data + 4);
+  const size_t sampleSize = readU32(IMG.data + 8) * readU32(IMG.data + 12);
+  if(readU32(LBL.data + 4) not_eq nSamples ||
+     IMG.size < 16 + nSamples * sampleSize || LBL.size < 8 + nSamples) {
+    printf("Mismatched idx files %s %s. Aborting.\n", images.c_str(), labels.c_str());
+    abort();
+  }
+
+  const std::vector<int32_t> L(LBL.data + 8, LBL.data + 8 + nSamples);
+  writeDataset<uint8_t>(fname, nSamples, sampleSize, IMG.data + 16, L.data(), 1/255.0);
+}
+
+// Dataset file mapped in memory. Samples are converted to Real only when
+// gathered, directly in the memory where they are used (e.g. the workspace of
+// the input layer of the network).
+template<typename Real>
+struct MappedDataset
+{
+  const MappedFile file;
+  const DatasetHeader& H = * (const DatasetHeader*) file.data;
+  const int nSamples, sampleSize;
+
+  MappedDataset(const std::string fname) : file(fname),
+    nSamples(checkHeader(fname)), sampleSize(H.sampleSize) {}
+
+  int checkHeader(const std::string& fname) const
+  {
+    if(file.size < sizeof(DatasetHeader) ||
+       not std::equal(DATASET_MAGIC, DATASET_MAGIC + 8, H.magic) ||
+       H.version not_eq DATASET_VERSION || H.type > 1 ||
+       file.size < H.rowsOffset + H.nSamples * H.rowStride) {
+      printf("Invalid dataset file %s. Aborting.\n", fname.c_str()); abort();
+    }
+    return H.nSamples;
+  }
+
+  int label(const int sample) const {
+    assert(sample >= 0 && sample < nSamples);
+    return ((const int32_t*) (file.data + H.labelsOffset))[sample];
+  }
+
+  // Writes samples ids[0], ..., ids[n-1] as the rows of the row-major matrix
+  // out of size [n][sampleSize] and, if labels is not null, their labels.
+  void gather(const int* const ids, const int n, Real* const out,
+              int* const labels = nullptr) const
+  {
+    if(H.type == DatasetType<uint8_t>::id) gatherT<uint8_t>(ids,n,out,labels);
+    else                                   gatherT<float  >(ids,n,out,labels);
+  }
+
+  template<typename T>
+  void gatherT(const int* const ids, const int n, Real* const out,
+               int* const labels) const
+  {
+    const Real fac = H.scale;
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++)
+    {
+      assert(ids[i] >= 0 && ids[i] < nSamples);
+      const T* const row =
+        (const T*) (file.data + H.rowsOffset + ids[i] * H.rowStride);
+      Real* const O = out + (size_t) i * sampleSize;
+      for (int j = 0; j < sampleSize; j++) O[j] = row[j] * fac;
+      if(labels not_eq nullptr) labels[i] = label(ids[i]);
+    }
+  }
+};
@@ -0,0 +1,105 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Layers.h"
+
+// Data-parallel training over MPI ranks, each holding a replica of the
+// network and computing the gradient of its own shard of the minibatch.
+// Network::bckward calls ready() after the bckward of each layer, from the
+// last layer to the first. Since the grads of the layers are stored in order
+// in the flat array, the grads that are ready always are the end of the
+// array: once they are at least `bucketSize` values past the last bucket,
+// they are summed over the ranks by a non-blocking allreduce, while bckward
+// continues with the layers below. finish() reduces the last bucket and
+// waits for all of them, after which each rank holds the summed gradient.
+// Enabled by compiling with -DUSE_MPI (`make mpi=1`) and calling
+// Network::distribute, otherwise all its functions are empty.
+#ifdef USE_MPI
+#include <mpi.h>
+
+template<typename Real>
+struct GradientAllreduce
+{
+  MPI_Comm comm = MPI_COMM_NULL;
+  int rank = 0, nRanks = 1;
+  // Number of grads reduced by each allreduce (but the last of bckward):
+  size_t bucketSize = (1 << 20) / sizeof(Real);
+
+  Real* flatGrads = nullptr;
+  // Grads in [readyBegin, bucketEnd) are ready and not yet reduced:
+  size_t readyBegin = 0, bucketEnd = 0;
+  std::vector<MPI_Request> requests;
+
+  static MPI_Datatype datatype() {
+    return sizeof(Real) == sizeof(float) ? MPI_FLOAT : MPI_DOUBLE;
+  }
+
+  bool active() const { return comm not_eq MPI_COMM_NULL && nRanks > 1; }
+
+  void init(const MPI_Comm _comm, Real* const _flatGrads)
+  {
+    comm = _comm;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nRanks);
+    flatGrads = _flatGrads;
+  }
+
+  // Called before the bckward of the last layer:
+  void begin(const size_t flatSize)
+  {
+    if (not active()) return;
+    assert(requests.empty());
+    readyBegin = bucketEnd = flatSize;
+  }
+
+  // Called after the bckward of a layer whose grads are `grad`, if any:
+  void ready(const Params<Real>* const grad)
+  {
+    if (not active() || grad == nullptr) return;
+    readyBegin = grad->weights - flatGrads;
+    if (bucketEnd - readyBegin >= bucketSize) reduceBucket();
+    // let the library progress the reductions already started:
+    int done = 0;
+    if (requests.size())
+      MPI_Testall(requests.size(), requests.data(), &done, MPI_STATUSES_IGNORE);
+  }
+
+  // Called after the bckward of the first layer:
+  void finish()
+  {
+    if (not active()) return;
+    if (bucketEnd > readyBegin) reduceBucket();
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+    requests.clear();
+  }
+
+  void reduceBucket()
+  {
+    requests.push_back(MPI_REQUEST_NULL);
+    MPI_Iallreduce(MPI_IN_PLACE, flatGrads + readyBegin, bucketEnd-readyBegin,
+      datatype(), MPI_SUM, comm, & requests.back());
+    bucketEnd = readyBegin;
+  }
+};
+
+#else
+
+template<typename Real>
+struct GradientAllreduce
+{
+  int rank = 0, nRanks = 1;
+  bool active() const { return false; }
+  void begin(const size_t) {}
+  void ready(const Params<Real>* const) {}
+  void finish() {}
+};
+
+#endif
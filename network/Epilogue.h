@@ -0,0 +1,219 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Blas.h"
+
+// Element-wise activation that a Linear or convolution layer applies after its
+// bias, when it is followed by a LReLu or Tanh layer (see Layer::epilogue).
+enum class Epilogue { None, LReLu, Tanh };
+
+// Bias and activation applied to a block of outputs right after the product
+// that computed it, while the block is still in cache, and the matching
+// derivative applied to a block of gradients before the products of bckward.
+template<typename Real>
+struct FusedEpilogue
+{
+  static constexpr Real leak = 0.1;
+
+  // O[r][c] = f(O[r][c] + B[c]) for nRows rows of nCols values:
+  static void forward(const Epilogue E, Real*const __restrict__ O,
+    const Real*const __restrict__ B, const int nRows, const int nCols)
+  {
+    switch (E) {
+      case Epilogue::None:
+        apply(O, B, nRows, nCols, [](const Real x) { return x; }); break;
+      case Epilogue::LReLu:
+        apply(O, B, nRows, nCols, [](const Real x) {
+          return x > 0 ? x : leak * x; }); break;
+      case Epilogue::Tanh:
+        apply(O, B, nRows, nCols, [](const Real x) {
+          return std::tanh(x); }); break;
+    }
+  }
+
+  // D[r][c] *= f'(input), computed from the output O[r][c] as the separate
+  // activation layers do, and sumD[c] += D[r][c] (the gradient of the bias):
+  static void bckward(const Epilogue E, Real*const __restrict__ D,
+    const Real*const __restrict__ O, Real*const __restrict__ sumD,
+    const int nRows, const int nCols)
+  {
+    switch (E) {
+      case Epilogue::None: // O is not read, it may have been overwritten
+        for (int r = 0; r < nRows; r++) {
+          #pragma omp simd
+          for (int c = 0; c < nCols; c++) sumD[c] += D[r*nCols + c];
+        }
+        break;
+      case Epilogue::LReLu:
+        diff(D, O, sumD, nRows, nCols, [](const Real y) {
+          return y > 0 ? 1 : leak; }); break;
+      case Epilogue::Tanh:
+        diff(D, O, sumD, nRows, nCols, [](const Real y) {
+          return 1 - y*y; }); break;
+    }
+  }
+
+  // O = f(I W + B) with I: [nRows][nInp], W: [nInp][nOut], O: [nRows][nOut].
+  // If there are enough rows for all threads, each thread multiplies blocks
+  // of rows and finishes each block while it is in cache. Otherwise one
+  // product is threaded by the BLAS library, followed by the epilogue.
+  static int gemmBlockRows(const int nRows, const int nOut)
+  {
+    static constexpr int blockBytes = 1 << 15;
+    const int nThreads = omp_get_max_threads();
+    return std::min(std::max(gemmMinRows, blockBytes/(nOut*(int)sizeof(Real))),
+                    (nRows + nThreads - 1) / nThreads);
+  }
+  static constexpr int gemmMinRows = 8;
+
+  // Whether gemmForward calls BLAS from each thread (else from the master):
+  static bool gemmInParallel(const int nRows, const int nOut)
+  {
+    return gemmBlockRows(nRows, nOut) >= gemmMinRows;
+  }
+
+  static void gemmForward(const Epilogue E, const int nRows, const int nInp,
+    const int nOut, const Real*const I, const Real*const W,
+    const Real*const B, Real*const O)
+  {
+    if (nRows == 1) // single sample: O^T = W^T I^T, a matrix-vector product
+    {
+      gemv(CblasRowMajor, CblasTrans, nInp, nOut, (Real) 1.0, W, nOut, I, 1,
+        (Real) 0.0, O, 1);
+      forward(E, O, B, 1, nOut);
+      return;
+    }
+    const int blockRows = gemmBlockRows(nRows, nOut);
+    if (blockRows < gemmMinRows)
+    {
+      gemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, nRows, nOut, nInp,
+        (Real) 1.0, I, nInp, W, nOut, (Real) 0.0, O, nOut);
+      #pragma omp parallel for schedule(static)
+      for (int r = 0; r < nRows; r++) forward(E, O + (size_t) r*nOut, B, 1, nOut);
+      return;
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int r0 = 0; r0 < nRows; r0 += blockRows)
+    {
+      const int n = std::min(blockRows, nRows - r0);
+      gemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, n, nOut, nInp,
+        (Real) 1.0, I + (size_t) r0*nInp, nInp, W, nOut,
+        (Real) 0.0, O + (size_t) r0*nOut, nOut);
+      forward(E, O + (size_t) r0*nOut, B, n, nOut);
+    }
+  }
+
+  // Applies bckward to D: [nRows][nOut] and writes the sum of its rows, the
+  // gradient of the bias, onto gradB. Each thread sums a contiguous range of
+  // rows onto its own partial sum, then partial sums are added in a tree.
+  // Rows are summed `k` at a time, as rows of a [nRows/k][k*nOut] matrix, so
+  // that the vectorized loop over columns is long even for few channels and
+  // no index modulo nOut is needed. The k sums of each column are then added.
+  // The partial sums are a buffer of the calling thread kept between calls
+  // (see _scratch), its callers hold no other buffer of slot 0.
+  static void bckwardBias(const Epilogue E, const int nRows, const int nOut,
+    Real*const D, const Real*const O, Real*const gradB)
+  {
+    static constexpr int minWidth = 64;
+    const int k = std::max(1, minWidth / nOut), width = k * nOut;
+    const int nGroups = nRows / k, nThreads = omp_get_max_threads();
+    const size_t ld = _alignedSize<Real>(width);
+    Real* const partial = _scratch<Real>(0, nThreads * ld);
+
+    #pragma omp parallel num_threads(nThreads)
+    {
+      const int t = omp_get_thread_num(), nT = omp_get_num_threads();
+      Real* const sum = partial + t * ld;
+      std::fill(sum, sum + width, 0);
+
+      const int g0 = (size_t) nGroups * t / nT;
+      const int g1 = (size_t) nGroups * (t+1) / nT;
+      const size_t i0 = (size_t) g0 * width;
+      bckward(E, D + i0, O + i0, sum, g1 - g0, width);
+      if (t == nT-1 && nGroups * k < nRows) { // remaining nRows % k rows:
+        const size_t i1 = (size_t) nGroups * width;
+        bckward(E, D + i1, O + i1, sum, nRows - nGroups * k, nOut);
+      }
+      for (int j = 1; j < k; j++) {
+        #pragma omp simd
+        for (int c = 0; c < nOut; c++) sum[c] += sum[j*nOut + c];
+      }
+
+      for (int stride = 1; stride < nT; stride *= 2) {
+        #pragma omp barrier
+        if (t % (2*stride) == 0 && t + stride < nT) {
+          const Real* const other = partial + (t + stride) * ld;
+          #pragma omp simd
+          for (int c = 0; c < nOut; c++) sum[c] += other[c];
+        }
+      }
+    }
+
+    std::copy(partial, partial + nOut, gradB);
+  }
+
+  // Called by every thread of a parallel region once thread t wrote its
+  // partial sums onto parts[t]: writes the sum of the n values starting at
+  // offset of all the parts onto dst. Each thread adds a contiguous range of
+  // the n columns over all the parts, so the reduction is spread over the
+  // team instead of serialized.
+  static void reduceParts(const Real*const*const parts, const size_t offset,
+    const size_t n, Real*const __restrict__ dst)
+  {
+    const int t = omp_get_thread_num(), nT = omp_get_num_threads();
+    #pragma omp barrier
+    const size_t i0 = n * t / nT, i1 = n * (t+1) / nT;
+    std::copy(parts[0] + offset + i0, parts[0] + offset + i1, dst + i0);
+    for (int k = 1; k < nT; k++) {
+      const Real*const __restrict__ P = parts[k] + offset;
+      #pragma omp simd
+      for (size_t i = i0; i < i1; i++) dst[i] += P[i];
+    }
+  }
+
+  // O[r][c] += B[c] for a matrix O: [nRows][nOut], threaded over rows:
+  static void addBias(const int nRows, const int nOut,
+    const Real*const B, Real*const O)
+  {
+    static constexpr int blockRows = 64;
+    #pragma omp parallel for schedule(static)
+    for (int r0 = 0; r0 < nRows; r0 += blockRows)
+      forward(Epilogue::None, O + (size_t) r0*nOut, B,
+              std::min(blockRows, nRows - r0), nOut);
+  }
+
+  template<typename Func>
+  static inline void apply(Real*const __restrict__ O,
+    const Real*const __restrict__ B, const int nRows, const int nCols,
+    const Func& f)
+  {
+    for (int r = 0; r < nRows; r++) {
+      #pragma omp simd
+      for (int c = 0; c < nCols; c++)
+        O[r*nCols + c] = f(O[r*nCols + c] + B[c]);
+    }
+  }
+
+  template<typename Func>
+  static inline void diff(Real*const __restrict__ D,
+    const Real*const __restrict__ O, Real*const __restrict__ sumD,
+    const int nRows, const int nCols, const Func& df)
+  {
+    for (int r = 0; r < nRows; r++) {
+      #pragma omp simd
+      for (int c = 0; c < nCols; c++) {
+        D[r*nCols + c] *= (Real) df(O[r*nCols + c]);
+        sumD[c] += D[r*nCols + c];
+      }
+    }
+  }
+};
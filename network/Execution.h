@@ -0,0 +1,139 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Utils.h"
+#include "Blas.h"
+#include <sched.h>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+// How the network's threads run on the machine:
+// - The OpenMP runtime keeps its team of threads alive between parallel
+//   regions. If requested, by setting TDLL_PIN_THREADS=1 or by calling
+//   pinThreads, each thread of the team is pinned to one of the CPUs the
+//   process may run on, so that it keeps its caches and, on NUMA systems, its
+//   memory node. Affinity is process-wide: it is not changed otherwise, nor
+//   if the user placed the threads with OMP_PROC_BIND, nor if other ranks of
+//   MPI run on the same node, which may share the CPUs of the process.
+// - The BLAS library has its own threads. Layers that call BLAS from each of
+//   their threads (see Layer::blasInParallel) run it single-threaded, the
+//   others with as many threads as the team, never both at the same time.
+// - Buffers are first touched (zeroed) in parallel with a static schedule
+//   over their rows, as used by the kernels, instead of by the master thread,
+//   so that the pages are placed on the memory node of the thread using them.
+struct ExecutionContext
+{
+  ExecutionContext() { pinIfRequested(); }
+
+  // CPUs the process may run on, as found before pinning any thread:
+  static const cpu_set_t& processMask()
+  {
+    static const cpu_set_t mask = [] () {
+      cpu_set_t M;
+      CPU_ZERO(&M);
+      sched_getaffinity(0, sizeof(cpu_set_t), &M);
+      return M;
+    } ();
+    return mask;
+  }
+
+  // Number of processes of the job on this node, as set by the launchers of
+  // Open MPI, MPICH and Slurm, else 1, or 0 if unknown but MPI runs on more
+  // than one rank:
+  static int ranksOnNode()
+  {
+    for (const char* const var : {"OMPI_COMM_WORLD_LOCAL_SIZE",
+         "MPI_LOCALNRANKS", "PMI_LOCAL_SIZE", "SLURM_NTASKS_PER_NODE"}) {
+      const char* const val = getenv(var);
+      if (val not_eq nullptr && atoi(val) > 0) return atoi(val);
+    }
+#ifdef USE_MPI
+    int initialized = 0, nRanks = 1;
+    MPI_Initialized(&initialized);
+    if (initialized) MPI_Comm_size(MPI_COMM_WORLD, &nRanks);
+    if (nRanks > 1) return 0;
+#endif
+    return 1;
+  }
+
+  // Pins the team if TDLL_PIN_THREADS is set and not 0:
+  static void pinIfRequested()
+  {
+    const char* const val = getenv("TDLL_PIN_THREADS");
+    if (val not_eq nullptr && strcmp(val, "0") not_eq 0) pinThreads();
+  }
+
+  // Pins thread t of the team to the t-th CPU of the process' affinity mask.
+  // Done once per team size: the runtime reuses the same threads.
+  static void pinThreads()
+  {
+    static int pinnedTeam = 0;
+    const int nThreads = omp_get_max_threads();
+    if (omp_in_parallel() || getenv("OMP_PROC_BIND") not_eq nullptr ||
+        omp_get_proc_bind() not_eq omp_proc_bind_false ||
+        nThreads == pinnedTeam) return;
+    // ranks bound to a socket, or not at all, share their mask: each would
+    // pin its team to the same first CPUs
+    if (ranksOnNode() not_eq 1) return;
+
+    const cpu_set_t& mask = processMask();
+    std::vector<int> cpus;
+    for (int c = 0; c < CPU_SETSIZE; c++) if (CPU_ISSET(c, &mask)) cpus.push_back(c);
+    // more threads than CPUs: leave the placement to the OS
+    if ((int) cpus.size() < nThreads) return;
+
+    #pragma omp parallel num_threads(nThreads)
+    {
+      cpu_set_t own;
+      CPU_ZERO(&own);
+      CPU_SET(cpus[omp_get_thread_num()], &own);
+      sched_setaffinity(0, sizeof(cpu_set_t), &own);
+    }
+    pinnedTeam = nThreads;
+  }
+
+  // Threads created by the pinned master (e.g. of DataLoader) inherit its CPU,
+  // they call this to run on any CPU of the process instead:
+  static void unpin()
+  {
+    sched_setaffinity(0, sizeof(cpu_set_t), &processMask());
+  }
+
+  // Selects the BLAS threads for the next layer, whose calls to BLAS are
+  // made either by each thread of the team or by the master thread. Does
+  // nothing inside a parallel region, e.g. for networks run by each thread
+  // (see GradCheck), whose calls to BLAS then use one thread:
+  static void blasFor(const bool inParallel)
+  {
+    if (omp_in_parallel()) return;
+    setBlasThreads(inParallel ? 1 : omp_get_max_threads());
+  }
+
+  // Zeroes the array [nRows][nCols] with the static schedule over rows of
+  // the kernels, which places the pages of the rows used by each thread:
+  template<typename T>
+  static void firstTouch(T* const ptr, const size_t nRows, const size_t nCols)
+  {
+    #pragma omp parallel for schedule(static)
+    for (size_t r = 0; r < nRows; r++)
+      memset(ptr + r * nCols, 0, nCols * sizeof(T));
+  }
+
+  // Same for a flat array used with a static schedule over its elements, such
+  // as the params, grads and moments by the optimizers:
+  template<typename T>
+  static void firstTouch(T* const ptr, const size_t size)
+  {
+    #pragma omp parallel for simd schedule(static)
+    for (size_t i = 0; i < size; i++) ptr[i] = 0;
+  }
+};
@@ -0,0 +1,182 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Network.h"
+#include <functional>
+
+// Compares the grads computed by bckward with central finite differences.
+// The checked function is, on a random minibatch of `batchSize` inputs, the
+// loss given random labels (for networks ending with a loss layer), or else
+// the sum of all the outputs weighted by random coefficients. Parameters are
+// split among threads, each perturbing them on its own copy of the network,
+// made by calling `build`. If maxPerLayer > 0, that many parameters of each
+// layer are picked at random and the report bounds the fraction of the
+// layer's parameters whose error is above `tol`.
+template<typename Real>
+struct GradCheck
+{
+  struct Report
+  {
+    size_t nParams = 0, nChecked = 0, nFailed = 0;
+    double sumErr = 0, maxErr = 0;
+
+    double meanErr() const { return nChecked ? sumErr / nChecked : 0; }
+
+    // Upper bound, with 95% confidence, of the fraction of parameters with
+    // error above tol, from the Wilson interval of nFailed in nChecked
+    // samples. Exact if all parameters were checked:
+    double failedBound() const
+    {
+      if (nChecked == 0) return 1;
+      const double p = (double) nFailed / nChecked, n = nChecked, z = 1.96;
+      if (nChecked == nParams) return p;
+      return (p + z*z/(2*n) + z*std::sqrt(p*(1-p)/n + z*z/(4*n*n)))
+             / (1 + z*z/n);
+    }
+  };
+
+  const std::function<void(Network<Real>&)> build;
+  const bool bLoss;
+  int batchSize = 4;
+  size_t maxPerLayer = 0;
+  Real incr = std::cbrt( std::numeric_limits<Real>::epsilon() );
+  Real tol = std::cbrt( std::numeric_limits<Real>::epsilon() );
+  std::mt19937 gen;
+  // One report for each layer of the network:
+  std::vector<Report> reports;
+
+  GradCheck(const std::function<void(Network<Real>&)>& _build,
+            const bool _bLoss, const int seed = 0) :
+    build(_build), bLoss(_bLoss), gen(seed) {}
+
+  // Error of grad G wrt to finite differences D: relative if |G| or |D| are
+  // larger than one, else absolute:
+  static double error(const double G, const double D) {
+    return std::fabs(G - D) / std::max({1.0, std::fabs(G), std::fabs(D)});
+  }
+
+  // Returns the mean error over all the checked parameters:
+  double run()
+  {
+    Network<Real> NET;
+    build(NET);
+    const int nInputs = NET.nInputs, nOutputs = NET.nOutputs;
+    const size_t nLayers = NET.layers.size();
+
+    std::normal_distribution<Real> dis(0, 1);
+    std::vector<Real> input(batchSize * nInputs), coefs(batchSize * nOutputs);
+    std::generate(input.begin(), input.end(), [&]() { return dis(gen); });
+    std::generate(coefs.begin(), coefs.end(), [&]() { return dis(gen); });
+    std::vector<int> labels(batchSize);
+    std::uniform_int_distribution<int> disLabel(0, nOutputs-1);
+    std::generate(labels.begin(), labels.end(), [&]() {return disLabel(gen);});
+
+    // grads of the checked function, whose gradient wrt to the outputs is
+    // either computed by the loss layer or given by the coefficients:
+    for(auto& p: NET.grads) if(p not_eq nullptr) {p->clearBias(); p->clearWeight();}
+    NET.forward(nullptr, input.data(), batchSize);
+    if (bLoss) NET.bckward(labels.data(), batchSize);
+    else       NET.bckward(coefs.data(), batchSize);
+
+    // parameters to check, as pairs of layer ID and index of the parameter
+    // (weights first, then biases):
+    reports.assign(nLayers, Report());
+    std::vector<std::pair<int, int>> checked;
+    for (size_t j = 0; j < nLayers; j++)
+    {
+      if (NET.params[j] == nullptr) continue;
+      const int nParams = NET.params[j]->nWeights + NET.params[j]->nBiases;
+      std::vector<int> ids(nParams);
+      std::iota(ids.begin(), ids.end(), 0);
+      size_t nChecked = ids.size();
+      if (maxPerLayer > 0 && maxPerLayer < ids.size()) {
+        nChecked = maxPerLayer;
+        // first nChecked entries become a random sample:
+        for (size_t i = 0; i < nChecked; i++)
+          std::swap(ids[i], ids[std::uniform_int_distribution<size_t>(
+                                 i, ids.size()-1)(gen)]);
+      }
+      for (size_t i = 0; i < nChecked; i++) checked.push_back({(int) j, ids[i]});
+      reports[j].nParams = nParams;
+    }
+
+    // each thread checks parameters on its own copy of the network, whose
+    // layers then run serially, as does BLAS:
+    std::vector<double> errors(checked.size());
+    ExecutionContext::blasFor(true);
+    #pragma omp parallel
+    {
+      Network<Real> copy;
+      #pragma omp critical
+      build(copy);
+      std::copy(NET.flatParams, NET.flatParams + NET.flatSize, copy.flatParams);
+      copy.paramsChanged();
+      copy.setInferenceOnly(not bLoss);
+      Real* const INP = copy.getInputBuffer(batchSize);
+      std::copy(input.begin(), input.end(), INP);
+
+      const auto objective = [&] () {
+        copy.forward(batchSize);
+        if (bLoss) return (double) copy.layers.back()->loss(copy.workspace,
+                                                            labels.data());
+        const Real* const O = copy.getOutputActivation()->output;
+        return (double) std::inner_product(O, O + batchSize * nOutputs,
+                                           coefs.begin(), (Real) 0);
+      };
+
+      #pragma omp for schedule(dynamic)
+      for (size_t i = 0; i < checked.size(); i++)
+      {
+        const int j = checked[i].first, k = checked[i].second;
+        const int nW = copy.params[j]->nWeights;
+        Real* const P = k < nW ? copy.params[j]->weights + k
+                               : copy.params[j]->biases + (k - nW);
+        const Real G = k < nW ? NET.grads[j]->weights[k]
+                              : NET.grads[j]->biases[k - nW];
+        const Real backup = *P;
+        *P = backup + incr;
+        copy.paramsChanged();
+        const double objP = objective();
+        *P = backup - incr;
+        copy.paramsChanged();
+        const double objM = objective();
+        *P = backup;
+        copy.paramsChanged();
+        errors[i] = error(G, (objP - objM) / (2 * incr));
+      }
+    }
+
+    double sumErr = 0;
+    for (size_t i = 0; i < checked.size(); i++)
+    {
+      Report& R = reports[checked[i].first];
+      R.nChecked++;
+      R.sumErr += errors[i];
+      R.maxErr = std::max(R.maxErr, errors[i]);
+      R.nFailed += errors[i] > tol;
+      sumErr += errors[i];
+    }
+    return checked.size() ? sumErr / checked.size() : 0;
+  }
+
+  void print() const
+  {
+    printf("  ID  checked/params  mean err   max err  failed  failed<=(95%%)\n");
+    for (size_t j = 0; j < reports.size(); j++)
+    {
+      const Report& R = reports[j];
+      if (R.nParams == 0) continue;
+      printf("%4lu  %7lu/%-7lu  %8.2e  %8.2e  %6lu  %12.2f%%\n", j,
+        R.nChecked, R.nParams, R.meanErr(), R.maxErr, R.nFailed,
+        100 * R.failedBound());
+    }
+  }
+};
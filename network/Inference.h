@@ -0,0 +1,98 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Network.h"
+
+// Forward of one sample at a time with the params of a network, e.g. to serve
+// requests or to decode single vectors of a layer, at low latency:
+// - It has its own workspace, planned for inference with batch size 1 when
+//   the context is created. The network's training workspace is untouched,
+//   switching between the two never reallocates either.
+// - Layers see a minibatch of one row: Linear and the GEMM-based
+//   convolutions call gemv (see FusedEpilogue::gemmForward), the implicit
+//   and Winograd convolutions split the image into panels for all threads
+//   and keep their temporary buffers between calls (see _scratch).
+// - forward does not allocate memory: the caller reads the output from the
+//   returned pointer, valid until the next call.
+// - Layers only read the params and the values computed from them when they
+//   change (e.g. the transformed Winograd filters, see Layer::paramsChanged):
+//   a sample costs no transform of the filters, and contexts never write onto
+//   the network, so several can run forward at the same time.
+// The network must not get new layers, nor new params, while the context is
+// used.
+template<typename Real>
+struct InferenceContext
+{
+  const Network<Real>& net;
+  const WorkspacePlan<Real> plan;
+  Real* const arena;
+  std::vector<Activation<Real>*> workspace;
+
+  InferenceContext(const Network<Real>& _net) : net(_net),
+    plan(_net.layers, 1, false), arena(_myalloc<Real>(plan.arenaSize))
+  {
+    if(net.layers.size() < 2) {
+      printf("Attempted inference with uninitialized network. Aborting\n");
+      abort();
+    }
+    memset(arena, 0, plan.arenaSize * sizeof(Real));
+    workspace.resize(net.layers.size(), nullptr);
+    for(size_t j=0; j<net.layers.size(); j++)
+      workspace[j] = new Activation<Real>(1, net.layers[j]->size,
+        arena + plan.outOffset[j], nullptr);
+  }
+
+  ~InferenceContext() {
+    for(auto& p : workspace) _dispose_object(p);
+    _myfree(arena);
+  }
+
+  // Memory where the caller can write the sample before forward(layerStart),
+  // of size of layer layerStart:
+  Real* getInputBuffer(const size_t layerStart = 0) const
+  {
+    assert(layerStart < workspace.size());
+    return workspace[layerStart]->output;
+  }
+
+  // Output of the network, nOutputs values, after forward:
+  const Real* getOutput() const { return workspace.back()->output; }
+
+  // Forward of the sample written in getInputBuffer(layerStart):
+  const Real* forward(const size_t layerStart = 0) const
+  {
+    for (size_t j=layerStart+1; j<net.layers.size(); j++) {
+      net.exec.blasFor(net.layers[j]->blasInParallel(1, false));
+      const double t0 = net.profiler.start();
+      net.layers[j]->forward(workspace, net.params);
+      net.profiler.stop(net.layers[j], false, 1, t0);
+    }
+    return getOutput();
+  }
+
+  // Copies the sample I, output of layer layerStart, before forward:
+  const Real* forward(const Real* const I, const size_t layerStart = 0) const
+  {
+    Real* const input = getInputBuffer(layerStart);
+    if(I not_eq input)
+      std::copy(I, I + workspace[layerStart]->layersSize, input);
+    return forward(layerStart);
+  }
+
+  // Helper that returns a copy of the output:
+  std::vector<Real> forward(const std::vector<Real>& I,
+                            const size_t layerStart = 0) const
+  {
+    assert(I.size() == (size_t) workspace[layerStart]->layersSize);
+    const Real* const O = forward(I.data(), layerStart);
+    return std::vector<Real>(O, O + net.nOutputs);
+  }
+};
@@ -0,0 +1,311 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Layers.h"
+
+// Batch normalization of the channels of NHWC activations: the input is a
+// [batchSize * nPixels][nChannels] matrix, and each channel is normalized
+// with its mean and variance over the rows, then scaled by gamma and shifted
+// by beta (the weights and biases of the layer):
+//   y = gamma * (x - mean) / sqrt(var + EPS) + beta
+// which in inference is an affine map of x, and can be folded into the
+// weights and biases of the previous layer (see foldInto).
+// In training the statistics of the minibatch are computed in one pass with
+// Welford's updates: each thread accumulates the mean and the sum of squared
+// deviations of a contiguous range of rows, and the ranges are then merged.
+// They also update the running statistics, used in inference.
+template<typename Real>
+struct RuntimeBatchNormLayer: public Layer<Real>
+{
+  using Layer<Real>::ID;
+  using Layer<Real>::size;
+  const int nChannels, nPixels;
+  // running statistics are updated as (1-momentum) * old + momentum * batch:
+  static constexpr Real momentum = 0.1, EPS = 1e-5;
+
+  // If true, forward normalizes with the statistics of the minibatch and
+  // updates the running ones. Otherwise, and always with an inference
+  // workspace (no gradients), it normalizes with the running ones.
+  bool training = true;
+  // running mean and variance of each channel, [2][nChannels], then 1 if the
+  // normalization was folded into the previous layer's params. Saved by
+  // checkpoints as the layer's state:
+  mutable std::vector<Real> running;
+  // mean and inverse std of the last minibatch normalized in training, read
+  // by bckward, and sums of each thread's range of rows:
+  mutable std::vector<Real> batchMean, batchInvStd, partial;
+
+  Params<Real>* allocate_params() const override {
+    // gamma and beta of each channel:
+    return new Params<Real>(nChannels, nChannels);
+  }
+
+  // If folded, forward copies its input, and runs in place with no cost:
+  bool folded() const { return running[2 * nChannels] > 0; }
+
+  bool bckwardNeedsInput()  const override { return not folded(); }
+  bool bckwardNeedsOutput() const override { return false; }
+  bool canRunInPlace() const override { return true; }
+
+  const char* name() const override { return "BatchNorm"; }
+  // statistics (4 operations per value in training), then a subtraction and
+  // a multiply-add; bckward sums two products, then computes the gradient:
+  double flops(const int batchSize, const bool bck) const override {
+    if (folded()) return 0;
+    return (bck ? 8.0 : (training ? 7.0 : 3.0)) * batchSize * size;
+  }
+
+  size_t stateSize() const override { return running.size(); }
+  Real* state() const override { return running.data(); }
+  void setTraining(const bool _training) override { training = _training; }
+
+  RuntimeBatchNormLayer(const int _ID, const int _size, const int _nChannels)
+    : Layer<Real>(_size, _ID), nChannels(_nChannels),
+      nPixels(_size / _nChannels), running(2 * _nChannels + 1, 1),
+      batchMean(_nChannels, 0), batchInvStd(_nChannels, 1)
+  {
+    printf("(%d) BatchNorm Layer of size Output:%d over %d channels\n",
+      ID, size, nChannels);
+    assert(nChannels > 0 && nPixels * nChannels == size);
+    std::fill(running.begin(), running.begin() + nChannels, 0);
+    running[2 * nChannels] = 0;
+  }
+
+  void init(std::mt19937& G,
+            const std::vector<Params<Real>*>& P) const override
+  {
+    std::fill(P[ID]->weights, P[ID]->weights + nChannels, 1);
+    std::fill(P[ID]->biases,  P[ID]->biases  + nChannels, 0);
+  }
+
+  bool useBatchStatistics(const std::vector<Activation<Real>*>& act) const {
+    return training && act[ID]->dError_dOutput not_eq nullptr;
+  }
+
+  // Each thread t of nThreads sums over rows [r0, r1) of nRows:
+  static void threadRows(const int t, const int nThreads, const int nRows,
+                         int& r0, int& r1)
+  {
+    r0 = (size_t) nRows * t / nThreads;
+    r1 = (size_t) nRows * (t+1) / nThreads;
+  }
+
+  // Statistics of X: [nRows][nChannels] onto batchMean and batchInvStd, and
+  // update of the running statistics:
+  void statistics(const Real* const X, const int nRows) const
+  {
+    const int C = nChannels, nThreads = omp_get_max_threads();
+    partial.resize(2 * (size_t) C * nThreads);
+
+    #pragma omp parallel for schedule(static)
+    for (int t = 0; t < nThreads; t++)
+    {
+      int r0, r1;
+      threadRows(t, nThreads, nRows, r0, r1);
+      Real* const __restrict__ mean = partial.data() + 2 * (size_t) C * t;
+      Real* const __restrict__ M2 = mean + C;
+      std::fill(mean, mean + 2 * C, 0);
+      for (int r = r0; r < r1; r++) {
+        const Real* const __restrict__ x = X + (size_t) r * C;
+        const Real invN = (Real) 1 / (r - r0 + 1);
+        #pragma omp simd
+        for (int c = 0; c < C; c++) {
+          const Real delta = x[c] - mean[c];
+          mean[c] += delta * invN;
+          M2[c] += delta * (x[c] - mean[c]);
+        }
+      }
+    }
+
+    // merge the ranges: (n, mean, M2) of two sets give those of their union
+    Real* const mean = batchMean.data();
+    Real* const M2 = batchInvStd.data();
+    std::fill(mean, mean + C, 0);
+    std::fill(M2, M2 + C, 0);
+    Real n = 0;
+    for (int t = 0; t < nThreads; t++) {
+      int r0, r1;
+      threadRows(t, nThreads, nRows, r0, r1);
+      if (r1 == r0) continue;
+      const Real nT = r1 - r0, w = nT / (n + nT);
+      const Real* const meanT = partial.data() + 2 * (size_t) C * t;
+      const Real* const M2T = meanT + C;
+      for (int c = 0; c < C; c++) {
+        const Real delta = meanT[c] - mean[c];
+        mean[c] += delta * w;
+        M2[c] += M2T[c] + delta * delta * n * w;
+      }
+      n += nT;
+    }
+
+    // running variance is the unbiased estimate:
+    const Real unbiased = n > 1 ? n / (n - 1) : 1;
+    for (int c = 0; c < C; c++) {
+      const Real var = M2[c] / n;
+      running[c]     = (1-momentum) * running[c]     + momentum * mean[c];
+      running[C + c] = (1-momentum) * running[C + c] + momentum * var*unbiased;
+      batchInvStd[c] = 1 / std::sqrt(var + EPS);
+    }
+  }
+
+  // Mean and inverse std used by forward and bckward, of size nChannels:
+  void normalization(const bool batch, const Real*& mean,
+                     const Real*& invStd, Real* const buf) const
+  {
+    if (batch) {
+      mean = batchMean.data();
+      invStd = batchInvStd.data();
+      return;
+    }
+    for (int c = 0; c < nChannels; c++)
+      buf[c] = 1 / std::sqrt(running[nChannels + c] + EPS);
+    mean = running.data();
+    invStd = buf;
+  }
+
+  void forward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param) const override
+  {
+    const int nRows = act[ID]->batchSize * nPixels, C = nChannels;
+    //Both have size nRows * nChannels, they may be the same matrix:
+    const Real* const X = act[ID-1]->output;
+    Real* const Y = act[ID]->output;
+    if (folded()) {
+      if (Y not_eq X) std::copy(X, X + (size_t) nRows * C, Y);
+      return;
+    }
+
+    const bool batch = useBatchStatistics(act);
+    if (batch) statistics(X, nRows);
+    const Real* mean, * invStd;
+    // per-thread buffers kept between calls: forward does not allocate
+    Real* const scale = _scratch<Real>(0, 2 * C);
+    normalization(batch, mean, invStd, scale + C);
+    const Real* const gamma = param[ID]->weights;
+    const Real* const beta  = param[ID]->biases;
+    for (int c = 0; c < C; c++) scale[c] = gamma[c] * invStd[c];
+
+    #pragma omp parallel for schedule(static)
+    for (int r = 0; r < nRows; r++) {
+      const Real* const x = X + (size_t) r * C;
+      Real* const y = Y + (size_t) r * C;
+      // x - mean first: no cancellation for channels with large means
+      #pragma omp simd
+      for (int c = 0; c < C; c++) y[c] = scale[c] * (x[c] - mean[c]) + beta[c];
+    }
+  }
+
+  void bckward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param,
+               const std::vector<Params<Real>*>& grad)  const override
+  {
+    if (folded()) {
+      printf("BatchNorm layer %d was folded and cannot be trained. "
+             "Aborting.\n", ID);
+      abort();
+    }
+    const int nRows = act[ID]->batchSize * nPixels, C = nChannels;
+    const int nThreads = omp_get_max_threads();
+    const Real* const X = act[ID-1]->output;
+    const Real* const D = act[ID]->dError_dOutput;
+    Real* const E = act[ID-1]->dError_dOutput;
+    const bool batch = useBatchStatistics(act);
+    const Real* mean, * invStd;
+    Real* const buf = _scratch<Real>(0, 2 * C);
+    normalization(batch, mean, invStd, buf);
+
+    // sums over the rows of D and of D * xhat, with xhat the normalized x:
+    partial.resize(2 * (size_t) C * nThreads);
+    #pragma omp parallel for schedule(static)
+    for (int t = 0; t < nThreads; t++)
+    {
+      int r0, r1;
+      threadRows(t, nThreads, nRows, r0, r1);
+      Real* const __restrict__ sumD = partial.data() + 2 * (size_t) C * t;
+      Real* const __restrict__ sumDX = sumD + C;
+      std::fill(sumD, sumD + 2 * C, 0);
+      for (int r = r0; r < r1; r++) {
+        const Real* const __restrict__ x = X + (size_t) r * C;
+        const Real* const __restrict__ d = D + (size_t) r * C;
+        #pragma omp simd
+        for (int c = 0; c < C; c++) {
+          sumD[c]  += d[c];
+          sumDX[c] += d[c] * (x[c] - mean[c]) * invStd[c];
+        }
+      }
+    }
+    Real* const gradGamma = grad[ID]->weights;
+    Real* const gradBeta  = grad[ID]->biases;
+    std::fill(gradGamma, gradGamma + C, 0);
+    std::fill(gradBeta,  gradBeta  + C, 0);
+    for (int t = 0; t < nThreads; t++)
+      for (int c = 0; c < C; c++) {
+        gradBeta[c]  += partial[2 * (size_t) C * t + c];
+        gradGamma[c] += partial[2 * (size_t) C * t + C + c];
+      }
+
+    // dE/dx = gamma invStd (d - (sum d + xhat sum d xhat) / nRows), where the
+    // sums vanish if the statistics are not those of the minibatch:
+    const Real* const gamma = param[ID]->weights;
+    const Real invN = batch ? (Real) 1 / nRows : 0;
+    #pragma omp parallel for schedule(static)
+    for (int r = 0; r < nRows; r++) {
+      const Real* const x = X + (size_t) r * C;
+      const Real* const d = D + (size_t) r * C;
+      Real* const e = E + (size_t) r * C;
+      #pragma omp simd
+      for (int c = 0; c < C; c++) {
+        const Real xhat = (x[c] - mean[c]) * invStd[c];
+        e[c] = gamma[c] * invStd[c] *
+               (d[c] - invN * (gradBeta[c] + xhat * gradGamma[c]));
+      }
+    }
+  }
+
+  // Layers computing f(I W + B) with W: [..][nChannels] and B: [nChannels],
+  // those that can fuse an activation, without one (it would be applied
+  // before the normalization):
+  bool foldInto(const Layer<Real>& prev, Params<Real>* const prevParams,
+                const Params<Real>* const own) override
+  {
+    const int C = nChannels;
+    if (folded() || prevParams == nullptr || not prev.canFuseActivation() ||
+        prev.epilogue not_eq Epilogue::None || prevParams->nBiases not_eq C ||
+        prevParams->nWeights % C not_eq 0) return false;
+
+    std::vector<Real> buf(C);
+    const Real* mean, * invStd;
+    normalization(false, mean, invStd, buf.data());
+    Real* const W = prevParams->weights;
+    Real* const B = prevParams->biases;
+    for (int c = 0; c < C; c++) {
+      const Real scale = own->weights[c] * invStd[c];
+      B[c] = scale * (B[c] - mean[c]) + own->biases[c];
+      buf[c] = scale;
+    }
+    #pragma omp parallel for schedule(static)
+    for (int k = 0; k < prevParams->nWeights / C; k++) {
+      #pragma omp simd
+      for (int c = 0; c < C; c++) W[(size_t) k * C + c] *= buf[c];
+    }
+    running[2 * C] = 1;
+    return true;
+  }
+};
+
+template<typename Real, int nChannels>
+struct BatchNormLayer: public RuntimeBatchNormLayer<Real>
+{
+  BatchNormLayer(const int _ID, const int _size) :
+    RuntimeBatchNormLayer<Real>(_ID, _size, nChannels) {
+    static_assert(nChannels>0, "Invalid sizes");
+  }
+};
@@ -11,26 +11,50 @@
 #pragma once
 #include "Layers.h"
 
-template
-<
-  int InX, int InY, int InC, //input image: x:width, y:height, c:color channels
-  int KnX, int KnY, int KnC, //filter:      x:width, y:height, c:color channels
-  int OpX, int OpY //output img: x:width, y:height, same color channels as KnC
->
-struct Conv2DLayer: public Layer
+// Convolution, as product of the im2col matrix written by Im2MatLayer with the
+// filters, with sizes given at runtime. Its work is done by gemm and by the
+// epilogue, which take runtime sizes anyway: Conv2DLayer below only fixes
+// them at compile time.
+template<typename Real>
+struct RuntimeConv2DLayer: public Layer<Real>
 {
-  Params* allocate_params() const override {
+  using Layer<Real>::ID;
+  using Layer<Real>::epilogue;
+  const int InX, InY, InC, KnX, KnY, KnC, OpX, OpY;
+
+  Params<Real>* allocate_params() const override {
     //number of kernel parameters:
     // 2d kernel size * number of inp channels * number of out channels
     const int nParams = KnY * KnX * InC * KnC;
     const int nBiases = KnC;
-    return new Params(nParams, nBiases);
+    return new Params<Real>(nParams, nBiases);
   }
 
-  Conv2DLayer(const int _ID) : Layer(OpX * OpY * KnC, _ID) {
-    static_assert(InX>0 && InY>0 && InC>0, "Invalid input");
-    static_assert(KnX>0 && KnY>0 && KnC>0, "Invalid kernel");
-    static_assert(OpX>0 && OpY>0, "Invalid outpus");
+  // bckward needs the input to compute the gradient wrt to the weights, and
+  // the output if it applies the derivative of a fused activation:
+  bool bckwardNeedsOutput() const override {
+    return epilogue != Epilogue::None;
+  }
+  bool canFuseActivation() const override { return true; }
+  bool blasInParallel(const int batchSize, const bool bck) const override {
+    return not bck &&
+           FusedEpilogue<Real>::gemmInParallel(batchSize * OpY * OpX, KnC);
+  }
+
+  const char* name() const override { return "Conv2D"; }
+  double flops(const int batchSize, const bool bck) const override {
+    const double nOut = (double) batchSize * OpY * OpX * KnC;
+    return this->gemmFlops(nOut * KnY * KnX * InC, nOut, bck);
+  }
+  double bytes(const int batchSize, const bool bck) const override {
+    return this->gemmBytes((double) batchSize * OpY * OpX * KnY * KnX * InC,
+      (double) batchSize * OpY * OpX * KnC, KnY * KnX * InC * KnC + KnC, bck);
+  }
+
+  RuntimeConv2DLayer(const int _ID, const ConvShape& S) :
+    Layer<Real>(S.OpX * S.OpY * S.KnC, _ID), InX(S.InX), InY(S.InY),
+    InC(S.InC), KnX(S.KnX), KnY(S.KnY), KnC(S.KnC), OpX(S.OpX), OpY(S.OpY) {
+    assert(S.valid());
     print();
   }
 
@@ -39,8 +63,8 @@ struct Conv2DLayer: public Layer
       ID, OpY,OpX,KnY,KnX,InC, KnY,KnX,InC,KnC, OpX,OpY,KnC);
   }
 
-  void forward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param) const override
+  void forward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param) const override
   {
     assert(act[ID]->layersSize   == OpY * OpX *                   KnC);
     assert(act[ID-1]->layersSize == OpY * OpX * KnY * KnX * InC      );
@@ -49,36 +73,21 @@ struct Conv2DLayer: public Layer
 
     const int batchSize = act[ID]->batchSize;
 
-    {
-            Real* const __restrict__ OUT = act[ID]->output;
-      const Real* const __restrict__ B = param[ID]->biases;
-      #pragma omp parallel for schedule(static)
-      for (int i=0; i<batchSize * OpY * OpX * KnC; i++) OUT[i] = B[i % KnC];
-    }
-    {
-      const int mm_outRow = batchSize * OpY * OpX;
-      const int mm_nInner = KnY * KnX * InC;
-      const int mm_outCol = KnC;
-      gemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-        mm_outRow, mm_outCol, mm_nInner,
-    		(Real) 1.0, act[ID-1]->output, mm_nInner,
-                    param[ID]->weights, mm_outCol,
-    		(Real) 1.0, act[ID]->output, mm_outCol);
-    }
+    // [BS*OpY*OpX, KnC] = [BS*OpY*OpX, KnY*KnX*InC] [KnY*KnX*InC, KnC]
+    // then bias and fused activation, if any, on each block of rows:
+    FusedEpilogue<Real>::gemmForward(epilogue, batchSize * OpY * OpX,
+      KnY * KnX * InC, KnC, act[ID-1]->output, param[ID]->weights,
+      param[ID]->biases, act[ID]->output);
   }
 
-  void bckward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param,
-               const std::vector<Params*>& grad) const override
+  void bckward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param,
+               const std::vector<Params<Real>*>& grad) const override
   {
     const int batchSize = act[ID]->batchSize;
-    {
-      const Real* const __restrict__ dEdO = act[ID]->dError_dOutput;
-            Real* const __restrict__ B = grad[ID]->biases;
-      std::fill(B, B+KnC, 0);
-      #pragma omp parallel for schedule(static) reduction(+ : B[:KnC])
-      for (int i=0; i<batchSize * OpY * OpX * KnC; i++) B[i % KnC] += dEdO[i];
-    }
+    // Derivative of the fused activation, if any, and bias gradient:
+    FusedEpilogue<Real>::bckwardBias(epilogue, batchSize * OpY * OpX, KnC,
+      act[ID]->dError_dOutput, act[ID]->output, grad[ID]->biases);
     {
       // Compute gradient of error wrt to kernel parameters:
       // [KnY*KnX*InC, KnC] = [BS*OpY*OpX, KnY*KnX*InC]^T [BS*OpX*OpY, KnC]
@@ -105,7 +114,8 @@ struct Conv2DLayer: public Layer
     }
   }
 
-  void init(std::mt19937& gen, const std::vector<Params*>& param) const override
+  void init(std::mt19937& gen,
+            const std::vector<Params<Real>*>& param) const override
   {
     // get pointers to layer's weights and bias
     Real *const W = param[ID]->weights, *const B = param[ID]->biases;
@@ -117,3 +127,20 @@ struct Conv2DLayer: public Layer
     std::fill(B, B + KnC, 0);
   }
 };
+
+template
+<
+  typename Real,
+  int InX, int InY, int InC, //input image: x:width, y:height, c:color channels
+  int KnX, int KnY, int KnC, //filter:      x:width, y:height, c:color channels
+  int OpX, int OpY //output img: x:width, y:height, same color channels as KnC
+>
+struct Conv2DLayer: public RuntimeConv2DLayer<Real>
+{
+  Conv2DLayer(const int _ID) : RuntimeConv2DLayer<Real>(_ID,
+    {InX,InY,InC, KnX,KnY,KnC, 1,1, 0,0, OpX,OpY}) {
+    static_assert(InX>0 && InY>0 && InC>0, "Invalid input");
+    static_assert(KnX>0 && KnY>0 && KnC>0, "Invalid kernel");
+    static_assert(OpX>0 && OpY>0, "Invalid outpus");
+  }
+};
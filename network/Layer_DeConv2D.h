@@ -12,26 +12,44 @@
 #include "Layers.h"
 
 
-template
-<
-int InX, int InY, int InC, //input image: x:width, y:height, c:color channels
-int KnX, int KnY, int KnC, //filter:      x:width, y:height, c:color channels
-int OpX, int OpY //output img: x:width, y:height, same color channels as KnC
->
-struct Deconv2DLayer: public Layer
+// Transposed convolution, followed by a transposed Im2MatLayer, with sizes
+// given at runtime. Its work is done by gemm and by the column sums, which take
+// runtime sizes anyway: Deconv2DLayer below only fixes them at compile time.
+template<typename Real>
+struct RuntimeDeconv2DLayer: public Layer<Real>
 {
-  Params* allocate_params() const override {
+  using Layer<Real>::ID;
+  const int InX, InY, InC, KnX, KnY, KnC, OpX, OpY;
+
+  Params<Real>* allocate_params() const override {
     //number of kernel parameters:
     // 2d kernel size * number of inp channels * number of out channels
     const int nParams = InC * KnY * KnX * KnC;
     const int nBiases = KnC;
-    return new Params(nParams, nBiases);
+    return new Params<Real>(nParams, nBiases);
   }
 
-  Deconv2DLayer(const int _ID) : Layer(InY * InX * KnY * KnX * KnC, _ID) {
-    static_assert(InX>0 && InY>0 && InC>0, "Invalid input");
-    static_assert(KnX>0 && KnY>0 && KnC>0, "Invalid kernel");
-    static_assert(OpX>0 && OpY>0, "Invalid outpus");
+  // bckward needs the input to compute the gradient wrt to the weights:
+  bool bckwardNeedsOutput() const override { return false; }
+
+  const char* name() const override { return "DeConv2D"; }
+  double flops(const int batchSize, const bool bck) const override {
+    // one multiply-add per input value, filter pixel and output channel:
+    const double nInp = (double) batchSize * InY * InX * InC;
+    const double nOut = (double) batchSize * InY * InX * KnY * KnX * KnC;
+    return this->gemmFlops(nInp * KnY * KnX * KnC, nOut, bck);
+  }
+  double bytes(const int batchSize, const bool bck) const override {
+    return this->gemmBytes((double) batchSize * InY * InX * InC,
+      (double) batchSize * InY * InX * KnY * KnX * KnC,
+      InC * KnY * KnX * KnC + KnC, bck);
+  }
+
+  RuntimeDeconv2DLayer(const int _ID, const ConvShape& S) :
+    Layer<Real>(S.InY * S.InX * S.KnY * S.KnX * S.KnC, _ID), InX(S.InX),
+    InY(S.InY), InC(S.InC), KnX(S.KnX), KnY(S.KnY), KnC(S.KnC), OpX(S.OpX),
+    OpY(S.OpY) {
+    assert(S.valid());
     print();
   }
   void print() {
@@ -39,8 +57,8 @@ struct Deconv2DLayer: public Layer
            ID, InY,InX,InC, InC,KnY,KnX,KnC, InY,InX,KnY,KnX,KnC);
   }
 
-  void forward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param) const override
+  void forward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param) const override
   {
     assert(act[ID-1]->layersSize == InY * InX * InC);
     assert(act[ID]->layersSize == InY * InX * KnY * KnX * KnC);
@@ -60,26 +78,19 @@ struct Deconv2DLayer: public Layer
             (Real) 0.0, act[ID]->output, mm_outCol
           );
     }
-    {
-            Real* const __restrict__ O = act[ID]->output;
-      const Real* const __restrict__ B = param[ID]->biases; // size is KnC
-      #pragma omp parallel for schedule(static)
-      for(int i=0; i<batchSize * InY*InX * KnY*KnX*KnC; i++) O[i] += B[i % KnC];
-    }
+    // add bias to each of the [BS*InY*InX*KnY*KnX] rows of KnC outputs:
+    FusedEpilogue<Real>::addBias(batchSize * InY*InX * KnY*KnX, KnC,
+      param[ID]->biases, act[ID]->output);
   }
 
-  void bckward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param,
-               const std::vector<Params*>& grad) const override
+  void bckward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param,
+               const std::vector<Params<Real>*>& grad) const override
   {
     const int batchSize = act[ID]->batchSize;
-    {
-      const Real* const __restrict__ D = act[ID]->dError_dOutput;
-            Real* const __restrict__ B = grad[ID]->biases; // size is KnC
-      std::fill(B, B + KnC, 0);
-      #pragma omp parallel for schedule(static) reduction(+ : B[:KnC])
-      for(int i=0; i<batchSize * InY*InX * KnY*KnX*KnC; i++) B[i % KnC] += D[i];
-    }
+    // bias gradient is the sum of the [BS*InY*InX*KnY*KnX] rows of dEdO:
+    FusedEpilogue<Real>::bckwardBias(Epilogue::None, batchSize * InY*InX *
+      KnY*KnX, KnC, act[ID]->dError_dOutput, act[ID]->output, grad[ID]->biases);
 
     const int mm_outRow = batchSize * InY * InX;
     const int mm_nInner = InC;
@@ -103,7 +114,8 @@ struct Deconv2DLayer: public Layer
           (Real) 0.0, act[ID-1]->dError_dOutput, mm_nInner);
   }
 
-  void init(std::mt19937& gen, const std::vector<Params*>& param) const override
+  void init(std::mt19937& gen,
+            const std::vector<Params<Real>*>& param) const override
   {
     // get pointers to layer's weights and bias
     Real *const W = param[ID]->weights, *const B = param[ID]->biases;
@@ -115,3 +127,20 @@ struct Deconv2DLayer: public Layer
     std::fill(B, B + KnC, 0);
   }
 };
+
+template
+<
+typename Real,
+int InX, int InY, int InC, //input image: x:width, y:height, c:color channels
+int KnX, int KnY, int KnC, //filter:      x:width, y:height, c:color channels
+int OpX, int OpY //output img: x:width, y:height, same color channels as KnC
+>
+struct Deconv2DLayer: public RuntimeDeconv2DLayer<Real>
+{
+  Deconv2DLayer(const int _ID) : RuntimeDeconv2DLayer<Real>(_ID,
+    {InX,InY,InC, KnX,KnY,KnC, 1,1, 0,0, OpX,OpY}) {
+    static_assert(InX>0 && InY>0 && InC>0, "Invalid input");
+    static_assert(KnX>0 && KnY>0 && KnC>0, "Invalid kernel");
+    static_assert(OpX>0 && OpY>0, "Invalid outpus");
+  }
+};
@@ -11,48 +11,65 @@
 #pragma once
 #include "Layers.h"
 
-template<int nOutputs>
-struct LReLuLayer: public Layer
+// Element-wise and softmax layers loop over sizes known only at runtime (the
+// minibatch), so the layers templated on their size below only fix it for
+// the runtime layers that do the work.
+
+template<typename Real>
+struct RuntimeLReLuLayer: public Layer<Real>
 {
-  static constexpr Real leak = 0.1;
+  using Layer<Real>::ID;
+  using Layer<Real>::size;
+  const int nOutputs;
+
+  static constexpr Real leak = FusedEpilogue<Real>::leak;
 
-  Params* allocate_params() const override {
+  Params<Real>* allocate_params() const override {
     // non linear activation layers have no parameters:
     return nullptr;
   }
 
-  LReLuLayer(const int _ID) : Layer(nOutputs, _ID) {
+  // bckward uses the output, which has the same sign as the input:
+  bool bckwardNeedsInput()  const override { return false; }
+  bool bckwardNeedsOutput() const override { return true; }
+  bool canRunInPlace() const override { return true; }
+
+  const char* name() const override { return "LReLu"; }
+
+  RuntimeLReLuLayer(const int _ID, const int _nOutputs) :
+    Layer<Real>(_nOutputs, _ID), nOutputs(_nOutputs) {
     printf("(%d) LReLu Layer of size Output:%d\n", ID, nOutputs);
   }
 
-  void forward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param) const override
+  void forward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param) const override
   {
     const int batchSize = act[ID]->batchSize;
-    //Each matrix has size is batchSize * size:
-    const Real*const __restrict__ inputs = act[ID-1]->output;
-    Real*const __restrict__ output = act[ID]->output;
+    //Each matrix has size is batchSize * size, they may be the same matrix:
+    const Real*const inputs = act[ID-1]->output;
+    Real*const output = act[ID]->output;
 
     #pragma omp parallel for schedule(static)
     for (int i=0; i<batchSize * size; i++) output[i] = eval(inputs[i]);
   }
 
-  void bckward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param,
-               const std::vector<Params*>& grad)  const override
+  void bckward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param,
+               const std::vector<Params<Real>*>& grad)  const override
   {
     const int batchSize = act[ID]->batchSize;
-    //Each matrix has size is batchSize * size:
-    const Real* const __restrict__ I = act[ID-1]->output;
-    const Real* const __restrict__ D = act[ID]->dError_dOutput;
-    Real* const __restrict__ E = act[ID-1]->dError_dOutput;
+    //Each matrix has size is batchSize * size, D and E may be the same:
+    const Real* const __restrict__ O = act[ID]->output;
+    const Real* const D = act[ID]->dError_dOutput;
+    Real* const E = act[ID-1]->dError_dOutput;
 
     #pragma omp parallel for schedule(static)
-    for (int i=0; i<batchSize * size; i++)  E[i] = D[i] * evalDiff(I[i]);
+    for (int i=0; i<batchSize * size; i++)  E[i] = D[i] * evalDiff(O[i]);
   }
 
   // no parameters to initialize;
-  void init(std::mt19937& G, const std::vector<Params*>& P) const override {}
+  void init(std::mt19937& G,
+            const std::vector<Params<Real>*>& P) const override {}
 
   static inline Real eval(const Real in) {
     return in > 0 ? in : leak * in;
@@ -62,20 +79,35 @@ struct LReLuLayer: public Layer
   }
 };
 
-template<int nOutputs>
-struct SoftMaxLayer: public Layer
+template<typename Real>
+struct RuntimeSoftMaxLayer: public Layer<Real>
 {
-  Params* allocate_params() const override {
+  using Layer<Real>::ID;
+  const int nOutputs;
+
+  Params<Real>* allocate_params() const override {
     // non linear activation layers have no parameters:
     return nullptr;
   }
 
-  SoftMaxLayer(const int _ID) : Layer(nOutputs, _ID) {
-    printf("(%d) SoftMax Layer of size Output:%d\n", ID, nOutputs);
+  bool bckwardNeedsInput()  const override { return false; }
+  bool bckwardNeedsOutput() const override { return true; }
+
+  const char* name() const override { return "SoftMax"; }
+  // forward: max, exp (one operation), sum and normalization of each value,
+  // bckward: dot product and one multiply-add per value:
+  double flops(const int batchSize, const bool bck) const override {
+    return 4.0 * batchSize * nOutputs;
+  }
+
+  RuntimeSoftMaxLayer(const int _ID, const int _nOutputs,
+                      const char* const layerName = "SoftMax") :
+    Layer<Real>(_nOutputs, _ID), nOutputs(_nOutputs) {
+    printf("(%d) %s Layer of size Output:%d\n", ID, layerName, nOutputs);
   }
 
-  void forward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param) const override
+  void forward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param) const override
   {
     const int batchSize = act[ID]->batchSize;
 
@@ -83,83 +115,156 @@ struct SoftMaxLayer: public Layer
     for(int i=0; i<batchSize; i++)
     {
       //Both output and input have size batchSize * size
-      Real*const __restrict__ I = act[ID-1]->output + i*nOutputs;
+      const Real*const __restrict__ I = act[ID-1]->output + i*nOutputs;
       Real*const __restrict__ O = act[ID]->output + i*nOutputs;
+      // subtract the max of the row to prevent overflow of the exponentials:
+      const Real maxI = * std::max_element(I, I + nOutputs);
       Real norm = 0;
       for(int j=0; j<nOutputs; j++) {
-        I[j] = std::exp(I[j]); // I won't need input anymore: over-writed
-        norm += I[j];
+        O[j] = std::exp(I[j] - maxI);
+        norm += O[j];
       }
-      for(int j=0; j<nOutputs; j++) O[j] = I[j]/norm;
+      const Real invN = 1 / norm;
+      for(int j=0; j<nOutputs; j++) O[j] *= invN;
     }
   }
 
-  void bckward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param,
-               const std::vector<Params*>& grad)  const override
+  void bckward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param,
+               const std::vector<Params<Real>*>& grad)  const override
   {
     const int batchSize = act[ID]->batchSize;
-    memset(act[ID-1]->dError_dOutput, 0, nOutputs*batchSize*sizeof(Real) );
 
     #pragma omp parallel for schedule(static)
     for(int i=0; i<batchSize; i++)
     {
       const Real*const __restrict__ D = act[ID]->dError_dOutput +i*nOutputs;
-      const Real*const __restrict__ I = act[ID-1]->output +i*nOutputs;
+      const Real*const __restrict__ O = act[ID]->output +i*nOutputs;
       Real* const __restrict__ E = act[ID-1]->dError_dOutput +i*nOutputs;
 
-      Real norm = 0; // re-compute normalization
-      for(int j=0; j<nOutputs; j++) norm += I[j];
-      const Real invN = 1 / norm;
-
-      for(int j=0; j<nOutputs; j++)
-        for(int k=0; k<nOutputs; k++)
-          E[k] += D[j] * I[k] *((k==j) -I[j]*invN)*invN;
+      // Jacobian of softmax is diag(O) - O O^T, therefore its product with D
+      // is O * (D - O^T D): no need to build the [nOutputs]x[nOutputs] matrix
+      Real dot = 0;
+      for(int j=0; j<nOutputs; j++) dot += D[j] * O[j];
+      for(int j=0; j<nOutputs; j++) E[j] = O[j] * (D[j] - dot);
     }
   }
 
   // no parameters to initialize;
-  void init(std::mt19937& G, const std::vector<Params*>&P) const override {}
+  void init(std::mt19937& G,
+            const std::vector<Params<Real>*>& P) const override {}
 };
 
+// Softmax fused with the cross-entropy loss. Forward computes probabilities
+// as SoftMaxLayer. Given integer labels, `loss` computes the cross-entropy of
+// the minibatch from the logits (the input), as log-sum-exp, which is finite
+// even where the probability of the label underflows, and writes directly
+// the gradient of the loss wrt to the input of the layer:
+// dLoss / dInput = probabilities - onehot(label).
+template<typename Real>
+struct RuntimeSoftMaxCrossEntropyLayer: public RuntimeSoftMaxLayer<Real>
+{
+  using Layer<Real>::ID;
+  using RuntimeSoftMaxLayer<Real>::nOutputs;
+
+  RuntimeSoftMaxCrossEntropyLayer(const int _ID, const int _nOutputs) :
+    RuntimeSoftMaxLayer<Real>(_ID, _nOutputs, "SoftMaxCrossEntropy") {}
+
+  // bckward is `loss`, which reads the logits and the probabilities:
+  bool bckwardNeedsInput() const override { return true; }
+
+  const char* name() const override { return "SoftMaxCrossEntropy"; }
+  // bckward: gradient and max of the logits, and one log per row:
+  double flops(const int batchSize, const bool bck) const override {
+    return bck ? batchSize * (2.0 * nOutputs + 3) : 4.0 * batchSize * nOutputs;
+  }
+  double bytes(const int batchSize, const bool bck) const override {
+    return (bck ? 3.0 : 2.0) * batchSize * nOutputs * sizeof(Real);
+  }
+
+  Real loss(const std::vector<Activation<Real>*>& act,
+            const int* const labels) const override
+  {
+    const int batchSize = act[ID]->batchSize;
+    Real sumLoss = 0;
+
+    #pragma omp parallel for schedule(static) reduction(+ : sumLoss)
+    for(int i=0; i<batchSize; i++)
+    {
+      const Real*const __restrict__ I = act[ID-1]->output +i*nOutputs;
+      const Real*const __restrict__ P = act[ID]->output +i*nOutputs;
+      Real* const __restrict__ E = act[ID-1]->dError_dOutput +i*nOutputs;
+      assert(labels[i] >= 0 && labels[i] < nOutputs);
+
+      int jMax = 0;
+      for(int j=0; j<nOutputs; j++) {
+        E[j] = P[j];
+        if (I[j] > I[jMax]) jMax = j;
+      }
+      E[labels[i]] -= 1;
+      // -log(P[label]) = log(sum_j exp(I[j])) - I[label]. Forward subtracted
+      // the max of the row from the exponents, so the sum is 1 / P[jMax],
+      // which is at least 1 / nOutputs: no exponentials are computed again.
+      sumLoss += I[jMax] - std::log(P[jMax]) - I[labels[i]];
+    }
+    return sumLoss;
+  }
+};
 
-template<int nOutputs>
-struct TanhLayer: public Layer
+template<typename Real>
+struct RuntimeTanhLayer: public Layer<Real>
 {
-  Params* allocate_params() const override {
+  using Layer<Real>::ID;
+  using Layer<Real>::size;
+  const int nOutputs;
+
+  Params<Real>* allocate_params() const override {
     // non linear activation layers have no parameters:
     return nullptr;
   }
 
-  TanhLayer(const int _ID) : Layer(nOutputs, _ID) {
+  // bckward uses the output: d tanh(x) / dx = 1 - tanh(x)^2
+  bool bckwardNeedsInput()  const override { return false; }
+  bool bckwardNeedsOutput() const override { return true; }
+  bool canRunInPlace() const override { return true; }
+
+  const char* name() const override { return "Tanh"; }
+  // tanh counts as one operation, its derivative needs three:
+  double flops(const int batchSize, const bool bck) const override {
+    return (bck ? 3.0 : 1.0) * batchSize * nOutputs;
+  }
+
+  RuntimeTanhLayer(const int _ID, const int _nOutputs) :
+    Layer<Real>(_nOutputs, _ID), nOutputs(_nOutputs) {
     printf("(%d) Tanh Layer of size Output:%d\n", ID, nOutputs);
   }
 
-  void forward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param) const override
+  void forward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param) const override
   {
     const int batchSize = act[ID]->batchSize;
     //array of outputs from previous layer, size is batchSize * size:
-    const Real*const __restrict__ inputs = act[ID-1]->output;
-    //return matrix that contains layer's output, same size
-    Real*const __restrict__ output = act[ID]->output;
+    const Real*const inputs = act[ID-1]->output;
+    //return matrix that contains layer's output, same size (may be inputs)
+    Real*const output = act[ID]->output;
 
     #pragma omp parallel for schedule(static)
     for (int i=0; i<batchSize * size; i++) output[i] = std::tanh(inputs[i]);
   }
 
-  void bckward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param,
-               const std::vector<Params*>& grad)  const override
+  void bckward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param,
+               const std::vector<Params<Real>*>& grad)  const override
   {
     const int batchSize = act[ID]->batchSize;
 
     //const Real* const inputs = act[ID-1]->output; //size is batchSize * size
     const Real* const __restrict__ output = act[ID]->output;
     // this matrix already contains dError / dOutput for this layer:
-    const Real* const __restrict__ deltas = act[ID]->dError_dOutput;
-    //return matrix that contains dError / dOutput for previous layer:
-    Real* const __restrict__ errinp = act[ID-1]->dError_dOutput;
+    const Real* const deltas = act[ID]->dError_dOutput;
+    //return matrix that contains dError / dOutput for previous layer (may be
+    //the same matrix as deltas):
+    Real* const errinp = act[ID-1]->dError_dOutput;
 
     #pragma omp parallel for schedule(static)
     for (int i=0; i<batchSize * size; i++)
@@ -167,5 +272,31 @@ struct TanhLayer: public Layer
   }
 
   // no parameters to initialize;
-  void init(std::mt19937& G, const std::vector<Params*>& P) const override {}
+  void init(std::mt19937& G,
+            const std::vector<Params<Real>*>& P) const override {}
+};
+
+template<typename Real, int nOutputs>
+struct LReLuLayer: public RuntimeLReLuLayer<Real>
+{
+  LReLuLayer(const int _ID) : RuntimeLReLuLayer<Real>(_ID, nOutputs) {}
+};
+
+template<typename Real, int nOutputs>
+struct SoftMaxLayer: public RuntimeSoftMaxLayer<Real>
+{
+  SoftMaxLayer(const int _ID) : RuntimeSoftMaxLayer<Real>(_ID, nOutputs) {}
+};
+
+template<typename Real, int nOutputs>
+struct SoftMaxCrossEntropyLayer: public RuntimeSoftMaxCrossEntropyLayer<Real>
+{
+  SoftMaxCrossEntropyLayer(const int _ID) :
+    RuntimeSoftMaxCrossEntropyLayer<Real>(_ID, nOutputs) {}
+};
+
+template<typename Real, int nOutputs>
+struct TanhLayer: public RuntimeTanhLayer<Real>
+{
+  TanhLayer(const int _ID) : RuntimeTanhLayer<Real>(_ID, nOutputs) {}
 };
@@ -11,19 +11,17 @@
 #pragma once
 #include "Layers.h"
 
-// Im2MatLayer gets as input an image of sizes InX * InY * InC
-// and prepares the output for convolution with a filter of size KnY * KnX * KnC
-// and output an image of size OpY * OpX * KnC
-template
-<
-  int InX, int InY, int InC, //input image: x:width, y:height, c:color channels
-  int KnX, int KnY, int KnC, //filter:      x:width, y:height, c:color channels
-  int Sx, int Sy, // stride  x/y
-  int Px, int Py, // padding x/y
-  int OpX, int OpY //output img: x:width, y:height, same color channels as KnC
->
-struct Im2MatLayer: public Layer
+// Im2Mat gets as input an image of sizes InX * InY * InC and prepares the
+// output for convolution with a filter of size KnY * KnX * KnC and output an
+// image of size OpY * OpX * KnC. RuntimeIm2MatLayer takes the sizes at runtime,
+// Im2MatLayer below at compile time, which lets the compiler specialize the
+// copies of Im2Mat and Mat2Im for the shape of the layer.
+template<typename Real>
+struct RuntimeIm2MatLayer: public Layer<Real>
 {
+  using Layer<Real>::ID;
+  const int InX, InY, InC, KnX, KnY, KnC, Sx, Sy, Px, Py, OpX, OpY;
+
   // if not transposed then forward operation is Im2Mat and backward is Mat2Im
   // if transposed then forward operation is Mat2Im and backward is Im2Mat
   const bool transposed;
@@ -31,12 +29,25 @@ struct Im2MatLayer: public Layer
   const int out_size = transposed ? InX*InY*InC : OpY*OpX*KnY*KnX*InC;
 
   //Im2ColLayer has no parameters:
-  Params* allocate_params() const override { return nullptr; }
+  Params<Real>* allocate_params() const override { return nullptr; }
 
-  Im2MatLayer(const int _ID, const bool bTrans = false) :
-    Layer(bTrans? InX*InY*InC : OpY*OpX*KnY*KnX*InC, _ID), transposed(bTrans) {
-    static_assert(Sx> 0 && Sy> 0, "Invalid stride");
-    static_assert(Px>=0 && Py>=0, "Invalid kernel");
+  // bckward only moves gradients around:
+  bool bckwardNeedsInput()  const override { return false; }
+  bool bckwardNeedsOutput() const override { return false; }
+
+  const char* name() const override { return transposed ? "Col2Im" : "Im2Col"; }
+  // only copies, each value of the input and of the output is accessed once:
+  double flops(const int batchSize, const bool bck) const override { return 0; }
+  double bytes(const int batchSize, const bool bck) const override {
+    return (double) batchSize * (inp_size + out_size) * sizeof(Real);
+  }
+
+  RuntimeIm2MatLayer(const int _ID, const ConvShape& S, const bool bTrans) :
+    Layer<Real>(bTrans? S.InX*S.InY*S.InC : S.OpY*S.OpX*S.KnY*S.KnX*S.InC, _ID),
+    InX(S.InX), InY(S.InY), InC(S.InC), KnX(S.KnX), KnY(S.KnY), KnC(S.KnC),
+    Sx(S.Sx), Sy(S.Sy), Px(S.Px), Py(S.Py), OpX(S.OpX), OpY(S.OpY),
+    transposed(bTrans) {
+    assert(S.valid());
     print();
   }
 
@@ -50,8 +61,8 @@ struct Im2MatLayer: public Layer
     printf("with Stride:[%d %d] and Padding:[%d %d]\n",Sx,Sy,Px,Py);
   }
 
-  void forward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param) const override
+  void forward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param) const override
   {
     const int batchSize = act[ID]->batchSize;
 
@@ -69,9 +80,9 @@ struct Im2MatLayer: public Layer
     }
   }
 
-  void bckward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param,
-               const std::vector<Params*>& grad) const override
+  void bckward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param,
+               const std::vector<Params<Real>*>& grad) const override
   {
     const int batchSize = act[ID]->batchSize;
 
@@ -89,10 +100,96 @@ struct Im2MatLayer: public Layer
     }
   }
 
+  // Images are [BS][InY][InX][InC], matrices are [BS][OpY][OpX][KnY][KnX][InC]
+  virtual void Im2Mat(const int BS,
+    const Real*const __restrict__ INP,
+    Real*const __restrict__ OUT
+  ) const
+  {
+    // clean up memory space of OUT. Why? Because padding, that's why.
+    memset(OUT, 0, (size_t) BS * OpY * OpX * KnY * KnX * InC * sizeof(Real));
+
+    #pragma omp parallel for collapse(3) schedule(static)
+    for (int bc = 0; bc < BS;  bc++)
+    for (int oy = 0; oy < OpY; oy++)
+    for (int ox = 0; ox < OpX; ox++)
+    {
+      //starting position along input map for convolution with kernel
+      const int ix0 = ox * Sx - Px, iy0 = oy * Sy - Py;
+      Real* const O = OUT + (((size_t) bc*OpY + oy)*OpX + ox) * KnY*KnX*InC;
+      for (int fy = 0; fy < KnY; fy++)
+      for (int fx = 0; fx < KnX; fx++)
+      {
+        //index along input map of the convolution op:
+        const int ix = ix0 + fx, iy = iy0 + fy;
+        //padding: skip addition if outside input boundaries
+        if (ix < 0 || ix >= InX || iy < 0 || iy >= InY) continue;
+        const Real* const I = INP + (((size_t) bc*InY + iy)*InX + ix) * InC;
+        std::copy(I, I + InC, O + (fy*KnX + fx) * InC);
+      }
+    }
+  }
+
+  virtual void Mat2Im(const int BS,
+    const Real*const __restrict__ dLdOUT,
+    Real*const __restrict__ dLdINP
+  ) const
+  {
+    // Mat2Im accesses memory with plus equal: reset field
+    memset(dLdINP, 0, (size_t) BS * InY * InX * InC * sizeof(Real));
+
+    #pragma omp parallel for collapse(3) schedule(static)
+    for (int bc = 0; bc < BS;  bc++)
+    for (int iy = 0; iy < InY; iy++)
+    for (int ix = 0; ix < InX; ix++)
+    {
+      Real* const E = dLdINP + (((size_t) bc*InY + iy)*InX + ix) * InC;
+      // only the filter entries of stride-aligned offsets fall on (iy, ix),
+      // those of output pixel oy = (iy + Py - fy) / Sy, which decreases:
+      for (int fy = (iy + Py) % Sy; fy < KnY; fy += Sy)
+      {
+        const int oy = (iy + Py - fy) / Sy;
+        if (oy < 0) break;
+        if (oy >= OpY) continue;
+        for (int fx = (ix + Px) % Sx; fx < KnX; fx += Sx)
+        {
+          const int ox = (ix + Px - fx) / Sx;
+          if (ox < 0) break;
+          if (ox >= OpX) continue;
+          const Real* const D = dLdOUT + ((((size_t) bc*OpY + oy)*OpX + ox)
+                                          * KnY*KnX + fy*KnX + fx) * InC;
+          for (int ic = 0; ic < InC; ic++) E[ic] += D[ic];
+        }
+      }
+    }
+  }
+
+  void init(std::mt19937& G,
+            const std::vector<Params<Real>*>& P) const override {  }
+};
+
+template
+<
+  typename Real,
+  int InX, int InY, int InC, //input image: x:width, y:height, c:color channels
+  int KnX, int KnY, int KnC, //filter:      x:width, y:height, c:color channels
+  int Sx, int Sy, // stride  x/y
+  int Px, int Py, // padding x/y
+  int OpX, int OpY //output img: x:width, y:height, same color channels as KnC
+>
+struct Im2MatLayer: public RuntimeIm2MatLayer<Real>
+{
+  Im2MatLayer(const int _ID, const bool bTrans = false) :
+    RuntimeIm2MatLayer<Real>(_ID,
+      {InX,InY,InC, KnX,KnY,KnC, Sx,Sy, Px,Py, OpX,OpY}, bTrans) {
+    static_assert(Sx> 0 && Sy> 0, "Invalid stride");
+    static_assert(Px>=0 && Py>=0, "Invalid kernel");
+  }
+
   void Im2Mat(const int BS,
     const Real*const __restrict__ lin_inp,
     Real*const __restrict__ lin_out
-  ) const
+  ) const override
   {
     using InputImages    = Real[][InY][InX][InC];
     using OutputMatrices = Real[][OpY][OpX][KnY][KnX][InC];
@@ -135,7 +232,7 @@ struct Im2MatLayer: public Layer
   void Mat2Im(const int BS,
     const Real*const __restrict__ lin_inp,
     Real*const __restrict__ lin_out
-  ) const
+  ) const override
   {
     using InputImages    = Real[][InY][InX][InC];
     using OutputMatrices = Real[][OpY][OpX][KnY][KnX][InC];
@@ -155,15 +252,15 @@ struct Im2MatLayer: public Layer
       for (int fy = 0; fy < KnY; fy++)
       for (int fx = 0; fx < KnX; fx++)
       {
-        const int oy = ( iy + Py - fy ) / Sy;
-        const int ox = ( ix + Px - fx ) / Sx;
+        // output pixel whose patch has (fy, fx) on (iy, ix), if any:
+        const int ny = iy + Py - fy, nx = ix + Px - fx;
+        if (ny < 0 || nx < 0 || ny % Sy || nx % Sx) continue;
+        const int oy = ny / Sy, ox = nx / Sx;
         //padding: skip addition if outside input boundaries
-        if (oy < 0 || oy >= OpX || ox < 0 || ox >= OpY) continue;
+        if (oy >= OpY || ox >= OpX) continue;
         for (int ic = 0; ic < InC; ic++) //loop over inp feature maps
           dLdINP[bc][iy][ix][ic] += dLdOUT[bc][oy][ox][fy][fx][ic];
       }
     }
   }
-
-  void init(std::mt19937& G, const std::vector<Params*>& P) const override {  }
 };
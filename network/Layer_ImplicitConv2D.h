@@ -0,0 +1,329 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Layers.h"
+
+// Convolution of an image of sizes InY * InX * InC with KnC filters of size
+// KnY * KnX * InC, which outputs an image of size OpY * OpX * KnC.
+// Same operation as Im2MatLayer followed by Conv2DLayer, but the im2col matrix
+// of size [BS*OpY*OpX, KnY*KnX*InC] is never allocated: each thread packs a
+// block of its rows at a time in a panel that fits in cache and multiplies it
+// with the filters while the panel is still in cache.
+// RuntimeImplicitConv2DLayer takes the sizes at runtime, ImplicitConv2DLayer
+// below at compile time, which lets the compiler specialize the packing of the
+// panels for the shape of the layer.
+template<typename Real>
+struct RuntimeImplicitConv2DLayer: public Layer<Real>
+{
+  using Layer<Real>::ID;
+  using Layer<Real>::epilogue;
+  const int InX, InY, InC, KnX, KnY, KnC, Sx, Sy, Px, Py, OpX, OpY;
+
+  // Size of the panel of the im2col matrix packed by each thread:
+  static constexpr int panelBytes = 1 << 17;
+  // one row of the im2col matrix (one output pixel) has the size of a filter:
+  const int nCols = KnY * KnX * InC;
+  const int imgRows = OpY * OpX;
+  const int panelRows = std::max(1, panelBytes / (nCols * (int) sizeof(Real)));
+  // In backward each thread processes blocks of whole images. This way it
+  // can scatter the gradient onto the input image without race conditions.
+  const int imgPerBlock = std::max(1, panelRows / imgRows);
+
+  Params<Real>* allocate_params() const override {
+    //number of kernel parameters:
+    // 2d kernel size * number of inp channels * number of out channels
+    const int nParams = KnY * KnX * InC * KnC;
+    const int nBiases = KnC;
+    return new Params<Real>(nParams, nBiases);
+  }
+
+  // bckward needs the input to compute the gradient wrt to the weights, and
+  // the output if it applies the derivative of a fused activation:
+  bool bckwardNeedsOutput() const override {
+    return epilogue != Epilogue::None;
+  }
+  bool canFuseActivation() const override { return true; }
+  // each thread multiplies its own panels:
+  bool blasInParallel(const int batchSize, const bool bck) const override {
+    return true;
+  }
+
+  const char* name() const override { return "ImplicitConv2D"; }
+  double flops(const int batchSize, const bool bck) const override {
+    const double nOut = (double) batchSize * OpY * OpX * KnC;
+    return this->gemmFlops(nOut * KnY * KnX * InC, nOut, bck);
+  }
+  double bytes(const int batchSize, const bool bck) const override {
+    return this->gemmBytes((double) batchSize * InY * InX * InC,
+      (double) batchSize * OpY * OpX * KnC, KnY * KnX * InC * KnC + KnC, bck);
+  }
+
+  bool convShape(ConvShape& S) const override {
+    S = {InX,InY,InC, KnX,KnY,KnC, Sx,Sy, Px,Py, OpX,OpY};
+    return true;
+  }
+
+  RuntimeImplicitConv2DLayer(const int _ID, const ConvShape& S) :
+    Layer<Real>(S.OpX * S.OpY * S.KnC, _ID),
+    InX(S.InX), InY(S.InY), InC(S.InC), KnX(S.KnX), KnY(S.KnY), KnC(S.KnC),
+    Sx(S.Sx), Sy(S.Sy), Px(S.Px), Py(S.Py), OpX(S.OpX), OpY(S.OpY) {
+    assert(S.valid());
+    print();
+  }
+
+  void print() {
+    printf("(%d) ImplicitConv: In:[%d %d %d] F:[%d %d %d %d] Out:[%d %d %d] ",
+      ID, InY,InX,InC, KnY,KnX,InC,KnC, OpY,OpX,KnC);
+    printf("with Stride:[%d %d] and Padding:[%d %d]\n",Sx,Sy,Px,Py);
+  }
+
+  void forward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param) const override
+  {
+    assert(act[ID]->layersSize   == OpY * OpX *                   KnC);
+    assert(act[ID-1]->layersSize == InY * InX *                   InC);
+    assert(param[ID]->nWeights   ==             KnY * KnX * InC * KnC);
+    assert(param[ID]->nBiases    ==                               KnC);
+
+    const int batchSize = act[ID]->batchSize;
+    const Real* const INP = act[ID-1]->output;
+    const Real* const W = param[ID]->weights;
+    const Real* const B = param[ID]->biases;
+    Real* const OUT = act[ID]->output;
+    // Output rows are independent: panels are taken from all the rows of the
+    // minibatch, smaller than panelRows if there are too few rows to give
+    // one to each thread (e.g. for a single image):
+    const int nRowsTot = batchSize * imgRows, nThreads = omp_get_max_threads();
+    const int rowsPerPanel = std::max(1, std::min(panelRows,
+                                      (nRowsTot + nThreads - 1) / nThreads));
+
+    #pragma omp parallel
+    {
+      // per-thread buffer kept between calls: forward does not allocate
+      Real* const panel = _scratch<Real>(0, panelRows * nCols);
+
+      #pragma omp for schedule(static)
+      for (int row0 = 0; row0 < nRowsTot; row0 += rowsPerPanel)
+      {
+        const int nRows = std::min(rowsPerPanel, nRowsTot - row0);
+        pack(INP, panel, row0, nRows);
+        Real* const O = OUT + (size_t) row0 * KnC;
+        // [nRows, KnC] = [nRows, KnY*KnX*InC] [KnY*KnX*InC, KnC]
+        gemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, nRows, KnC, nCols,
+          (Real) 1.0, panel, nCols, W, KnC, (Real) 0.0, O, KnC);
+        // bias and fused activation, if any, while O is in cache:
+        FusedEpilogue<Real>::forward(epilogue, O, B, nRows, KnC);
+      }
+    }
+  }
+
+  void bckward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param,
+               const std::vector<Params<Real>*>& grad) const override
+  {
+    const int batchSize = act[ID]->batchSize;
+    const int nBlocks = (batchSize + imgPerBlock - 1) / imgPerBlock;
+    const Real* const INP = act[ID-1]->output;
+    const Real* const OUT = act[ID]->output;
+    Real* const dEdO = act[ID]->dError_dOutput;
+    const Real* const W = param[ID]->weights;
+    Real* const dEdI = act[ID-1]->dError_dOutput;
+    Real* const gradW = grad[ID]->weights;
+    Real* const gradB = grad[ID]->biases;
+    // each thread's gradients, [KnY*KnX*InC][KnC] then [KnC]:
+    const size_t ldW = _alignedSize<Real>(nCols * KnC);
+    const Real** const parts = _scratch<const Real*>(0, omp_get_max_threads());
+
+    #pragma omp parallel
+    {
+      // per-thread buffers kept between calls, as in forward:
+      Real* const panel = _scratch<Real>(0, panelRows * nCols);
+      Real* const thrW = _scratch<Real>(1, ldW + KnC);
+      Real* const thrB = thrW + ldW;
+      std::fill(thrW, thrW + ldW + KnC, 0);
+      parts[omp_get_thread_num()] = thrW;
+
+      #pragma omp for schedule(static)
+      for (int blck = 0; blck < nBlocks; blck++)
+      {
+        const int imgBeg = blck*imgPerBlock;
+        const int imgEnd = std::min(batchSize, (blck+1)*imgPerBlock);
+        // scatter below accumulates: reset gradient of block's input images
+        std::fill(dEdI + imgBeg * InY*InX*InC, dEdI + imgEnd * InY*InX*InC, 0);
+
+        for (int row0 = imgBeg*imgRows; row0 < imgEnd*imgRows; row0+=panelRows)
+        {
+          const int nRows = std::min(panelRows, imgEnd*imgRows - row0);
+          // derivative of the fused activation, if any, and bias gradient:
+          Real* const D = dEdO + row0 * KnC;
+          FusedEpilogue<Real>::bckward(epilogue, D, OUT + row0 * KnC, thrB,
+                                       nRows, KnC);
+
+          // [KnY*KnX*InC, KnC] += [nRows, KnY*KnX*InC]^T [nRows, KnC]
+          pack(INP, panel, row0, nRows);
+          gemm(CblasRowMajor, CblasTrans, CblasNoTrans, nCols, KnC, nRows,
+            (Real) 1.0, panel, nCols, D, KnC, (Real) 1.0, thrW, KnC);
+
+          // [nRows, KnY*KnX*InC] = [nRows, KnC] [KnY*KnX*InC, KnC]^T
+          gemm(CblasRowMajor, CblasNoTrans, CblasTrans, nRows, nCols, KnC,
+            (Real) 1.0, D, KnC, W, KnC, (Real) 0.0, panel, nCols);
+          unpackAdd(panel, dEdI, row0, nRows);
+        }
+      }
+
+      // sums over the threads, each of a range of columns:
+      FusedEpilogue<Real>::reduceParts(parts, 0, nCols * KnC, gradW);
+      FusedEpilogue<Real>::reduceParts(parts, ldW, KnC, gradB);
+    }
+  }
+
+  // Write nRows rows of the im2col matrix, starting from row0, onto panel:
+  virtual void pack(const Real*const __restrict__ INP,
+                          Real*const __restrict__ panel,
+                    const int row0, const int nRows) const
+  {
+    for (int r = 0; r < nRows; r++)
+    {
+      const int bc = (row0 + r) / imgRows, pix = (row0 + r) % imgRows;
+      //starting position along input map for convolution with kernel
+      const int ix0 = (pix % OpX) * Sx - Px, iy0 = (pix / OpX) * Sy - Py;
+      for (int fy = 0; fy < KnY; fy++)
+      for (int fx = 0; fx < KnX; fx++)
+      {
+        //index along input map of the convolution op:
+        const int ix = ix0 + fx, iy = iy0 + fy;
+        Real* const O = panel + (size_t) r * nCols + (fy*KnX + fx) * InC;
+        //padding: zeros if outside input boundaries
+        if (ix < 0 || ix >= InX || iy < 0 || iy >= InY)
+          std::fill(O, O + InC, 0);
+        else {
+          const Real* const I = INP + (((size_t) bc*InY + iy)*InX + ix) * InC;
+          std::copy(I, I + InC, O);
+        }
+      }
+    }
+  }
+
+  // Add nRows rows of d Loss d im2col matrix, starting from row0, onto the
+  // gradient of the input images:
+  virtual void unpackAdd(const Real*const __restrict__ panel,
+                               Real*const __restrict__ dLdINP,
+                         const int row0, const int nRows) const
+  {
+    for (int r = 0; r < nRows; r++)
+    {
+      const int bc = (row0 + r) / imgRows, pix = (row0 + r) % imgRows;
+      const int ix0 = (pix % OpX) * Sx - Px, iy0 = (pix / OpX) * Sy - Py;
+      for (int fy = 0; fy < KnY; fy++)
+      for (int fx = 0; fx < KnX; fx++)
+      {
+        const int ix = ix0 + fx, iy = iy0 + fy;
+        //padding: skip addition if outside input boundaries
+        if (ix < 0 || ix >= InX || iy < 0 || iy >= InY) continue;
+        const Real* const D = panel + (size_t) r * nCols + (fy*KnX + fx) * InC;
+        Real* const E = dLdINP + (((size_t) bc*InY + iy)*InX + ix) * InC;
+        for (int ic = 0; ic < InC; ic++) E[ic] += D[ic];
+      }
+    }
+  }
+
+  void init(std::mt19937& gen,
+            const std::vector<Params<Real>*>& param) const override
+  {
+    // get pointers to layer's weights and bias
+    Real *const W = param[ID]->weights, *const B = param[ID]->biases;
+    // initialize weights with Xavier initialization
+    const int nAdded = KnX * KnY * InC, nW = param[ID]->nWeights;
+    const Real scale = std::sqrt(6.0 / (nAdded + KnC));
+    std::uniform_real_distribution < Real > dis(-scale, scale);
+    std::generate(W, W + nW, [&]() {return dis( gen );});
+    std::fill(B, B + KnC, 0);
+  }
+};
+
+template
+<
+  typename Real,
+  int InX, int InY, int InC, //input image: x:width, y:height, c:color channels
+  int KnX, int KnY, int KnC, //filter:      x:width, y:height, c:color channels
+  int Sx, int Sy, // stride  x/y
+  int Px, int Py, // padding x/y
+  int OpX, int OpY //output img: x:width, y:height, same color channels as KnC
+>
+struct ImplicitConv2DLayer: public RuntimeImplicitConv2DLayer<Real>
+{
+  static constexpr int imgRows = OpY * OpX;
+
+  ImplicitConv2DLayer(const int _ID) : RuntimeImplicitConv2DLayer<Real>(_ID,
+    {InX,InY,InC, KnX,KnY,KnC, Sx,Sy, Px,Py, OpX,OpY}) {
+    static_assert(InX>0 && InY>0 && InC>0, "Invalid input");
+    static_assert(KnX>0 && KnY>0 && KnC>0, "Invalid kernel");
+    static_assert(Sx> 0 && Sy> 0, "Invalid stride");
+    static_assert(Px>=0 && Py>=0, "Invalid padding");
+    static_assert(OpX>0 && OpY>0, "Invalid outpus");
+  }
+
+  // Write nRows rows of the im2col matrix, starting from row0, onto panel:
+  void pack(const Real*const __restrict__ lin_inp,
+                  Real*const __restrict__ panel,
+            const int row0, const int nRows) const override
+  {
+    using InputImages = Real[][InY][InX][InC];
+    using PanelRows   = Real[][KnY][KnX][InC];
+    const InputImages & __restrict__ INP = * (InputImages*) lin_inp;
+    PanelRows & __restrict__ OUT = * (PanelRows*) panel;
+
+    for (int r = 0; r < nRows; r++)
+    {
+      const int bc = (row0 + r) / imgRows, pix = (row0 + r) % imgRows;
+      //starting position along input map for convolution with kernel
+      const int ix0 = (pix % OpX) * Sx - Px, iy0 = (pix / OpX) * Sy - Py;
+      for (int fy = 0; fy < KnY; fy++)
+      for (int fx = 0; fx < KnX; fx++)
+      {
+        //index along input map of the convolution op:
+        const int ix = ix0 + fx, iy = iy0 + fy;
+        //padding: zeros if outside input boundaries
+        if (ix < 0 || ix >= InX || iy < 0 || iy >= InY)
+          std::fill(OUT[r][fy][fx], OUT[r][fy][fx] + InC, 0);
+        else
+          std::copy(INP[bc][iy][ix], INP[bc][iy][ix] + InC, OUT[r][fy][fx]);
+      }
+    }
+  }
+
+  // Add nRows rows of d Loss d im2col matrix, starting from row0, onto the
+  // gradient of the input images:
+  void unpackAdd(const Real*const __restrict__ panel,
+                       Real*const __restrict__ lin_out,
+                 const int row0, const int nRows) const override
+  {
+    using InputImages = Real[][InY][InX][InC];
+    using PanelRows   = Real[][KnY][KnX][InC];
+    InputImages & __restrict__ dLdINP = * (InputImages*) lin_out;
+    const PanelRows & __restrict__ dLdOUT = * (PanelRows*) panel;
+
+    for (int r = 0; r < nRows; r++)
+    {
+      const int bc = (row0 + r) / imgRows, pix = (row0 + r) % imgRows;
+      const int ix0 = (pix % OpX) * Sx - Px, iy0 = (pix / OpX) * Sy - Py;
+      for (int fy = 0; fy < KnY; fy++)
+      for (int fx = 0; fx < KnX; fx++)
+      {
+        const int ix = ix0 + fx, iy = iy0 + fy;
+        //padding: skip addition if outside input boundaries
+        if (ix < 0 || ix >= InX || iy < 0 || iy >= InY) continue;
+        for (int ic = 0; ic < InC; ic++) //loop over inp feature maps
+          dLdINP[bc][iy][ix][ic] += dLdOUT[r][fy][fx][ic];
+      }
+    }
+  }
+};
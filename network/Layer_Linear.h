@@ -11,53 +11,74 @@
 #pragma once
 #include "Layers.h"
 
-template<int nOutputs, int nInputs>
-struct LinearLayer: public Layer
+// Linear layer with sizes given at runtime. Its work is done by gemm, which
+// takes runtime sizes anyway: LinearLayer below only fixes them at compile time.
+template<typename Real>
+struct RuntimeLinearLayer: public Layer<Real>
 {
-  Params* allocate_params() const override {
+  using Layer<Real>::ID;
+  using Layer<Real>::size;
+  using Layer<Real>::epilogue;
+  const int nOutputs, nInputs;
+
+  Params<Real>* allocate_params() const override {
     // Allocate params: weight of size nInputs*nOutputs, bias of size nOutputs
-    return new Params(nInputs*nOutputs, nOutputs);
+    return new Params<Real>(nInputs*nOutputs, nOutputs);
+  }
+
+  // bckward needs the input to compute the gradient wrt to the weights, and
+  // the output if it applies the derivative of a fused activation:
+  bool bckwardNeedsOutput() const override {
+    return epilogue != Epilogue::None;
+  }
+  bool canFuseActivation() const override { return true; }
+  bool blasInParallel(const int batchSize, const bool bck) const override {
+    return not bck && FusedEpilogue<Real>::gemmInParallel(batchSize, nOutputs);
   }
 
-  LinearLayer(const int _ID) : Layer(nOutputs, _ID)
+  const char* name() const override { return "Linear"; }
+  double flops(const int batchSize, const bool bck) const override {
+    return this->gemmFlops((double) batchSize * nInputs * nOutputs,
+                           (double) batchSize * nOutputs, bck);
+  }
+  double bytes(const int batchSize, const bool bck) const override {
+    return this->gemmBytes((double) batchSize * nInputs,
+      (double) batchSize * nOutputs, nInputs * nOutputs + nOutputs, bck);
+  }
+
+  bool convShape(ConvShape& S) const override {
+    S = {1,1,nInputs, 1,1,nOutputs, 1,1, 0,0, 1,1};
+    return true;
+  }
+
+  RuntimeLinearLayer(const int _ID, const int _nOutputs, const int _nInputs)
+    : Layer<Real>(_nOutputs, _ID), nOutputs(_nOutputs), nInputs(_nInputs)
   {
     printf("(%d) Linear Layer of Input:%d Output:%d\n", ID, nInputs, nOutputs);
     assert(nOutputs>0 && nInputs>0);
   }
 
-  void forward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param) const override
+  void forward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param) const override
   {
     const int batchSize = act[ID]->batchSize;
-    {
-            Real*const __restrict__ O = act[ID]->output; //batchSize * nOutputs
-      const Real*const __restrict__ B = param[ID]->biases;
-      #pragma omp parallel for schedule(static)
-      for(int b=0; b<batchSize; b++) std::copy(B, B + nOutputs, O + b*nOutputs);
-    }
-    gemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-        batchSize, nOutputs, nInputs,
-        (Real)1.0, act[ID-1]->output, nInputs,
-                   param[ID]->weights, nOutputs,
-        (Real)1.0, act[ID]->output, nOutputs);
+    FusedEpilogue<Real>::gemmForward(epilogue, batchSize, nInputs, nOutputs,
+      act[ID-1]->output, param[ID]->weights, param[ID]->biases,
+      act[ID]->output);
   }
 
 
-  void bckward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param,
-               const std::vector<Params*>& grad)  const override
+  void bckward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param,
+               const std::vector<Params<Real>*>& grad)  const override
   {
     // At this point, act[ID]->dError_dOutput contins derivative of error
     // with respect to the outputs of the network.
     const int batchSize = act[ID]->batchSize;
-    { // BackProp to compute bias gradient: dError / dBias
-      const Real* const __restrict__ deltas = act[ID]->dError_dOutput;
-      Real* const __restrict__ grad_B = grad[ID]->biases; // size nOutputs
-      std::fill(grad_B, grad_B + nOutputs, 0);
-      #pragma omp parallel for schedule(static, 64/sizeof(Real))
-      for(int n=0; n<nOutputs; n++)
-        for(int b=0; b<batchSize; b++) grad_B[n] += deltas[n + b*nOutputs];
-    }
+    // Derivative of the fused activation, if any, and bias gradient in the
+    // same pass over the deltas:
+    FusedEpilogue<Real>::bckwardBias(epilogue, batchSize, nOutputs,
+      act[ID]->dError_dOutput, act[ID]->output, grad[ID]->biases);
     { // BackProp to compute weight gradient: dError / dWeights
       gemm(CblasRowMajor, CblasTrans, CblasNoTrans,
           nInputs, nOutputs, batchSize,
@@ -74,7 +95,8 @@ struct LinearLayer: public Layer
     }
   }
 
-  void init(std::mt19937& gen, const std::vector<Params*>& param) const override
+  void init(std::mt19937& gen,
+            const std::vector<Params<Real>*>& param) const override
   {
     assert(param[ID] not_eq nullptr);
     // get pointers to layer's weights and bias
@@ -88,3 +110,12 @@ struct LinearLayer: public Layer
     std::generate( B, B + nOutputs, [&]() { return dis( gen ); } );
   }
 };
+
+template<typename Real, int nOutputs, int nInputs>
+struct LinearLayer: public RuntimeLinearLayer<Real>
+{
+  LinearLayer(const int _ID) :
+    RuntimeLinearLayer<Real>(_ID, nOutputs, nInputs) {
+    static_assert(nOutputs>0 && nInputs>0, "Invalid sizes");
+  }
+};
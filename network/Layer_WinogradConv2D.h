@@ -0,0 +1,437 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Layers.h"
+
+// Transforms of Winograd's minimal filtering algorithm F(m x m, 3 x 3), which
+// computes a tile of m x m outputs from a tile of (m+2) x (m+2) inputs:
+// Y = AT [ (G g GT) * (BT d B) ] A
+template<typename Real, int m> struct Winograd;
+
+template<typename Real> struct Winograd<Real, 2>
+{
+  static constexpr int alpha = 4;
+  static constexpr Real BT[alpha][alpha] = {
+    { 1,  0, -1,  0},
+    { 0,  1,  1,  0},
+    { 0, -1,  1,  0},
+    { 0,  1,  0, -1}
+  };
+  static constexpr Real G[alpha][3] = {
+    {  1,    0,   0},
+    { .5,   .5,  .5},
+    { .5,  -.5,  .5},
+    {  0,    0,   1}
+  };
+  static constexpr Real AT[2][alpha] = {
+    { 1,  1,  1,  0},
+    { 0,  1, -1, -1}
+  };
+};
+
+template<typename Real> struct Winograd<Real, 4>
+{
+  static constexpr int alpha = 6;
+  static constexpr Real BT[alpha][alpha] = {
+    { 4,  0, -5,  0,  1,  0},
+    { 0, -4, -4,  1,  1,  0},
+    { 0,  4, -4, -1,  1,  0},
+    { 0, -2, -1,  2,  1,  0},
+    { 0,  2, -1, -2,  1,  0},
+    { 0,  4,  0, -5,  0,  1}
+  };
+  static constexpr Real G[alpha][3] = {
+    { (Real) 1/ 4,            0,            0},
+    {-(Real) 1/ 6, -(Real) 1/ 6, -(Real) 1/ 6},
+    {-(Real) 1/ 6,  (Real) 1/ 6, -(Real) 1/ 6},
+    { (Real) 1/24,  (Real) 1/12,  (Real) 1/ 6},
+    { (Real) 1/24, -(Real) 1/12,  (Real) 1/ 6},
+    {            0,            0,            1}
+  };
+  static constexpr Real AT[4][alpha] = {
+    { 1,  1,  1,  1,  1,  0},
+    { 0,  1, -1,  2, -2,  0},
+    { 0,  1,  1,  4,  4,  0},
+    { 0,  1, -1,  8, -8,  1}
+  };
+};
+
+template<typename Real> constexpr Real Winograd<Real, 2>::BT[4][4];
+template<typename Real> constexpr Real Winograd<Real, 2>::G[4][3];
+template<typename Real> constexpr Real Winograd<Real, 2>::AT[2][4];
+template<typename Real> constexpr Real Winograd<Real, 4>::BT[6][6];
+template<typename Real> constexpr Real Winograd<Real, 4>::G[6][3];
+template<typename Real> constexpr Real Winograd<Real, 4>::AT[4][6];
+
+// Convolution with KnC filters of size 3 * 3 * InC with stride 1 computed with
+// Winograd's F(m x m, 3 x 3). Outputs larger than 4x4 use F(4x4, 3x3), which
+// needs 36 instead of 144 multiplications per tile and channel pair; smaller
+// outputs use F(2x2, 3x3), which needs 16 instead of 36. Transformed tiles are
+// multiplied with the transformed filters with alpha^2 matrix multiplications.
+// Backward applies the transposed transforms: it is the exact adjoint of the
+// forward operation.
+template
+<
+  typename Real,
+  int InX, int InY, int InC, //input image: x:width, y:height, c:color channels
+  int KnC,                   //number of filters of size 3 * 3 * InC
+  int Px, int Py, // padding x/y
+  int OpX, int OpY //output img: x:width, y:height, same color channels as KnC
+>
+struct WinogradConv2DLayer: public Layer<Real>
+{
+  using Layer<Real>::ID;
+  using Layer<Real>::epilogue;
+  static constexpr int KnX = 3, KnY = 3;
+
+  static constexpr int m = OpX >= 4 && OpY >= 4 ? 4 : 2;
+  using WT = Winograd<Real, m>;
+  static constexpr int alpha = WT::alpha, alpha2 = alpha * alpha;
+  // number of tiles along y and x of each image:
+  static constexpr int tileY = (OpY + m - 1) / m, tileX = (OpX + m - 1) / m;
+  static constexpr int imgTiles = tileY * tileX;
+  // Number of tiles processed at the time by each thread is such that their
+  // transforms fit in cache:
+  static constexpr int panelBytes = 1 << 18;
+  static constexpr int panelTiles =
+    std::max(1, panelBytes / (alpha2 * std::max(InC,KnC) * (int)sizeof(Real)));
+  // In backward each thread processes blocks of whole images. This way it
+  // can scatter the gradient onto the input image without race conditions.
+  static constexpr int imgPerBlock = std::max(1, panelTiles / imgTiles);
+
+  Params<Real>* allocate_params() const override {
+    //number of kernel parameters:
+    // 2d kernel size * number of inp channels * number of out channels
+    const int nParams = KnY * KnX * InC * KnC;
+    const int nBiases = KnC;
+    return new Params<Real>(nParams, nBiases);
+  }
+
+  // bckward needs the input to compute the gradient wrt to the weights, and
+  // the output if it applies the derivative of a fused activation:
+  bool bckwardNeedsOutput() const override {
+    return epilogue != Epilogue::None;
+  }
+  bool canFuseActivation() const override { return true; }
+  // each thread multiplies its own panels:
+  bool blasInParallel(const int batchSize, const bool bck) const override {
+    return true;
+  }
+
+  const char* name() const override { return "WinogradConv2D"; }
+  // flops of the direct convolution, Winograd computes fewer multiplications:
+  double flops(const int batchSize, const bool bck) const override {
+    const double nOut = (double) batchSize * OpY * OpX * KnC;
+    return this->gemmFlops(nOut * KnY * KnX * InC, nOut, bck);
+  }
+  double bytes(const int batchSize, const bool bck) const override {
+    return this->gemmBytes((double) batchSize * InY * InX * InC,
+      (double) batchSize * OpY * OpX * KnC, KnY * KnX * InC * KnC + KnC, bck);
+  }
+
+  bool convShape(ConvShape& S) const override {
+    S = {InX,InY,InC, KnX,KnY,KnC, 1,1, Px,Py, OpX,OpY};
+    return true;
+  }
+
+  // Transformed filters, computed by paramsChanged whenever the weights
+  // change and only read by forward and bckward, and their gradient, written
+  // by bckward. Each of size [alpha^2][InC][KnC]:
+  static constexpr int sizeU = alpha2 * InC * KnC;
+  Real* const U = _myalloc<Real>(2 * sizeU);
+  Real* const dU = U + sizeU;
+
+  void paramsChanged(const std::vector<Params<Real>*>& param) override {
+    transformFilters(param[ID]->weights, U);
+  }
+
+  ~WinogradConv2DLayer() { _myfree(U); }
+
+  WinogradConv2DLayer(const int _ID) : Layer<Real>(OpX * OpY * KnC, _ID) {
+    static_assert(InX>0 && InY>0 && InC>0, "Invalid input");
+    static_assert(KnC>0, "Invalid kernel");
+    static_assert(Px>=0 && Py>=0, "Invalid padding");
+    static_assert(OpX == InX-KnX+2*Px+1 && OpY == InY-KnY+2*Py+1,
+      "Invalid outputs: stride must be 1");
+    print();
+  }
+
+  void print() {
+    printf("(%d) WinogradConv F(%dx%d,3x3): In:[%d %d %d] F:[%d %d %d %d] "
+      "Out:[%d %d %d] with Padding:[%d %d]\n", ID, m, m, InY,InX,InC,
+      KnY,KnX,InC,KnC, OpY,OpX,KnC, Px,Py);
+  }
+
+  void forward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param) const override
+  {
+    assert(act[ID]->layersSize   == OpY * OpX *                   KnC);
+    assert(act[ID-1]->layersSize == InY * InX *                   InC);
+    assert(param[ID]->nWeights   ==             KnY * KnX * InC * KnC);
+    assert(param[ID]->nBiases    ==                               KnC);
+
+    const int batchSize = act[ID]->batchSize;
+    const Real* const INP = act[ID-1]->output;
+    const Real* const bias = param[ID]->biases;
+    Real* const OUT = act[ID]->output;
+    // Output tiles are independent: panels are taken from all the tiles of
+    // the minibatch, smaller than panelTiles if there are too few tiles to
+    // give one to each thread (e.g. for a single image):
+    const int nTilesTot = batchSize * imgTiles, nThreads = omp_get_max_threads();
+    const int tilesPerPanel = std::max(1, std::min(panelTiles,
+                                       (nTilesTot + nThreads - 1) / nThreads));
+
+    // Buffers of forward are kept by each thread between calls: forward does
+    // not allocate.
+    #pragma omp parallel
+    {
+      // transformed input tiles and their product with transformed filters,
+      // sizes [alpha^2][panelTiles][InC] and [alpha^2][panelTiles][KnC]:
+      Real* const V = _scratch<Real>(1, alpha2 * panelTiles * InC);
+      Real* const M = _scratch<Real>(2, alpha2 * panelTiles * KnC);
+      // one input tile and one output tile, not on the stack of the thread:
+      Real* const d = _scratch<Real>(4, alpha2 * InC);
+      Real* const y = _scratch<Real>(5, m * m * KnC);
+
+      #pragma omp for schedule(static)
+      for (int t0 = 0; t0 < nTilesTot; t0 += tilesPerPanel)
+      {
+        const int nT = std::min(tilesPerPanel, nTilesTot - t0);
+        for (int t = 0; t < nT; t++) {
+          gatherInput(INP, t0 + t, d);
+          transform<alpha, alpha, InC>(BT, d, V + t*InC, nT*InC);
+        }
+        // for each point of the tile: [nT, KnC] = [nT, InC] [InC, KnC]
+        for (int xi = 0; xi < alpha2; xi++)
+          gemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, nT, KnC, InC,
+            (Real) 1.0, V + xi*nT*InC, InC, U + xi*InC*KnC, KnC,
+            (Real) 0.0, M + xi*nT*KnC, KnC);
+        for (int t = 0; t < nT; t++) {
+          transform<m, alpha, KnC>(AT, M + t*KnC, nT*KnC, y);
+          // bias and fused activation, if any, on the tile:
+          FusedEpilogue<Real>::forward(epilogue, y, bias, m * m, KnC);
+          scatterOutput(y, t0 + t, OUT);
+        }
+      }
+    }
+  }
+
+  void bckward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param,
+               const std::vector<Params<Real>*>& grad) const override
+  {
+    const int batchSize = act[ID]->batchSize;
+    const int nBlocks = (batchSize + imgPerBlock - 1) / imgPerBlock;
+    const Real* const INP = act[ID-1]->output;
+    const Real* const OUT = act[ID]->output;
+    Real* const dEdO = act[ID]->dError_dOutput;
+    Real* const dEdI = act[ID-1]->dError_dOutput;
+    Real* const gradB = grad[ID]->biases;
+    // each thread's gradients, wrt to U then to the biases:
+    const size_t ldU = _alignedSize<Real>(sizeU);
+    const Real** const parts = _scratch<const Real*>(0, omp_get_max_threads());
+
+    #pragma omp parallel
+    {
+      // per-thread buffers kept between calls, as in forward:
+      Real* const V = _scratch<Real>(1, alpha2 * panelTiles * InC);
+      Real* const dM = _scratch<Real>(2, alpha2 * panelTiles * KnC);
+      Real* const thrU = _scratch<Real>(3, ldU + KnC);
+      Real* const thrB = thrU + ldU;
+      Real* const d = _scratch<Real>(4, alpha2 * InC);
+      Real* const y = _scratch<Real>(5, m * m * KnC);
+      std::fill(thrU, thrU + ldU + KnC, 0);
+      parts[omp_get_thread_num()] = thrU;
+
+      #pragma omp for schedule(static)
+      for (int blck = 0; blck < nBlocks; blck++)
+      {
+        const int imgBeg = blck*imgPerBlock;
+        const int imgEnd = std::min(batchSize, (blck+1)*imgPerBlock);
+        // scatter below accumulates: reset gradient of block's input images
+        std::fill(dEdI + imgBeg * InY*InX*InC, dEdI + imgEnd * InY*InX*InC, 0);
+        // derivative of the fused activation, if any, and bias gradient of
+        // the block's images, before their tiles are gathered:
+        FusedEpilogue<Real>::bckward(epilogue, dEdO + imgBeg * OpY*OpX*KnC,
+          OUT + imgBeg * OpY*OpX*KnC, thrB, (imgEnd-imgBeg) * OpY*OpX, KnC);
+
+        for (int t0 = imgBeg*imgTiles; t0 < imgEnd*imgTiles; t0 += panelTiles)
+        {
+          const int nT = std::min(panelTiles, imgEnd*imgTiles - t0);
+          for (int t = 0; t < nT; t++) {
+            gatherInput(INP, t0 + t, d);
+            transform<alpha, alpha, InC>(BT, d, V + t*InC, nT*InC);
+            gatherOutput(dEdO, t0 + t, y);
+            transform<alpha, m, KnC>(A, y, dM + t*KnC, nT*KnC);
+          }
+          // for each point of the tile: [InC, KnC] += [nT, InC]^T [nT, KnC]
+          for (int xi = 0; xi < alpha2; xi++)
+            gemm(CblasRowMajor, CblasTrans, CblasNoTrans, InC, KnC, nT,
+              (Real) 1.0, V + xi*nT*InC, InC, dM + xi*nT*KnC, KnC,
+              (Real) 1.0, thrU + xi*InC*KnC, KnC);
+          // for each point of the tile: [nT, InC] = [nT, KnC] [InC, KnC]^T
+          for (int xi = 0; xi < alpha2; xi++)
+            gemm(CblasRowMajor, CblasNoTrans, CblasTrans, nT, InC, KnC,
+              (Real) 1.0, dM + xi*nT*KnC, KnC, U + xi*InC*KnC, KnC,
+              (Real) 0.0, V + xi*nT*InC, InC);
+          for (int t = 0; t < nT; t++) {
+            transform<alpha, alpha, InC>(B, V + t*InC, nT*InC, d);
+            scatterInput(d, t0 + t, dEdI);
+          }
+        }
+      }
+
+      // sums over the threads, each of a range of columns:
+      FusedEpilogue<Real>::reduceParts(parts, 0, sizeU, dU);
+      FusedEpilogue<Real>::reduceParts(parts, ldU, KnC, gradB);
+    }
+
+    // gradient wrt to filters: transposed filter transform of dU
+    for (int ic = 0; ic < InC; ic++)
+      transform<3, alpha, KnC>(GT, dU + ic*KnC, InC*KnC,
+        grad[ID]->weights + ic*KnC, InC*KnC);
+  }
+
+  // Coefficients of the transforms and of their transposes:
+  static Real BT(const int i, const int j) { return WT::BT[i][j]; }
+  static Real B (const int i, const int j) { return WT::BT[j][i]; }
+  static Real G (const int i, const int j) { return WT::G [i][j]; }
+  static Real GT(const int i, const int j) { return WT::G [j][i]; }
+  static Real AT(const int i, const int j) { return WT::AT[i][j]; }
+  static Real A (const int i, const int j) { return WT::AT[j][i]; }
+
+  // out = T in T^T, where T has size [nO][nI] and in has size [nI][nI][C].
+  // Rows of in and out (the nI*nI and nO*nO points) are separated by strides
+  // ldi and ldo, the C channels are contiguous.
+  template<int nO, int nI, int C, typename Coef>
+  static void transform(const Coef T,
+    const Real*const __restrict__ in, const int ldi,
+          Real*const __restrict__ out, const int ldo)
+  {
+    // [nO][nI][C], kept by the calling thread (slot 6 is used only here):
+    Real*const __restrict__ tmp = _scratch<Real>(6, nO * nI * C);
+    for (int i = 0; i < nO; i++)
+      for (int j = 0; j < nI; j++) {
+        Real* const t = tmp + (i*nI + j)*C;
+        for (int c = 0; c < C; c++) t[c] = 0;
+        for (int k = 0; k < nI; k++)
+          for (int c = 0; c < C; c++) t[c] += T(i, k) * in[(k*nI + j)*ldi + c];
+      }
+    for (int i = 0; i < nO; i++)
+      for (int j = 0; j < nO; j++) {
+        Real* const o = out + (i*nO + j)*ldo;
+        for (int c = 0; c < C; c++) o[c] = 0;
+        for (int k = 0; k < nI; k++) {
+          const Real* const t = tmp + (i*nI + k)*C;
+          for (int c = 0; c < C; c++) o[c] += T(j, k) * t[c];
+        }
+      }
+  }
+  template<int nO, int nI, int C, typename Coef>
+  static void transform(const Coef T, const Real*const in, Real*const out,
+    const int ldo) { transform<nO, nI, C>(T, in, C, out, ldo); }
+  template<int nO, int nI, int C, typename Coef>
+  static void transform(const Coef T, const Real*const in, const int ldi,
+    Real*const out) { transform<nO, nI, C>(T, in, ldi, out, C); }
+  template<int nO, int nI, int C, typename Coef>
+  static void transform(const Coef T, const Real*const in, Real*const out) {
+    transform<nO, nI, C>(T, in, C, out, C);
+  }
+
+  // U = G W GT for each pair of input and output channels. Both the filters
+  // and U are stored with the output channel as the fastest index.
+  static void transformFilters(const Real*const W, Real*const U)
+  {
+    for (int ic = 0; ic < InC; ic++)
+      transform<alpha, 3, KnC>(G, W + ic*KnC, InC*KnC, U + ic*KnC, InC*KnC);
+  }
+
+  // Tile `tile` of the minibatch: image index and position of tile's corner.
+  static void tilePosition(const int tile, int& b, int& y0, int& x0) {
+    b = tile / imgTiles;
+    y0 = m * ((tile % imgTiles) / tileX);
+    x0 = m * ((tile % imgTiles) % tileX);
+  }
+
+  // Copy input tile of size [alpha][alpha][InC] with zeros for padding:
+  static void gatherInput(const Real*const __restrict__ lin_inp,
+                          const int tile, Real*const __restrict__ d)
+  {
+    using InputImages = Real[][InY][InX][InC];
+    const InputImages & __restrict__ INP = * (InputImages*) lin_inp;
+    int b, y0, x0; tilePosition(tile, b, y0, x0);
+    for (int i = 0; i < alpha; i++)
+    for (int j = 0; j < alpha; j++) {
+      const int iy = y0 + i - Py, ix = x0 + j - Px;
+      Real* const dij = d + (i*alpha + j) * InC;
+      if (ix < 0 || ix >= InX || iy < 0 || iy >= InY)
+        std::fill(dij, dij + InC, 0);
+      else std::copy(INP[b][iy][ix], INP[b][iy][ix] + InC, dij);
+    }
+  }
+
+  // Add gradient of input tile of size [alpha][alpha][InC] onto dLdINP:
+  static void scatterInput(const Real*const __restrict__ d, const int tile,
+                           Real*const __restrict__ lin_out)
+  {
+    using InputImages = Real[][InY][InX][InC];
+    InputImages & __restrict__ dLdINP = * (InputImages*) lin_out;
+    int b, y0, x0; tilePosition(tile, b, y0, x0);
+    for (int i = 0; i < alpha; i++)
+    for (int j = 0; j < alpha; j++) {
+      const int iy = y0 + i - Py, ix = x0 + j - Px;
+      if (ix < 0 || ix >= InX || iy < 0 || iy >= InY) continue;
+      const Real* const dij = d + (i*alpha + j) * InC;
+      for (int ic = 0; ic < InC; ic++) dLdINP[b][iy][ix][ic] += dij[ic];
+    }
+  }
+
+  // Copy output tile of size [m][m][KnC] onto the output images:
+  static void scatterOutput(const Real*const __restrict__ y, const int tile,
+    Real*const __restrict__ lin_out)
+  {
+    using OutputImages = Real[][OpY][OpX][KnC];
+    OutputImages & __restrict__ OUT = * (OutputImages*) lin_out;
+    int b, y0, x0; tilePosition(tile, b, y0, x0);
+    for (int i = 0; i < m && y0 + i < OpY; i++)
+    for (int j = 0; j < m && x0 + j < OpX; j++)
+      for (int c = 0; c < KnC; c++)
+        OUT[b][y0+i][x0+j][c] = y[(i*m + j)*KnC + c];
+  }
+
+  // Copy gradient of output tile of size [m][m][KnC], zero outside image:
+  static void gatherOutput(const Real*const __restrict__ lin_inp,
+                           const int tile, Real*const __restrict__ y)
+  {
+    using OutputImages = Real[][OpY][OpX][KnC];
+    const OutputImages & __restrict__ dLdOUT = * (OutputImages*) lin_inp;
+    int b, y0, x0; tilePosition(tile, b, y0, x0);
+    for (int i = 0; i < m; i++)
+    for (int j = 0; j < m; j++) {
+      Real* const yij = y + (i*m + j) * KnC;
+      if (y0 + i >= OpY || x0 + j >= OpX) std::fill(yij, yij + KnC, 0);
+      else std::copy(dLdOUT[b][y0+i][x0+j], dLdOUT[b][y0+i][x0+j]+KnC, yij);
+    }
+  }
+
+  void init(std::mt19937& gen,
+            const std::vector<Params<Real>*>& param) const override
+  {
+    // get pointers to layer's weights and bias
+    Real *const W = param[ID]->weights, *const bias = param[ID]->biases;
+    // initialize weights with Xavier initialization
+    const int nAdded = KnX * KnY * InC, nW = param[ID]->nWeights;
+    const Real scale = std::sqrt(6.0 / (nAdded + KnC));
+    std::uniform_real_distribution < Real > dis(-scale, scale);
+    std::generate(W, W + nW, [&]() {return dis( gen );});
+    std::fill(bias, bias + KnC, 0);
+  }
+};
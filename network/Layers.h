@@ -10,16 +10,22 @@
 
 #pragma once
 #include "Activations.h"
+#include "Blas.h"
+#include "Epilogue.h"
 
-#ifdef USE_MKL
-#include "mkl_cblas.h"
-#else
-#ifndef __STDC_VERSION__ //it should never be defined with g++
-#define __STDC_VERSION__ 0
-#endif
-#include "cblas.h"
-#endif
+// Geometry of a layer that convolves its input image with KnC filters. Linear
+// layers are 1x1 convolutions of a 1x1 image with nInputs channels:
+struct ConvShape
+{
+  int InX, InY, InC, KnX, KnY, KnC, Sx, Sy, Px, Py, OpX, OpY;
+
+  bool valid() const {
+    return InX>0 && InY>0 && InC>0 && KnX>0 && KnY>0 && KnC>0 &&
+           Sx>0 && Sy>0 && Px>=0 && Py>=0 && OpX>0 && OpY>0;
+  }
+};
 
+template<typename Real>
 struct Layer
 {
   const int size, ID;
@@ -27,48 +33,124 @@ struct Layer
   Layer(const int _size, const int _ID) : size(_size), ID(_ID) {}
   virtual ~Layer() {}
 
-  virtual void forward(const std::vector<Activation*>& act,
-                       const std::vector<Params*>& param) const=0;
+  virtual void forward(const std::vector<Activation<Real>*>& act,
+                       const std::vector<Params<Real>*>& param) const=0;
 
-  virtual void bckward(const std::vector<Activation*>& act,
-                       const std::vector<Params*>& param,
-                       const std::vector<Params*>& grad) const=0;
+  virtual void bckward(const std::vector<Activation<Real>*>& act,
+                       const std::vector<Params<Real>*>& param,
+                       const std::vector<Params<Real>*>& grad) const=0;
 
-  virtual void init(std::mt19937& G, const std::vector<Params*>& P) const = 0;
+  virtual void init(std::mt19937& G,
+                    const std::vector<Params<Real>*>& P) const = 0;
 
-  Activation* allocateActivation(const unsigned batchSize) {
-    return new Activation(batchSize, size);
+  // Loss layers compute the loss of the minibatch given integer labels and
+  // write the gradient of the loss wrt to the layer's input (act[ID-1]).
+  // Returns the loss summed over the minibatch.
+  virtual Real loss(const std::vector<Activation<Real>*>& act,
+                    const int* const labels) const {
+    printf("Layer %d is not a loss layer. Aborting.\n", ID);
+    abort();
   }
-  virtual Params* allocate_params() const = 0;
 
+  // Used to plan the workspace (see WorkspacePlan.h). Whether bckward reads
+  // the layer's input (act[ID-1]->output) and output (act[ID]->output):
+  virtual bool bckwardNeedsInput()  const { return true; }
+  virtual bool bckwardNeedsOutput() const { return true; }
+  // Whether forward can write the output over the input and bckward the
+  // gradient wrt to input over the gradient wrt to output (e.g. element-wise):
+  virtual bool canRunInPlace() const { return false; }
+
+  // Layers that add a bias to a matrix product can also apply the activation
+  // that follows them (see Epilogue.h): then the network does not add the
+  // activation layer. A fused bckward reads the layer's output and overwrites
+  // dError_dOutput with the gradient wrt to the activation's input.
+  virtual bool canFuseActivation() const { return false; }
+  Epilogue epilogue = Epilogue::None;
+
+  // Whether forward (bck=false) or bckward (bck=true) call BLAS from each
+  // thread, rather than from the master thread: then the network runs BLAS
+  // single-threaded (see Execution.h).
+  virtual bool blasInParallel(const int batchSize, const bool bck) const {
+    return false;
+  }
 
-  virtual void    save(const std::vector<Params*>& param) const {
-    if(param[ID] not_eq nullptr) param[ID]->save(std::to_string(ID));
-  };
+  // Used by the profiler (see Profiler.h). Analytic estimates of the floating
+  // point operations and of the bytes read or written by forward (bck=false)
+  // or bckward (bck=true) on a minibatch. Defaults are for element-wise
+  // layers with one operation per element.
+  virtual const char* name() const { return "Layer"; }
+  virtual double flops(const int batchSize, const bool bck) const {
+    return (double) batchSize * size;
+  }
+  virtual double bytes(const int batchSize, const bool bck) const {
+    // forward reads input and writes output, bckward also reads the output:
+    return (bck ? 3.0 : 2.0) * batchSize * size * sizeof(Real);
+  }
+  // Used by the quantized engine (see Quantized.h): layers whose forward is a
+  // convolution with weights [KnY][KnX][InC][KnC] and biases [KnC] write its
+  // geometry and return true.
+  virtual bool convShape(ConvShape& S) const { return false; }
+
+  // State that forward uses but the optimizer does not train, e.g. running
+  // statistics, saved in checkpoints with the params:
+  virtual size_t stateSize() const { return 0; }
+  virtual Real* state() const { return nullptr; }
+  // Selects whether forward normalizes with the statistics of the minibatch
+  // (training) or with the accumulated ones (see Network::setTraining):
+  virtual void setTraining(const bool training) {}
+  // Layers that compute y = scale * x + shift per channel in inference can
+  // fold it into the weights and biases, prevParams, of the previous layer
+  // prev (see Network::foldBatchNorm). Returns whether it was folded.
+  virtual bool foldInto(const Layer<Real>& prev, Params<Real>* const prevParams,
+                        const Params<Real>* const own) { return false; }
+  // Layers that keep values computed from their params, e.g. transformed
+  // filters, compute them again (see Network::paramsChanged). forward only
+  // reads them: concurrent forwards of the same layer do not race.
+  virtual void paramsChanged(const std::vector<Params<Real>*>& param) {}
+
+  // Estimates for layers that multiply their input with their weights, given
+  // the number of multiply-adds, of input and output values, and of params.
+  // bckward computes two products, the bias grads, and writes the grads:
+  static double gemmFlops(const double nMACs, const double nOut,
+                          const bool bck) {
+    return bck ? 4 * nMACs + nOut : 2 * nMACs;
+  }
+  static double gemmBytes(const double nInp, const double nOut,
+                          const double nParams, const bool bck) {
+    return (bck ? 2*nInp + nOut + 2*nParams : nInp + nOut + nParams)
+           * sizeof(Real);
+  }
 
-  virtual void restart(const std::vector<Params*>& param) const {
-    if(param[ID] not_eq nullptr) param[ID]->save(std::to_string(ID));
-  };
+  Activation<Real>* allocateActivation(const unsigned batchSize) {
+    return new Activation<Real>(batchSize, size);
+  }
+  virtual Params<Real>* allocate_params() const = 0;
 };
 
-template<int nOutputs>
-struct Input_Layer: public Layer
+// Input layer of runtime size, used by both Network::addInput functions:
+template<typename Real>
+struct Input_Layer: public Layer<Real>
 {
-  Input_Layer() : Layer(nOutputs, 0) {
+  using Layer<Real>::ID;
+
+  Input_Layer(const int nOutputs) : Layer<Real>(nOutputs, 0) {
     printf("(%d) Input Layer of sizes Output:%d\n", ID, nOutputs);
   }
 
-  Params* allocate_params() const override {
+  Params<Real>* allocate_params() const override {
     // non linear activation layers have no parameters:
     return nullptr;
   }
 
-  void forward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param) const override {}
+  const char* name() const override { return "Input"; }
+
+  void forward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param) const override {}
 
-  void bckward(const std::vector<Activation*>& act,
-               const std::vector<Params*>& param,
-               const std::vector<Params*>& grad)  const override {}
+  void bckward(const std::vector<Activation<Real>*>& act,
+               const std::vector<Params<Real>*>& param,
+               const std::vector<Params<Real>*>& grad)  const override {}
 
-  void init(std::mt19937& G, const std::vector<Params*>& P) const override {}
+  void init(std::mt19937& G,
+            const std::vector<Params<Real>*>& P) const override {}
 };
@@ -9,54 +9,204 @@
 //
 
 #pragma once
-#include "Layers.h"
+#include "WorkspacePlan.h"
+#include "Profiler.h"
+#include "Distributed.h"
+#include "Checkpoint.h"
+#include "Execution.h"
+#include <map>
 
+template<typename Real>
 struct Network
 {
   std::mt19937 gen;
   // Vector of layers, each defines a forward and bckward operation:
-  std::vector<Layer*>  layers;
+  std::vector<Layer<Real>*>  layers;
   // Vector of parameters of each layer (two vectors must have the same size)
   // Each Params contains the matrices of parameters needed by the corresp layer
-  std::vector<Params*> params;
+  std::vector<Params<Real>*> params;
   // Vector of grads for each parameter. By definition they have the same size
-  std::vector<Params*>  grads;
-  // Memory space where each layer can compute its output and gradient:
-  std::vector<Activation*> workspace;
+  std::vector<Params<Real>*>  grads;
+  // All parameters, and all grads, are stored contiguously in two flat arrays
+  // with the same layout: params and grads are views onto them.
+  Real* flatParams = nullptr;
+  Real* flatGrads  = nullptr;
+  // Size of the flat arrays, including padding that aligns each view:
+  size_t flatSize = 0;
+  // Memory space where each layer can compute its output and gradient. Each
+  // Activation is a view onto the arena, laid out by a WorkspacePlan:
+  std::vector<Activation<Real>*> workspace;
+  Real* arena = nullptr;
+  // Input buffer within the arena. setInput can point the view of the input
+  // layer elsewhere, getInputBuffer points it back here:
+  Real* arenaInput = nullptr;
+  // If true the workspace only supports forward, and needs less memory:
+  bool inferenceOnly = false;
   // Number of inputs to the network:
   int nInputs = 0;
   // Number of network outputs:
   int nOutputs = 0;
-  size_t alloc_batchSize = 0;
+  // The workspace is allocated for minibatches of up to `capacity` samples,
+  // its views currently have alloc_batchSize rows:
+  size_t alloc_batchSize = 0, capacity = 0;
+  // If true, addLReLu and addTanh apply the activation in the epilogue of the
+  // previous layer, if it supports it, instead of adding a layer. Must be set
+  // before building the network.
+  bool fuseActivations = true;
+  // If false, allocateWorkspace does not print the sizes of the workspace:
+  bool verbose = true;
+  // Names given to layers by nameLayer, e.g. from a network spec file:
+  std::map<std::string, size_t> layerNames;
+  // Time, flops and bytes of each layer, if compiled with -DTDLL_PROFILE:
+  mutable Profiler<Real> profiler;
+  // Sums the grads over MPI ranks during bckward, after Network::distribute:
+  mutable GradientAllreduce<Real> allreduce;
+  // Pins the threads, selects the BLAS threads of each layer and places the
+  // buffers on the memory of the threads that use them:
+  ExecutionContext exec;
 
   Network(const int seed = 0) : gen(seed) {};
 
-  void forward(
-              std::vector<std::vector<Real>>& O,
-        // one vector of input for each element in the mini-batch:
-        const std::vector<std::vector<Real>> I,
-        // layer ID at which to start forward operation:
-        const size_t layerStart = 0 // (zero means compute from input to output)
-    )
+  // Names the last layer added, whose output can then be read or overwritten
+  // by name rather than by ID. If an activation was fused into the last layer
+  // the name refers to the activated output of that layer.
+  void nameLayer(const std::string& name)
+  {
+    if (layers.size() == 0 || layerNames.count(name)) {
+      printf("Cannot name layer %s. Aborting.\n", name.c_str()); abort();
+    }
+    layerNames[name] = layers.size() - 1;
+  }
+
+  size_t layerID(const std::string& name) const
+  {
+    const auto it = layerNames.find(name);
+    if (it == layerNames.end()) {
+      printf("No layer named %s. Aborting.\n", name.c_str()); abort();
+    }
+    return it->second;
+  }
+
+  // Zero-copy interface: returns the memory space where the caller can write
+  // the minibatch before calling forward(batchSize, layerStart). Respective
+  // workspace is a row-major matrix of size [batchSize]x[size of layerStart].
+  Real* getInputBuffer(const size_t batchSize, const size_t layerStart = 0)
   {
     if(params.size()==0 || grads.size()==0 || layers.size()==0) {
       printf("Attempted to access uninitialized network. Aborting\n");
       abort();
     }
+    assert(batchSize > 0 && layerStart < layers.size());
 
-    // input is a minibatch of datapoints: one vector for each datapoint:
-    const size_t batchSize = I.size();
-
-    // allocate workspaces where we can write output of each layer
+    // allocate workspaces where we can write output of each layer. Capacity
+    // grows geometrically: smaller minibatches (e.g. the last of an epoch or
+    // for evaluation) only change the number of rows of the views.
+    if (batchSize > capacity)
+      allocateWorkspace(std::max(batchSize, 2 * capacity));
     if (batchSize not_eq alloc_batchSize) {
-      clearWorkspace();
+      for(auto& p : workspace) p->batchSize = batchSize;
       alloc_batchSize = batchSize;
-      workspace = allocateActivation(batchSize);
     }
+    workspace[0]->output = arenaInput;
+    return workspace[layerStart]->output;
+  }
+
+  // Zero-copy interface for minibatches already in memory owned by the caller
+  // (e.g. the ring of a DataLoader): the view of the input layer points to I
+  // rather than to the workspace, until the next call to getInputBuffer. The
+  // network never writes onto I, which must be unchanged until bckward.
+  void setInput(const Real* const I, const size_t batchSize)
+  {
+    getInputBuffer(batchSize);
+    workspace[0]->output = const_cast<Real*>(I);
+  }
+
+  // Select whether the workspace will be planned for forward only. Takes
+  // effect at the next call to getInputBuffer: buffers are reallocated.
+  void setInferenceOnly(const bool inference)
+  {
+    if (inference == inferenceOnly) return;
+    inferenceOnly = inference;
+    clearWorkspace();
+  }
+
+  // Activation of the last layer: its output contains the network's output
+  // after forward, its dError_dOutput is read by bckward.
+  const Activation<Real>* getOutputActivation() const
+  {
+    assert(workspace.size() == layers.size());
+    return workspace.back();
+  }
+
+  // Memory space where the caller can write the gradient of the error wrt to
+  // the network's output before calling bckward(layerStart). Respective
+  // workspace is a row-major matrix of size [batchSize]x[nOutputs].
+  Real* getOutputErrorBuffer() const
+  {
+    assert(workspace.size() == layers.size());
+    return workspace.back()->dError_dOutput;
+  }
+
+  // Forward operation on the minibatch written in getInputBuffer(batchSize):
+  void forward(const size_t batchSize, const size_t layerStart = 0)
+  {
+    if(params.size()==0 || grads.size()==0 || layers.size()==0) {
+      printf("Attempted to access uninitialized network. Aborting\n");
+      abort();
+    }
+    assert(batchSize == alloc_batchSize && workspace.size() == layers.size());
+
+    // Start from layer after input. E.g. Input layer is 0. No need to backprop
+    // input layer has it has no parameters.
+    for (size_t j=layerStart+1; j<layers.size(); j++) {
+      exec.blasFor(layers[j]->blasInParallel(batchSize, false));
+      const double t0 = profiler.start();
+      layers[j]->forward(workspace, params);
+      profiler.stop(layers[j], false, batchSize, t0);
+    }
+  }
 
+  void forward(
+        // if not null, row-major matrix of size [batchSize]x[nOutputs]:
+              Real* const O,
+        // row-major matrix of size [batchSize]x[size of layer layerStart]:
+        const Real* const I,
+        const size_t batchSize,
+        // layer ID at which to start forward operation:
+        const size_t layerStart = 0 // (zero means compute from input to output)
+    )
+  {
     // User can overwrite the output of any upper layer (marked by layerStart)
     // in order to see what happens if layer layerStart has a predefined output.
     // ( e.g. this allows visualizing PCA components! )
+    Real* const input = getInputBuffer(batchSize, layerStart);
+    const int inputLayerSize = workspace[layerStart]->layersSize;
+
+    // copy input onto output of input layer, unless the caller already wrote
+    // the minibatch onto the workspace:
+    if(I not_eq input) std::copy(I, I + batchSize * inputLayerSize, input);
+
+    forward(batchSize, layerStart);
+
+    // copy the output of the last layer, if the caller wants it:
+    if(O not_eq nullptr) {
+      assert(nOutputs == workspace.back()->layersSize);
+      const Real* const output = workspace.back()->output;
+      std::copy(output, output + batchSize * nOutputs, O);
+    }
+  }
+
+  void forward(
+              std::vector<std::vector<Real>>& O,
+        // one vector of input for each element in the mini-batch:
+        const std::vector<std::vector<Real>>& I,
+        // layer ID at which to start forward operation:
+        const size_t layerStart = 0 // (zero means compute from input to output)
+    )
+  {
+    // input is a minibatch of datapoints: one vector for each datapoint:
+    const size_t batchSize = I.size();
+    Real* const input = getInputBuffer(batchSize, layerStart);
     const int inputLayerSize = workspace[layerStart]->layersSize;
 
     //copy input onto output of input layer:
@@ -67,15 +217,10 @@ struct Network
       // Input to the network is the output of input layer.
       // Respective workspace is a matrix of size [batchSize]x[nInputs]
       // Here we use row-major ordering: nInputs is the number of columns.
-      Real* const input_b = workspace[layerStart]->output + b * inputLayerSize;
-      // copy from function argument to workspace:
-      std::copy(I[b].begin(), I[b].end(), input_b);
+      std::copy(I[b].begin(), I[b].end(), input + b * inputLayerSize);
     }
 
-    // Start from layer after input. E.g. Input layer is 0. No need to backprop
-    // input layer has it has no parameters.
-    for (size_t j=layerStart+1; j<layers.size(); j++)
-      layers[j]->forward(workspace, params);
+    forward(batchSize, layerStart);
 
     // copy output into vector of vectors: one vector for each element of batch
     O.resize(batchSize);
@@ -88,15 +233,14 @@ struct Network
       // network output is the output of last layer.
       // Respective workspace is a matrix of size [batchSize]x[nOutputs]
       // Here we use row-major ordering: nOutputs is the number of columns.
-      Real* const output_b = workspace.back()->output + b * nOutputs;
+      const Real* const output_b = workspace.back()->output + b * nOutputs;
       // copy from function argument to workspace:
       std::copy(output_b, output_b + nOutputs, O[b].begin());
     }
   }
 
+  // Backward operation on the gradients written in getOutputErrorBuffer():
   void bckward(
-    // vector of size of mini-batch of gradients of error wrt to network output
-    const std::vector<std::vector<Real>> E,
     // layer ID at which forward operation was started:
     const size_t layerStart=0 // (zero means compute from input to output)
   ) const
@@ -107,9 +251,52 @@ struct Network
       printf("Attempted to access uninitialized network. Aborting\n");
       abort();
     }
+    assert(workspace.size() == layers.size() && not inferenceOnly);
+
+    // Backprop starts at the last layer, which computes gradient of error wrt
+    // to its parameters and gradient of error wrt to it's input.
+    // Last layer to backprop is the one above input layer. Eg. if layerStart=0
+    // Then input layer was 0, which has no parametes and has no inputs to
+    // backprp the error grad to, last layer to backprop is layer 1.
+    const int batchSize = workspace.back()->batchSize;
+    allreduce.begin(flatSize);
+    for (size_t i = layers.size()-1; i >= layerStart + 1; i--) {
+      exec.blasFor(layers[i]->blasInParallel(batchSize, true));
+      const double t0 = profiler.start();
+      layers[i]->bckward(workspace, params, grads);
+      profiler.stop(layers[i], true, batchSize, t0);
+      allreduce.ready(grads[i]);
+    }
+    allreduce.finish();
+  }
+
+  void bckward(
+    // row-major matrix of size [batchSize]x[nOutputs] of gradients of error
+    // wrt to network output:
+    const Real* const E,
+    const size_t batchSize,
+    // layer ID at which forward operation was started:
+    const size_t layerStart=0 // (zero means compute from input to output)
+  ) const
+  {
+    assert( (size_t) workspace.back()->batchSize == batchSize);
+    Real* const errors = getOutputErrorBuffer();
+    // copy unless the caller already wrote the gradients onto the workspace:
+    if(E not_eq errors) std::copy(E, E + batchSize * nOutputs, errors);
+    bckward(layerStart);
+  }
+
+  void bckward(
+    // vector of size of mini-batch of gradients of error wrt to network output
+    const std::vector<std::vector<Real>>& E,
+    // layer ID at which forward operation was started:
+    const size_t layerStart=0 // (zero means compute from input to output)
+  ) const
+  {
     // input is a minibatch of datapoints: one vector for each datapoint:
     const size_t batchSize = E.size();
     assert( (size_t) workspace.back()->batchSize == batchSize);
+    Real* const errors = getOutputErrorBuffer();
 
     //copy input onto output of input layer:
     #pragma omp parallel for schedule(static)
@@ -119,80 +306,286 @@ struct Network
       // Write d Err / d Out onto last layer of the network.
       // Respective workspace is a matrix of size [batchSize]x[nOutputs]
       // Here we use row-major ordering: nOutputs is the number of columns.
-      Real* const errors_b = workspace.back()->dError_dOutput + b * nOutputs;
-      // copy from function argument to workspace:
-      std::copy(E[b].begin(), E[b].end(), errors_b);
+      std::copy(E[b].begin(), E[b].end(), errors + b * nOutputs);
     }
 
-    // Backprop starts at the last layer, which computes gradient of error wrt
-    // to its parameters and gradient of error wrt to it's input.
-    // Last layer to backprop is the one above input layer. Eg. if layerStart=0
-    // Then input layer was 0, which has no parametes and has no inputs to
-    // backprp the error grad to, last layer to backprop is layer 1.
-    for (size_t i = layers.size()-1; i >= layerStart + 1; i--)
+    bckward(layerStart);
+  }
+
+  // For networks ending with a loss layer (e.g. SoftMaxCrossEntropy): computes
+  // the gradient of the loss given one integer label per element of the
+  // minibatch and backprops it. Returns the loss summed over the minibatch.
+  Real bckward(
+    const int* const labels,
+    const size_t batchSize,
+    // layer ID at which forward operation was started:
+    const size_t layerStart=0 // (zero means compute from input to output)
+  ) const
+  {
+    if(params.size()==0 || grads.size()==0 || layers.size()==0)
+    {
+      printf("Attempted to access uninitialized network. Aborting\n");
+      abort();
+    }
+    assert( (size_t) workspace.back()->batchSize == batchSize);
+    assert(layers.size() > layerStart + 1 && not inferenceOnly);
+
+    // Loss layer writes the gradient of the loss wrt to its input:
+    const double t0 = profiler.start();
+    const Real loss = layers.back()->loss(workspace, labels);
+    profiler.stop(layers.back(), true, batchSize, t0);
+    // Therefore backprop starts from the layer before the last:
+    allreduce.begin(flatSize);
+    for (size_t i = layers.size()-2; i >= layerStart + 1; i--) {
+      exec.blasFor(layers[i]->blasInParallel(batchSize, true));
+      const double t1 = profiler.start();
       layers[i]->bckward(workspace, params, grads);
+      profiler.stop(layers[i], true, batchSize, t1);
+      allreduce.ready(grads[i]);
+    }
+    allreduce.finish();
+    return loss;
   }
 
   // Helper function for forward with batchsize = 1
-  std::vector<Real> forward(const std::vector<Real>I, const size_t layerStart=0)
+  std::vector<Real> forward(const std::vector<Real>& I, const size_t layerStart=0)
   {
-    std::vector<std::vector<Real>> vecO (1, std::vector<Real>(nOutputs));
-    const std::vector<std::vector<Real>> vecI (1, I);
-    forward(vecO, vecI, layerStart);
-    return vecO[0];
+    std::vector<Real> O(nOutputs);
+    forward(O.data(), I.data(), 1, layerStart);
+    return O;
   }
 
   // Helper function for forward with batchsize = 1)
-  void bckward(const std::vector<Real> E, const size_t layerStart = 0) const
+  void bckward(const std::vector<Real>& E, const size_t layerStart = 0) const
+  {
+    assert(E.size() == (size_t) nOutputs);
+    bckward(E.data(), 1, layerStart);
+  }
+
+  // If compiled with -DTDLL_PROFILE, prints the time, flops and bytes of each
+  // layer accumulated since the previous call and appends them to the JSON
+  // file profiler.fname. Otherwise does nothing.
+  void reportProfile(const int epoch) const
   {
-    std::vector<std::vector<Real>> vecE (1, E);
-    bckward(vecE, layerStart);
+    profiler.report(layers, epoch);
   }
 
   ~Network() {
     for(auto& p : grads)      _dispose_object(p);
     for(auto& p : params)     _dispose_object(p);
     for(auto& p : layers)     _dispose_object(p);
-    for(auto& p : workspace)  _dispose_object(p);
+    clearWorkspace();
+    _myfree(flatParams);
+    _myfree(flatGrads);
+  }
+
+  // Moves all parameters and grads onto the flat arrays, replacing params
+  // and grads with views. Values are preserved. Called after adding a layer.
+  void packParams()
+  {
+    assert(params.size() == layers.size() && grads.size() == layers.size());
+    size_t size = 0;
+    for(const auto& p : params) if(p not_eq nullptr)
+      size += _alignedSize<Real>(p->nWeights) + _alignedSize<Real>(p->nBiases);
+
+    Real* const P = _myalloc<Real>(size);
+    Real* const G = _myalloc<Real>(size);
+    // zero padding, touched by the threads that update each part:
+    exec.firstTouch(P, size);
+    exec.firstTouch(G, size);
+
+    size_t offset = 0;
+    for(size_t j=0; j<layers.size(); j++)
+    {
+      if(params[j] == nullptr) continue;
+      const int nW = params[j]->nWeights, nB = params[j]->nBiases;
+      const size_t offsetW = offset, offsetB = offset + _alignedSize<Real>(nW);
+      offset = offsetB + _alignedSize<Real>(nB);
+
+      std::copy(params[j]->weights, params[j]->weights + nW, P + offsetW);
+      std::copy(params[j]->biases,  params[j]->biases  + nB, P + offsetB);
+      std::copy( grads[j]->weights,  grads[j]->weights + nW, G + offsetW);
+      std::copy( grads[j]->biases,   grads[j]->biases  + nB, G + offsetB);
+      _dispose_object(params[j]);
+      _dispose_object( grads[j]);
+      params[j] = new Params<Real>(nW, nB, P + offsetW, P + offsetB);
+       grads[j] = new Params<Real>(nW, nB, G + offsetW, G + offsetB);
+    }
+    assert(offset == size);
+
+    _myfree(flatParams); flatParams = P;
+    _myfree(flatGrads);  flatGrads  = G;
+    flatSize = size;
+  }
+
+#ifdef USE_MPI
+  // Data-parallel training: each rank of comm holds a replica of the network
+  // and calls forward and bckward on its own shard of each minibatch, after
+  // which bckward leaves on all ranks the grads summed over the minibatch.
+  // Parameters are copied from rank 0. Call after building the network:
+  void distribute(const MPI_Comm comm)
+  {
+    allreduce.init(comm, flatGrads);
+    MPI_Bcast(flatParams, flatSize, allreduce.datatype(), 0, comm);
+    paramsChanged();
+  }
+#endif
+
+  // Writes the params and the state of the generator to the checkpoint file
+  // fname (see Checkpoint.h). Optimizer::save also writes its state.
+  void save(const std::string fname) const
+  {
+    CheckpointWriter<Real> writer;
+    writer.write(*this, fname);
+  }
+
+  // Restores the params and the generator from the checkpoint file fname:
+  void restart(const std::string fname)
+  {
+    CheckpointFile<Real>(fname).restore(*this);
+  }
+
+  // Called after every change of the params: by the build functions, by
+  // Optimizer::update, restart, distribute and foldBatchNorm. Callers that
+  // write onto the params directly must call it before the next forward.
+  void paramsChanged()
+  {
+    for (auto& l : layers) l->paramsChanged(params);
+  }
+
+  // Selects whether layers such as batch normalization use the statistics of
+  // each minibatch and update their running ones (training, the default), or
+  // use the running ones, e.g. to evaluate on a test set. Workspaces for
+  // inference only, and InferenceContext, always use the running ones.
+  void setTraining(const bool training)
+  {
+    for (auto& l : layers) l->setTraining(training);
+  }
+
+  // Folds each batch normalization into the weights and biases of the
+  // preceding convolution or Linear layer, if it has no fused activation, to
+  // export the network for inference: the folded layers then copy their
+  // input, in place, and the network can no longer be trained. Returns the
+  // number of layers folded. Inference contexts must be created afterwards.
+  // Checkpoints save the fold: networks restarted from them are folded too.
+  size_t foldBatchNorm()
+  {
+    size_t nFolded = 0;
+    for (size_t j=2; j<layers.size(); j++)
+      if (layers[j]->foldInto(*layers[j-1], params[j-1], params[j])) {
+        printf("(%lu) %s folded into layer %lu\n", j, layers[j]->name(), j-1);
+        nFolded++;
+      }
+    // plan again: folded layers may now run in place
+    if (nFolded) { paramsChanged(); clearWorkspace(); }
+    return nFolded;
   }
 
   inline void clearWorkspace() {
     for(auto& p : workspace) _dispose_object(p);
     workspace.clear();
+    _myfree(arena);
+    arena = arenaInput = nullptr;
+    alloc_batchSize = 0;
+    capacity = 0;
   }
 
-  // Function to loop over layers and allocate workspace for network operations:
-  inline std::vector<Activation*> allocateActivation(size_t batchSize) const
+  // Buffers of the workspace, for both training and inference:
+  WorkspacePlan<Real> planWorkspace(const size_t batchSize,
+                                    const bool training) const
   {
-    std::vector<Activation*> ret(layers.size(), nullptr);
-    for(size_t j=0; j<layers.size(); j++)
-      ret[j] = layers[j]->allocateActivation(batchSize);
-    return ret;
+    return WorkspacePlan<Real>(layers, batchSize, training);
   }
 
-  // Function to loop over layers and allocate memory space for parameter grads:
-  inline std::vector<Params*> allocateGrad() const
+  // Function to plan and allocate the workspace for network operations on
+  // minibatches of up to batchSize samples. Buffers of the plan only grow
+  // with the batch size, so the offsets are valid for any smaller batch.
+  void allocateWorkspace(const size_t batchSize)
   {
-    std::vector<Params*> ret(layers.size(), nullptr);
-    for(size_t j=0; j<layers.size(); j++)
-      ret[j] = layers[j]->allocate_params();
-    return ret;
+    clearWorkspace();
+    const WorkspacePlan<Real> plan = planWorkspace(batchSize, !inferenceOnly);
+    const WorkspacePlan<Real> other = planWorkspace(batchSize, inferenceOnly);
+    const WorkspacePlan<Real>& train = inferenceOnly ? other : plan;
+    const WorkspacePlan<Real>& infer = inferenceOnly ? plan : other;
+    if (verbose) printf("Workspace for batch sizes up to %lu: naive total %lu "
+      "bytes, planned peak %lu bytes for training, %lu bytes for inference. "
+      "Allocated for %s.\n", batchSize, plan.naiveSize * sizeof(Real),
+      train.arenaSize * sizeof(Real), infer.arenaSize * sizeof(Real),
+      inferenceOnly ? "inference" : "training");
+
+    exec.pinIfRequested();
+    arena = _myalloc<Real>(plan.arenaSize);
+    workspace.resize(layers.size(), nullptr);
+    for(size_t j=0; j<layers.size(); j++) {
+      Real* const err = inferenceOnly ? nullptr : arena + plan.errOffset[j];
+      workspace[j] = new Activation<Real>(batchSize, layers[j]->size,
+        arena + plan.outOffset[j], err);
+      // each thread touches the rows of the minibatch that it computes, of
+      // the first buffer placed on each part of the arena:
+      exec.firstTouch(workspace[j]->output, batchSize, layers[j]->size);
+      if(err not_eq nullptr) exec.firstTouch(err, batchSize, layers[j]->size);
+    }
+    arenaInput = workspace[0]->output;
+    alloc_batchSize = capacity = batchSize;
   }
 
   //////////////////////////////////////////////////////////////////////////////
   /// Functions to build the network are defined in Network_buildFunctions.h ///
   //////////////////////////////////////////////////////////////////////////////
 
+  // Each add function takes the shape of the layer either as template
+  // arguments, for layers specialized at compile time for that shape, or as
+  // runtime arguments, e.g. to build networks from a description read at
+  // runtime. Runtime convolutions are all computed as ImplicitConv2DLayer.
   template<int size> void addInput();
+  void addInput(const int size);
+
+  // Fuses activation E into the last layer, see fuseActivations:
+  bool fuseActivation(const Epilogue E, const char* const name)
+  {
+    Layer<Real>* const L = layers.back();
+    if (not fuseActivations || not L->canFuseActivation() ||
+        L->epilogue not_eq Epilogue::None) return false;
+    L->epilogue = E;
+    printf("(%d) %s fused into the epilogue of layer %d\n", L->ID, name, L->ID);
+    return true;
+  }
 
   template<int nInputs, int size>
   void addLinear(const std::string fname = std::string());
+  void addLinear(const int nInputs, const int size);
 
   template<int size> void addSoftMax();
+  void addSoftMax(const int size);
+
+  template<int size> void addSoftMaxCrossEntropy();
+  void addSoftMaxCrossEntropy(const int size);
 
   template<int size> void addLReLu();
+  void addLReLu(const int size);
 
   template<int size> void addTanh();
+  void addTanh(const int size);
+
+  // Batch normalization of the nChannels channels of the output of the last
+  // layer, e.g. of a convolution (NHWC images) or of a Linear layer:
+  template<int nChannels> void addBatchNorm();
+  void addBatchNorm(const int nChannels);
+
+  // Shape of the runtime convolutions: negative padding means the default of
+  // the templates, which keeps the size of the image if the stride is 1, and
+  // output sizes are the defaults of the templates:
+  static ConvShape makeConvShape(const int InX, const int InY, const int InC,
+    const int KnX, const int KnY, const int KnC, const int Sx, const int Sy,
+    const int Px, const int Py, const bool transposed)
+  {
+    const int px = Px < 0 ? (KnX-1)/2 : Px, py = Py < 0 ? (KnY-1)/2 : Py;
+    const int OpX = transposed ? Sx*(InX-1) -2*px +KnX
+                               : (Sx > 0 ? (InX -KnX +2*px)/Sx+1 : 0);
+    const int OpY = transposed ? Sy*(InY-1) -2*py +KnY
+                               : (Sy > 0 ? (InY -KnY +2*py)/Sy+1 : 0);
+    return {InX,InY,InC, KnX,KnY,KnC, Sx,Sy, px,py, OpX,OpY};
+  }
 
   template
   <
@@ -206,6 +599,27 @@ struct Network
     int OpY=(InY -KnY +2*Py)/Sy+1 //Default: uniform padding in all directions.
   >
   void addConv2D(const std::string fname = std::string());
+  void addConv2D(const int InX, const int InY, const int InC,
+                 const int KnX, const int KnY, const int KnC,
+                 const int Sx=1, const int Sy=1, const int Px=-1, const int Py=-1);
+
+  // Same as addConv2D, but convolution is computed by an Im2MatLayer, which
+  // writes the im2col matrix in the workspace, followed by a Conv2DLayer:
+  template
+  <
+    int InX, int InY, int InC, //input image: x:width, y:height, c:channels
+    int KnX, int KnY, int KnC, //filter:      x:width, y:height, c:channels
+    int Sx=1, // (Stride in x) Defaults to 1: advance one pixel at the time.
+    int Sy=1, // (Stride in y)
+    int Px=(KnX -1)/2, // (Padding in x) Defaults to value that makes output
+    int Py=(KnY -1)/2, // (Padding in y) image of the same size as input image.
+    int OpX=(InX -KnX +2*Px)/Sx+1, //Out image: same number of channels as KnC.
+    int OpY=(InY -KnY +2*Py)/Sy+1 //Default: uniform padding in all directions.
+  >
+  void addIm2MatConv2D(const std::string fname = std::string());
+  void addIm2MatConv2D(const int InX, const int InY, const int InC,
+                 const int KnX, const int KnY, const int KnC,
+                 const int Sx=1, const int Sy=1, const int Px=-1, const int Py=-1);
 
   template
   <
@@ -219,6 +633,9 @@ struct Network
     int OpY=Sy*(InY-1) -2*Py +KnY //Default: uniform padding in all directions.
   >
   void addDeConv2D(const std::string fname = std::string());
+  void addDeConv2D(const int InX, const int InY, const int InC,
+                 const int KnX, const int KnY, const int KnC,
+                 const int Sx=1, const int Sy=1, const int Px=-1, const int Py=-1);
 };
 
 #include "Network_buildFunctions.h"
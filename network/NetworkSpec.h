@@ -0,0 +1,180 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Network.h"
+#include <fstream>
+
+// Builds a network from a text description with one layer per line, e.g.:
+//
+//   input    28 28 1         # image of width, height, channels (or `input N`)
+//   conv2d    8  8 4  stride=2 pad=0
+//   batchnorm                # normalizes each of the 4 channels
+//   lrelu
+//   linear   10
+//   tanh     name=code       # output of layer can be found by net.layerID
+//   linear   144
+//   reshape   3  3 16        # reinterpret the output as a 3x3x16 image
+//   deconv2d  4  4 8  pad=0
+//   softmax_xent
+//
+// Convolutions take the filter's width, height and number of channels, and
+// optionally stride=S or stride=SxxSy and pad=P or pad=PxxPy (default: keep
+// the image size). Their input image is the output of the previous line, so
+// only the shape of the input is written out. The other layer types are
+// linear N, im2mat_conv2d (same arguments as conv2d), batchnorm (over the
+// channels of the output, or the N outputs of linear), lrelu, tanh, softmax
+// and softmax_xent. Any layer accepts name=NAME. Everything after '#' is a
+// comment. Layers are built with the runtime add* functions; mistakes are
+// reported with the line number and abort, like the build functions.
+template<typename Real>
+struct NetworkSpec
+{
+  Network<Real>& net;
+  const std::string source;
+  int lineNumber = 0;
+  // shape of the output of the last layer:
+  int X = 0, Y = 0, C = 0;
+
+  NetworkSpec(Network<Real>& _net, const std::string& _source) :
+    net(_net), source(_source) {}
+
+  void error(const std::string& msg) const
+  {
+    printf("%s:%d: %s. Aborting.\n", source.c_str(), lineNumber, msg.c_str());
+    abort();
+  }
+
+  // Parses "A" or "AxB" into (a, b), with b = a for "A":
+  void parsePair(const std::string& key, const std::string& val,
+                 int& a, int& b) const
+  {
+    char* end = nullptr;
+    a = b = (int) strtol(val.c_str(), &end, 10);
+    if (*end == 'x') b = (int) strtol(end + 1, &end, 10);
+    if (end == val.c_str() || *end not_eq '\0')
+      error("invalid value of " + key + ": " + val);
+  }
+
+  void parseLine(const std::string& line)
+  {
+    std::istringstream iss(line.substr(0, line.find('#')));
+    std::string type, token;
+    if (not (iss >> type)) return;
+
+    std::vector<int> args;
+    std::string name;
+    int Sx = 1, Sy = 1, Px = -1, Py = -1;
+    while (iss >> token)
+    {
+      const size_t eq = token.find('=');
+      if (eq == std::string::npos) {
+        char* end = nullptr;
+        args.push_back((int) strtol(token.c_str(), &end, 10));
+        if (*end not_eq '\0' || args.back() <= 0)
+          error("invalid size " + token);
+        continue;
+      }
+      const std::string key = token.substr(0, eq), val = token.substr(eq+1);
+      if      (key == "name")   name = val;
+      else if (key == "stride") parsePair(key, val, Sx, Sy);
+      else if (key == "pad")    parsePair(key, val, Px, Py);
+      else error("unknown option " + key);
+    }
+
+    const auto expect = [&] (const std::vector<size_t> counts) {
+      if (std::find(counts.begin(), counts.end(), args.size()) == counts.end())
+        error(type + ": wrong number of sizes");
+      if (type not_eq "input" && net.layers.size() == 0)
+        error("first layer must be input");
+    };
+    const bool conv = type == "conv2d" || type == "im2mat_conv2d" ||
+                      type == "deconv2d";
+    if (not conv && (Sx not_eq 1 || Sy not_eq 1 || Px not_eq -1 || Py not_eq -1))
+      error(type + " takes no stride or padding");
+
+    if (type == "input") {
+      expect({1, 3});
+      if (net.layers.size()) error("multiple input layers");
+      if (args.size() == 1) args = {1, 1, args[0]};
+      X = args[0]; Y = args[1]; C = args[2];
+      net.addInput(X * Y * C);
+    }
+    else if (type == "linear") {
+      expect({1});
+      net.addLinear(X * Y * C, args[0]);
+      X = 1; Y = 1; C = args[0];
+    }
+    else if (conv) {
+      expect({3});
+      const bool transposed = type == "deconv2d";
+      const ConvShape S = Network<Real>::makeConvShape(X,Y,C,
+        args[0],args[1],args[2], Sx,Sy, Px,Py, transposed);
+      if (not S.valid())
+        error("invalid " + type + " of " + std::to_string(X) + "x" +
+              std::to_string(Y) + "x" + std::to_string(C) + " image");
+      if (type == "conv2d") net.addConv2D(X,Y,C, S.KnX,S.KnY,S.KnC, Sx,Sy,Px,Py);
+      else if (transposed) net.addDeConv2D(X,Y,C, S.KnX,S.KnY,S.KnC,Sx,Sy,Px,Py);
+      else net.addIm2MatConv2D(X,Y,C, S.KnX,S.KnY,S.KnC, Sx,Sy,Px,Py);
+      X = S.OpX; Y = S.OpY; C = S.KnC;
+    }
+    else if (type == "reshape") {
+      expect({3});
+      if (args[0] * args[1] * args[2] not_eq X * Y * C)
+        error("reshape does not preserve size " + std::to_string(X * Y * C));
+      X = args[0]; Y = args[1]; C = args[2];
+      if (name.size()) error("reshape adds no layer to name");
+    }
+    else if (type == "batchnorm")    { expect({0}); net.addBatchNorm(C); }
+    else if (type == "lrelu")        { expect({0}); net.addLReLu(X * Y * C); }
+    else if (type == "tanh")         { expect({0}); net.addTanh(X * Y * C);  }
+    else if (type == "softmax")      { expect({0}); net.addSoftMax(X * Y * C); }
+    else if (type == "softmax_xent") {
+      expect({0});
+      net.addSoftMaxCrossEntropy(X * Y * C);
+    }
+    else error("unknown layer type " + type);
+
+    if (name.size()) {
+      if (net.layerNames.count(name)) error("duplicate name " + name);
+      net.nameLayer(name);
+    }
+  }
+
+  void parse(std::istream& is)
+  {
+    std::string line;
+    while (std::getline(is, line)) {
+      lineNumber++;
+      parseLine(line);
+    }
+    if (net.layers.size() < 2) error("network needs input and one layer");
+  }
+};
+
+// Adds to an empty network the layers described by the stream `spec`, where
+// `source` is the name used in error messages:
+template<typename Real>
+void buildNetwork(Network<Real>& net, std::istream& spec,
+                  const std::string& source = "spec")
+{
+  NetworkSpec<Real>(net, source).parse(spec);
+}
+
+template<typename Real>
+void buildNetwork(Network<Real>& net, const std::string& fname)
+{
+  std::ifstream spec(fname);
+  if (not spec.is_open()) {
+    printf("Missing network spec file %s. Aborting.\n", fname.c_str());
+    abort();
+  }
+  buildNetwork(net, spec, fname);
+}
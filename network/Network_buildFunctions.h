@@ -13,8 +13,11 @@
 #include "Layer_Conv2D.h"
 #include "Layer_DeConv2D.h"
 #include "Layer_Im2Mat.h"
+#include "Layer_ImplicitConv2D.h"
+#include "Layer_WinogradConv2D.h"
 #include "Layer_Functions.h"
 #include "Layer_Linear.h"
+#include "Layer_BatchNorm.h"
 
 #define CHECK_NOEMPTY(SIZE) do { if(SIZE <= 0) { \
   printf("Requested empty layer. Aborting.\n"); abort(); } } while (0)
@@ -26,6 +29,11 @@
   printf("Mismatch: input size (%d) and prev. layer size (%d). Aborting\n", \
   NINP, layers.back()->size); abort(); } } while (0)
 
+#define CHECK_SHAPE(S) do { if(not S.valid()) {                          \
+  printf("Invalid shape In:[%d %d %d] F:[%d %d %d] Stride:[%d %d] "           \
+  "Padding:[%d %d] Out:[%d %d]. Aborting\n", S.InY, S.InX, S.InC, S.KnY,      \
+  S.KnX, S.KnC, S.Sy, S.Sx, S.Py, S.Px, S.OpY, S.OpX); abort(); } } while (0)
+
 #define CHECKOUT_NOPARAM() do {                                              \
     /* check that layer/weight/grad counters are correct so far */           \
     assert(params.size() == layers.size() && grads.size() == layers.size()); \
@@ -40,12 +48,21 @@
     layers.push_back(l);                                                     \
     params.push_back(l->allocate_params());                                  \
     grads.push_back(l->allocate_params()); /* grads same size as params */   \
+    packParams(); /* move params and grads to the network's flat arrays */   \
     l->init(gen, params); /* initialize params' values */                    \
+    l->paramsChanged(params);                                                \
   } while(0)
 
 
+template<typename Real>
 template<int size>
-void Network::addInput()
+void Network<Real>::addInput()
+{
+  addInput(size);
+}
+
+template<typename Real>
+void Network<Real>::addInput(const int size)
 {
   CHECK_NOEMPTY(size);
   if(layers.size() != 0) {
@@ -53,97 +70,296 @@ void Network::addInput()
   }
   assert(nInputs == 0);
 
-  Layer * l = new Input_Layer<size>();
+  Layer<Real> * l = new Input_Layer<Real>(size);
   nInputs = l->size;
   // input layer has no parameters and therefore no gradient of parameters:
   CHECKOUT_NOPARAM();
 }
 
+template<typename Real>
 template<int inpSize, int size>
-void Network::addLinear(const std::string fname)
+void Network<Real>::addLinear(const std::string fname)
 {
   CHECK_NOINPUT();
   CHECK_NOEMPTY(size);
   CHECK_INPOUT(inpSize);
 
-  auto l = new LinearLayer<size, inpSize>(layers.size());
+  auto l = new LinearLayer<Real, size, inpSize>(layers.size());
   nOutputs = l->size;
   CHECKOUT_ALLOCPARAM();
 }
 
+template<typename Real>
+void Network<Real>::addLinear(const int inpSize, const int size)
+{
+  CHECK_NOINPUT();
+  CHECK_NOEMPTY(size);
+  CHECK_INPOUT(inpSize);
+
+  auto l = new RuntimeLinearLayer<Real>(layers.size(), size, inpSize);
+  nOutputs = l->size;
+  CHECKOUT_ALLOCPARAM();
+}
+
+template<typename Real>
+template<int size>
+void Network<Real>::addSoftMax()
+{
+  CHECK_NOINPUT();
+  CHECK_NOEMPTY(size);
+  CHECK_INPOUT(size);
+
+  auto l = new SoftMaxLayer<Real, size>(layers.size());
+  nOutputs = l->size;
+  CHECKOUT_NOPARAM();
+}
+
+template<typename Real>
+void Network<Real>::addSoftMax(const int size)
+{
+  CHECK_NOINPUT();
+  CHECK_NOEMPTY(size);
+  CHECK_INPOUT(size);
+
+  auto l = new RuntimeSoftMaxLayer<Real>(layers.size(), size);
+  nOutputs = l->size;
+  CHECKOUT_NOPARAM();
+}
+
+template<typename Real>
 template<int size>
-void Network::addSoftMax()
+void Network<Real>::addSoftMaxCrossEntropy()
 {
   CHECK_NOINPUT();
   CHECK_NOEMPTY(size);
   CHECK_INPOUT(size);
 
-  auto l = new SoftMaxLayer<size>(layers.size());
+  auto l = new SoftMaxCrossEntropyLayer<Real, size>(layers.size());
   nOutputs = l->size;
   CHECKOUT_NOPARAM();
 }
 
+template<typename Real>
+void Network<Real>::addSoftMaxCrossEntropy(const int size)
+{
+  CHECK_NOINPUT();
+  CHECK_NOEMPTY(size);
+  CHECK_INPOUT(size);
+
+  auto l = new RuntimeSoftMaxCrossEntropyLayer<Real>(layers.size(), size);
+  nOutputs = l->size;
+  CHECKOUT_NOPARAM();
+}
+
+template<typename Real>
 template<int size>
-void Network::addLReLu()
+void Network<Real>::addLReLu()
+{
+  CHECK_NOINPUT();
+  CHECK_NOEMPTY(size);
+  CHECK_INPOUT(size);
+  if (fuseActivation(Epilogue::LReLu, "LReLu")) return;
+
+  auto l = new LReLuLayer<Real, size>(layers.size());
+  nOutputs = l->size;
+  CHECKOUT_NOPARAM();
+}
+
+template<typename Real>
+void Network<Real>::addLReLu(const int size)
 {
   CHECK_NOINPUT();
   CHECK_NOEMPTY(size);
   CHECK_INPOUT(size);
+  if (fuseActivation(Epilogue::LReLu, "LReLu")) return;
 
-  auto l = new LReLuLayer<size>(layers.size());
+  auto l = new RuntimeLReLuLayer<Real>(layers.size(), size);
   nOutputs = l->size;
   CHECKOUT_NOPARAM();
 }
 
+template<typename Real>
 template<int size>
-void Network::addTanh()
+void Network<Real>::addTanh()
 {
   CHECK_NOINPUT();
   CHECK_NOEMPTY(size);
   CHECK_INPOUT(size);
+  if (fuseActivation(Epilogue::Tanh, "Tanh")) return;
 
-  auto l = new TanhLayer<size>(layers.size());
+  auto l = new TanhLayer<Real, size>(layers.size());
   nOutputs = l->size;
   CHECKOUT_NOPARAM();
 }
 
+template<typename Real>
+void Network<Real>::addTanh(const int size)
+{
+  CHECK_NOINPUT();
+  CHECK_NOEMPTY(size);
+  CHECK_INPOUT(size);
+  if (fuseActivation(Epilogue::Tanh, "Tanh")) return;
 
+  auto l = new RuntimeTanhLayer<Real>(layers.size(), size);
+  nOutputs = l->size;
+  CHECKOUT_NOPARAM();
+}
+
+template<typename Real>
+template<int nChannels>
+void Network<Real>::addBatchNorm()
+{
+  CHECK_NOINPUT();
+  CHECK_NOEMPTY(nChannels);
+  const int size = layers.back()->size;
+  if(size % nChannels not_eq 0) {
+    printf("Mismatch: prev. layer size (%d) is not a multiple of %d channels. "
+      "Aborting\n", size, nChannels); abort();
+  }
+
+  auto l = new BatchNormLayer<Real, nChannels>(layers.size(), size);
+  nOutputs = l->size;
+  CHECKOUT_ALLOCPARAM();
+}
+
+template<typename Real>
+void Network<Real>::addBatchNorm(const int nChannels)
+{
+  CHECK_NOINPUT();
+  CHECK_NOEMPTY(nChannels);
+  const int size = layers.back()->size;
+  if(size % nChannels not_eq 0) {
+    printf("Mismatch: prev. layer size (%d) is not a multiple of %d channels. "
+      "Aborting\n", size, nChannels); abort();
+  }
+
+  auto l = new RuntimeBatchNormLayer<Real>(layers.size(), size, nChannels);
+  nOutputs = l->size;
+  CHECKOUT_ALLOCPARAM();
+}
+
+
+template<typename Real>
 template < int InX, int InY, int InC, int KnX, int KnY, int KnC,
            int  Sx, int  Sy, int  Px, int  Py, int OpX, int OpY >
-void Network::addConv2D(const std::string fname)
+void Network<Real>::addConv2D(const std::string fname)
+{
+  CHECK_NOINPUT();
+  CHECK_NOEMPTY(OpX * OpY * KnC);
+  CHECK_INPOUT(InX * InY * InC);
+
+  // 3x3 filters with stride 1 are computed with Winograd's algorithm:
+  constexpr bool winograd = KnX == 3 && KnY == 3 && Sx == 1 && Sy == 1 &&
+                            OpX == InX -KnX +2*Px +1 && OpY == InY -KnY +2*Py +1;
+  using ConvLayer = typename std::conditional<winograd,
+    WinogradConv2DLayer<Real, InX,InY,InC, KnC, Px,Py, OpX,OpY>,
+    ImplicitConv2DLayer<Real, InX,InY,InC, KnX,KnY,KnC, Sx,Sy, Px,Py, OpX,OpY>
+  >::type;
+
+  auto l = new ConvLayer(layers.size());
+  nOutputs = l->size;
+  CHECKOUT_ALLOCPARAM();
+}
+
+template<typename Real>
+void Network<Real>::addConv2D(const int InX, const int InY, const int InC,
+  const int KnX, const int KnY, const int KnC,
+  const int Sx, const int Sy, const int Px, const int Py)
+{
+  const ConvShape S = makeConvShape(InX,InY,InC, KnX,KnY,KnC, Sx,Sy, Px,Py,
+                                    false);
+  CHECK_NOINPUT();
+  CHECK_SHAPE(S);
+  CHECK_INPOUT(InX * InY * InC);
+
+  auto l = new RuntimeImplicitConv2DLayer<Real>(layers.size(), S);
+  nOutputs = l->size;
+  CHECKOUT_ALLOCPARAM();
+}
+
+template<typename Real>
+template < int InX, int InY, int InC, int KnX, int KnY, int KnC,
+           int  Sx, int  Sy, int  Px, int  Py, int OpX, int OpY >
+void Network<Real>::addIm2MatConv2D(const std::string fname)
 {
   CHECK_NOINPUT();
   CHECK_NOEMPTY(OpX * OpY * KnC);
   CHECK_INPOUT(InX * InY * InC);
   {
-    auto l = new Im2MatLayer<InX,InY,InC, KnX,KnY,KnC, Sx,Sy, Px,Py, OpX,OpY>(
-      layers.size() );
+    auto l = new Im2MatLayer<Real, InX,InY,InC, KnX,KnY,KnC, Sx,Sy, Px,Py,
+      OpX,OpY>(layers.size());
 
     CHECKOUT_NOPARAM();
   }
   {
-    auto l = new Conv2DLayer<InX,InY,InC, KnX,KnY,KnC, OpX,OpY>(
+    auto l = new Conv2DLayer<Real, InX,InY,InC, KnX,KnY,KnC, OpX,OpY>(
       layers.size());
     nOutputs = l->size;
     CHECKOUT_ALLOCPARAM();
   }
 }
 
+template<typename Real>
+void Network<Real>::addIm2MatConv2D(const int InX, const int InY, const int InC,
+  const int KnX, const int KnY, const int KnC,
+  const int Sx, const int Sy, const int Px, const int Py)
+{
+  const ConvShape S = makeConvShape(InX,InY,InC, KnX,KnY,KnC, Sx,Sy, Px,Py,
+                                    false);
+  CHECK_NOINPUT();
+  CHECK_SHAPE(S);
+  CHECK_INPOUT(InX * InY * InC);
+  {
+    auto l = new RuntimeIm2MatLayer<Real>(layers.size(), S, false);
+    CHECKOUT_NOPARAM();
+  }
+  {
+    auto l = new RuntimeConv2DLayer<Real>(layers.size(), S);
+    nOutputs = l->size;
+    CHECKOUT_ALLOCPARAM();
+  }
+}
+
+template<typename Real>
 template < int InX, int InY, int InC, int KnX, int KnY, int KnC,
            int  Sx, int  Sy, int  Px, int  Py, int OpX, int OpY >
-void Network::addDeConv2D(const std::string fname)
+void Network<Real>::addDeConv2D(const std::string fname)
 {
   CHECK_NOINPUT();
   CHECK_NOEMPTY(OpX * OpY * KnC);
   CHECK_INPOUT(InX * InY * InC);
   {
-    auto l = new Deconv2DLayer<InX,InY,InC, KnX,KnY,KnC, OpX,OpY>(
+    auto l = new Deconv2DLayer<Real, InX,InY,InC, KnX,KnY,KnC, OpX,OpY>(
       layers.size());
     CHECKOUT_ALLOCPARAM();
   }
   {
-    auto l = new Im2MatLayer<OpX,OpY,KnC, KnX,KnY,InC, Sx,Sy, Px,Py, InX,InY>(
-      layers.size(), true);
+    auto l = new Im2MatLayer<Real, OpX,OpY,KnC, KnX,KnY,InC, Sx,Sy, Px,Py,
+      InX,InY>(layers.size(), true);
+    CHECKOUT_NOPARAM();
+    nOutputs = l->size;
+  }
+}
+
+template<typename Real>
+void Network<Real>::addDeConv2D(const int InX, const int InY, const int InC,
+  const int KnX, const int KnY, const int KnC,
+  const int Sx, const int Sy, const int Px, const int Py)
+{
+  const ConvShape S = makeConvShape(InX,InY,InC, KnX,KnY,KnC, Sx,Sy, Px,Py,
+                                    true);
+  CHECK_NOINPUT();
+  CHECK_SHAPE(S);
+  CHECK_INPOUT(InX * InY * InC);
+  {
+    auto l = new RuntimeDeconv2DLayer<Real>(layers.size(), S);
+    CHECKOUT_ALLOCPARAM();
+  }
+  {
+    // transposed Im2Mat from the OpY*OpX image of KnC channels:
+    const ConvShape T = {S.OpX,S.OpY,S.KnC, S.KnX,S.KnY,S.InC, S.Sx,S.Sy,
+                         S.Px,S.Py, S.InX,S.InY};
+    auto l = new RuntimeIm2MatLayer<Real>(layers.size(), T, true);
     CHECKOUT_NOPARAM();
     nOutputs = l->size;
   }
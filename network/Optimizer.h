@@ -12,28 +12,44 @@
 #include <fstream>
 #include "Network.h"
 
+// Learning algorithms, the Algorithm of Optimizer. Each is created for one
+// update with the learning rate eta, the factor of the grads fac (1/batchSize
+// times the clipping factor), the penalization lambda, the coefficients beta1
+// and beta2 and their powers beta1t and beta2t. Element-wise algorithms
+// update `size` contiguous params in one vectorised loop (step); they are
+// called by each thread on its part of the flat arrays, which may span
+// several layers. Layer-wise algorithms (layerwise = true) first compute the
+// squared norms of each layer's params and update direction, see LAMB.
+
+template<typename Real>
 struct MomentumSGD
 {
+  typedef Real value_type;
+  static constexpr bool layerwise = false;
+
+  // used by the profiler: operations, and Reals read or written, per param:
+  static constexpr int flopsPerParam = 7, accessesPerParam = 5;
+
   const Real eta;
-  const Real fac; // 1/batchSize
+  const Real fac; // 1/batchSize, times the clipping factor
   const Real beta;
   const Real lambda;
 
-  MomentumSGD(const Real _eta, const int batchSize, const Real _lambda,
+  MomentumSGD(const Real _eta, const Real _fac, const Real _lambda,
     const Real _b1, const Real _b2, const Real _b1t, const Real _b2t) :
-    eta(_eta), fac(1./batchSize), beta(_b1), lambda(_lambda) {}
+    eta(_eta), fac(_fac), beta(_b1), lambda(_lambda) {}
 
   // perform gradient update for a parameter array:
   inline void step (
-        const int size,     // parameter array's size
+        const size_t size,  // parameter array's size
         Real* const __restrict__ param,  //param. array
         Real* const __restrict__ grad,   //param. array gradient
         Real* const __restrict__ mom1st, //param. array gradient 1st moment
         Real* const __restrict__ mom2nd  //param. array gradient 2nd moment
       ) const
   {
-    #pragma omp for schedule (dynamic, 64/sizeof(Real)) nowait
-    for (int i = 0; i < size; i++)
+    #pragma omp simd
+    for (size_t i = 0; i < size; i++)
     {
       // grad has two components: minimize loss function and L2 penalization:
       const Real G = fac * grad[i] + lambda * param[i];
@@ -43,27 +59,34 @@ struct MomentumSGD
   }
 };
 
+template<typename Real>
 struct Adam
 {
+  typedef Real value_type;
+  static constexpr bool layerwise = false;
+
   const Real eta, fac, beta1, beta2, lambda;
   static constexpr Real EPS = 1e-8;
+  // used by the profiler: operations (sqrt counts as one), and Reals read or
+  // written, per param:
+  static constexpr int flopsPerParam = 15, accessesPerParam = 7;
 
-  Adam(const Real _eta, const int batchSize, const Real _lambda,
+  Adam(const Real _eta, const Real _fac, const Real _lambda,
     const Real _b1, const Real _b2, const Real _b1t, const Real _b2t) :
-    eta(_eta * std::sqrt(1-_b2t)/(1-_b1t)), fac(1.0/batchSize),
+    eta(_eta * std::sqrt(1-_b2t)/(1-_b1t)), fac(_fac),
     beta1(_b1), beta2(_b2), lambda(_lambda) {}
 
   // perform gradient update for a parameter array:
   inline void step (
-        const int size,     // parameter array's size
+        const size_t size,  // parameter array's size
         Real* const __restrict__ param,  //param. array
         Real* const __restrict__ grad,   //param. array gradient
         Real* const __restrict__ mom1st, //param. array gradient 1st moment
         Real* const __restrict__ mom2nd  //param. array gradient 2nd moment
       ) const
   {
-    #pragma omp for schedule(dynamic, 64 / sizeof(Real)) nowait
-    for (int i = 0; i < size; i++)
+    #pragma omp simd
+    for (size_t i = 0; i < size; i++)
     {
       // grad has two components: minimize loss function and L2 penalization:
       const Real G = fac * grad[i] + lambda * param[i];
@@ -74,71 +97,358 @@ struct Adam
   }
 };
 
+// Adam with decoupled weight decay: lambda shrinks the params directly
+// instead of being added to the grad, where it would be rescaled by the
+// second moment.
+template<typename Real>
+struct AdamW
+{
+  typedef Real value_type;
+  static constexpr bool layerwise = false;
+
+  const Real eta, decay, fac, beta1, beta2;
+  static constexpr Real EPS = 1e-8;
+  static constexpr int flopsPerParam = 15, accessesPerParam = 7;
+
+  AdamW(const Real _eta, const Real _fac, const Real _lambda,
+    const Real _b1, const Real _b2, const Real _b1t, const Real _b2t) :
+    eta(_eta * std::sqrt(1-_b2t)/(1-_b1t)), decay(_eta * _lambda), fac(_fac),
+    beta1(_b1), beta2(_b2) {}
+
+  inline void step (
+        const size_t size,
+        Real* const __restrict__ param,
+        Real* const __restrict__ grad,
+        Real* const __restrict__ mom1st,
+        Real* const __restrict__ mom2nd
+      ) const
+  {
+    #pragma omp simd
+    for (size_t i = 0; i < size; i++)
+    {
+      const Real G = fac * grad[i];
+      mom1st[i] = beta1 * mom1st[i] + (1-beta1) * G;
+      mom2nd[i] = beta2 * mom2nd[i] + (1-beta2) * G * G;
+      param[i] = param[i] - eta * mom1st[i] / ( std::sqrt(mom2nd[i]) + EPS )
+                          - decay * param[i];
+    }
+  }
+};
+
+// LAMB: the Adam direction with decoupled decay, r = m/(sqrt(v)+eps) + lambda
+// w, is rescaled for each layer by the trust ratio |w| / |r|, so that each
+// layer's params change by a fraction eta of their norm whatever the scale of
+// its grads. direction updates the moments and accumulates |w|^2 and |r|^2,
+// apply recomputes r from the moments (instead of storing it) and updates w.
+template<typename Real>
+struct LAMB
+{
+  typedef Real value_type;
+  static constexpr bool layerwise = true;
+
+  const Real eta, corr, fac, beta1, beta2, lambda;
+  static constexpr Real EPS = 1e-6;
+  static constexpr int flopsPerParam = 25, accessesPerParam = 10;
+
+  LAMB(const Real _eta, const Real _fac, const Real _lambda,
+    const Real _b1, const Real _b2, const Real _b1t, const Real _b2t) :
+    eta(_eta), corr(std::sqrt(1-_b2t)/(1-_b1t)), fac(_fac),
+    beta1(_b1), beta2(_b2), lambda(_lambda) {}
+
+  inline Real r(const Real w, const Real m1, const Real m2) const {
+    return corr * m1 / ( std::sqrt(m2) + EPS ) + lambda * w;
+  }
+
+  inline void direction (
+        const size_t size,
+        const Real* const __restrict__ param,
+        const Real* const __restrict__ grad,
+        Real* const __restrict__ mom1st,
+        Real* const __restrict__ mom2nd,
+        Real& normW, // accumulate |w|^2
+        Real& normR  // accumulate |r|^2
+      ) const
+  {
+    Real sumW = 0, sumR = 0;
+    #pragma omp simd reduction(+ : sumW, sumR)
+    for (size_t i = 0; i < size; i++)
+    {
+      const Real G = fac * grad[i];
+      mom1st[i] = beta1 * mom1st[i] + (1-beta1) * G;
+      mom2nd[i] = beta2 * mom2nd[i] + (1-beta2) * G * G;
+      const Real R = r(param[i], mom1st[i], mom2nd[i]);
+      sumW += param[i] * param[i];
+      sumR += R * R;
+    }
+    normW += sumW;
+    normR += sumR;
+  }
+
+  // ratio: eta times the trust ratio of the layer of these params
+  inline void apply (
+        const size_t size,
+        Real* const __restrict__ param,
+        const Real* const __restrict__ mom1st,
+        const Real* const __restrict__ mom2nd,
+        const Real ratio
+      ) const
+  {
+    #pragma omp simd
+    for (size_t i = 0; i < size; i++)
+      param[i] = param[i] - ratio * r(param[i], mom1st[i], mom2nd[i]);
+  }
+
+  Real ratio(const Real normW, const Real normR) const
+  {
+    // layers whose params or direction are zero take a plain step:
+    if (normW <= 0 || normR <= 0) return eta;
+    return eta * std::sqrt(normW / normR);
+  }
+};
+
+// Learning rate of each step as a fraction of the optimizer's eta. It is a
+// function of the number of steps taken, which checkpoints store: training
+// resumed from a checkpoint continues with the same learning rate.
+struct LearningRateSchedule
+{
+  enum Decay { Constant, Cosine, StepDecay };
+  Decay decay = Constant;
+  // eta grows linearly from eta/warmup to eta over the first warmup steps:
+  size_t warmup = 0;
+  // After the warmup, Cosine decays eta to minFactor*eta over `period` steps
+  // and then keeps it there, StepDecay multiplies eta by gamma every `period`
+  // steps:
+  size_t period = 0;
+  double minFactor = 0, gamma = 0.1;
+
+  static LearningRateSchedule cosine(const size_t warmup, const size_t period,
+                                     const double minFactor = 0)
+  {
+    LearningRateSchedule S;
+    S.decay = Cosine; S.warmup = warmup; S.period = period;
+    S.minFactor = minFactor;
+    return S;
+  }
+
+  static LearningRateSchedule stepDecay(const size_t warmup,
+    const size_t period, const double gamma)
+  {
+    LearningRateSchedule S;
+    S.decay = StepDecay; S.warmup = warmup; S.period = period; S.gamma = gamma;
+    return S;
+  }
+
+  // factor of eta for the update that follows `step` updates:
+  double factor(const size_t step) const
+  {
+    if (step < warmup) return (step + 1.0) / warmup;
+    const size_t t = step - warmup;
+    if (period == 0) return 1;
+    switch (decay) {
+      case Cosine:
+        if (t >= period) return minFactor;
+        return minFactor + (1-minFactor) * (1 + std::cos(M_PI*t/period)) / 2;
+      case StepDecay:
+        return std::pow(gamma, (double) (t / period));
+      default:
+        return 1;
+    }
+  }
+};
+
 template<typename Algorithm>
 struct Optimizer
 {
-  Network& NET;
-  const Real eta, beta_1, beta_2, lambda;
-  Real beta_1t = beta_1;
-  Real beta_2t = beta_2;
-  // grab the reference to network weights and parameters
-  std::vector<Params*> & parms = NET.params;
-  std::vector<Params*> & grads = NET.grads;
+  // floating point type of the network is defined by the learning algorithm:
+  typedef typename Algorithm::value_type Real;
+  static constexpr Real NNEPS = std::numeric_limits<Real>::epsilon();
 
-  // allocate space to store first (and if needed second) moment of the grad
-  // which will allow us to learn with momentum:
-  std::vector<Params*> momentum_1st = NET.allocateGrad();
-  std::vector<Params*> momentum_2nd = NET.allocateGrad();
+  Network<Real>& NET;
+  const Real eta, beta_1, beta_2, lambda;
+  // Powers beta_1^t and beta_2^t for the bias correction of the moments of
+  // the update t (counted from 1), i.e. the next update after `step`:
+  double beta_1t = beta_1;
+  double beta_2t = beta_2;
+  // learning rate of each step is eta times schedule.factor(step):
+  LearningRateSchedule schedule;
+  // first (and if needed second) moment of the grad which will allow us to
+  // learn with momentum. Same layout as the network's flat array of params:
+  const size_t nParams = NET.flatSize;
+  Real* const momentum_1st = _myalloc<Real>(nParams);
+  Real* const momentum_2nd = _myalloc<Real>(nParams);
+  // The flat arrays hold one tensor for the weights, and one for the biases,
+  // of each layer: tensor t spans [tensorStart[t], tensorStart[t+1]).
+  std::vector<size_t> tensorStart;
+  // If positive, the grads are scaled down so that the global norm of the
+  // grads averaged over the minibatch is at most clipNorm:
+  Real clipNorm = 0;
+  // Global norm of the averaged grads at the last update, if clipping:
+  Real gradNorm = 0;
+  // Sums of layer-wise algorithms for each thread and tensor, and ratios:
+  std::vector<Real> partialNorms, ratios;
 
   // counter of gradient step:
   size_t step = 0;
 
   // Constructor:
-  Optimizer(Network& NN, Real LR = .001, // Learning rate. Should be in range [1e-5 to 1e-2]
+  Optimizer(Network<Real>& NN, Real LR = .001, // Learning rate. Should be in range [1e-5 to 1e-2]
       Real L2penal = 0, // L2 penalization coefficient. Found by exploration.
       Real B1 = .900, // Momentum coefficient. Should be in range [.5 to .9]
       Real B2 = .999   // Second moment coefficient. Currently not in use.
       ) :
       NET(NN), eta(LR), beta_1(B1), beta_2(B2), lambda(L2penal) {
+    // placed like the params, with the partition of the updates:
+    ExecutionContext::firstTouch(momentum_1st, nParams);
+    ExecutionContext::firstTouch(momentum_2nd, nParams);
+    for (size_t j = 0; j < NET.params.size(); j++) {
+      const Params<Real>* const P = NET.params[j];
+      if (P == nullptr) continue;
+      if (P->nWeights) tensorStart.push_back(P->weights - NET.flatParams);
+      if (P->nBiases)  tensorStart.push_back(P->biases  - NET.flatParams);
+    }
+    tensorStart.push_back(nParams);
   }
 
   virtual ~Optimizer() {
-    for (auto& p : momentum_1st) _dispose_object(p);
-    for (auto& p : momentum_2nd) _dispose_object(p);
+    _myfree(momentum_1st);
+    _myfree(momentum_2nd);
   }
 
-  virtual void update(const int batchSize)
+  // Checkpoint of the network's params and of the state of the optimizer,
+  // written by the thread of writer while training continues. userState are
+  // bytes of the caller, e.g. the state of its DataLoader, returned by restart:
+  void save(CheckpointWriter<Real>& writer, const std::string fname,
+            const std::string& userState = std::string()) const
   {
-    assert(parms.size() == grads.size());
-    assert(parms.size() == momentum_1st.size());
-    assert(parms.size() == momentum_2nd.size());
+    writer.write(NET, fname, momentum_1st, momentum_2nd, step, beta_1t,
+                 beta_2t, userState);
+  }
 
-    // Given some learning algorithm..
-    const Algorithm algo(eta,batchSize,lambda, beta_1,beta_2,beta_1t,beta_2t);
+  // Resumes training from a checkpoint written by save, returns userState:
+  std::string restart(const std::string fname)
+  {
+    const CheckpointFile<Real> file(fname);
+    file.restore(NET, momentum_1st, momentum_2nd);
+    step = file.H.step;
+    beta_1t = file.H.beta1t;
+    beta_2t = file.H.beta2t;
+    // checkpoints of version 1 saved powers squared at each step:
+    if (file.H.version < 2) {
+      beta_1t = std::pow((double) beta_1, (double) step + 1);
+      beta_2t = std::pow((double) beta_2, (double) step + 1);
+    }
+    return file.userState();
+  }
 
-    // ... loop over all parameter arrays and compute the update:
+  // Range [begin, end) of the flat arrays updated by the calling thread of a
+  // parallel region: contiguous, as with the static schedule of firstTouch.
+  void threadRange(size_t& begin, size_t& end) const
+  {
+    static constexpr size_t align = ALIGNBYTES / sizeof(Real);
+    const size_t nThreads = omp_get_num_threads();
+    const size_t chunk = (nParams + nThreads*align - 1) / (nThreads*align) * align;
+    begin = std::min(nParams, omp_get_thread_num() * chunk);
+    end = std::min(nParams, begin + chunk);
+  }
+
+  // Calls f(t, begin, end) for each part of tensor t in the calling thread's
+  // range of the flat arrays:
+  template<typename Func> void forEachTensor(const Func& f) const
+  {
+    size_t begin, end;
+    threadRange(begin, end);
+    if (begin >= end) return;
+    size_t t = std::upper_bound(tensorStart.begin(), tensorStart.end(), begin)
+               - tensorStart.begin() - 1;
+    for (; t+1 < tensorStart.size() && tensorStart[t] < end; t++)
+      f(t, std::max(begin, tensorStart[t]), std::min(end, tensorStart[t+1]));
+  }
+
+  // Element-wise algorithms: each thread updates its range in one call.
+  void sweep(const Algorithm& algo, std::false_type)
+  {
+    Real* const P = NET.flatParams, * const G = NET.flatGrads;
+    Real* const M1 = momentum_1st, * const M2 = momentum_2nd;
     #pragma omp parallel
-    for (size_t j = 0; j < parms.size(); j++)
     {
-      if (parms[j] == nullptr) continue; //layer does not have parameters
+      size_t b, e;
+      threadRange(b, e);
+      if (b < e) algo.step(e-b, P+b, G+b, M1+b, M2+b);
+    }
+  }
 
-      if (parms[j]->nWeights > 0)
-      {
-        algo.step(parms[j]->nWeights,
-                  parms[j]->weights, grads[j]->weights,
-                  momentum_1st[j]->weights, momentum_2nd[j]->weights);
+  // Layer-wise algorithms: one sweep computes the moments and the norms of
+  // each tensor, split among threads, a second sweep applies the update with
+  // the ratio of each tensor. All in one parallel region.
+  void sweep(const Algorithm& algo, std::true_type)
+  {
+    Real* const P = NET.flatParams, * const G = NET.flatGrads;
+    Real* const M1 = momentum_1st, * const M2 = momentum_2nd;
+    const size_t nTensors = tensorStart.size() - 1;
+    partialNorms.assign(2 * nTensors * omp_get_max_threads(), 0);
+    ratios.resize(nTensors);
+    #pragma omp parallel
+    {
+      Real* const norms = partialNorms.data() + 2*nTensors*omp_get_thread_num();
+      forEachTensor([&] (const size_t t, const size_t b, const size_t e) {
+        algo.direction(e-b, P+b, G+b, M1+b, M2+b, norms[2*t], norms[2*t+1]);
+      });
+      #pragma omp barrier
+      const int nThreads = omp_get_num_threads();
+      #pragma omp for schedule(static)
+      for (size_t t = 0; t < nTensors; t++) {
+        Real normW = 0, normR = 0;
+        for (int i = 0; i < nThreads; i++) {
+          normW += partialNorms[2*(i*nTensors + t) +0];
+          normR += partialNorms[2*(i*nTensors + t) +1];
+        }
+        ratios[t] = algo.ratio(normW, normR);
       }
+      forEachTensor([&] (const size_t t, const size_t b, const size_t e) {
+        algo.apply(e-b, P+b, M1+b, M2+b, ratios[t]);
+      });
+    }
+  }
 
-      if (parms[j]->nBiases > 0)
+  virtual void update(const int batchSize)
+  {
+    // network must not change after the optimizer is created:
+    assert(nParams == NET.flatSize);
+    const double t0 = NET.profiler.start();
+
+    // grads are averaged over the minibatch and, if their norm is larger
+    // than clipNorm, scaled down to norm clipNorm:
+    Real fac = (Real) 1 / batchSize;
+    if (clipNorm > 0) {
+      double sumsq = 0;
+      const Real* const G = NET.flatGrads;
+      #pragma omp parallel reduction(+ : sumsq)
       {
-        algo.step(parms[j]->nBiases,
-                  parms[j]->biases, grads[j]->biases,
-                  momentum_1st[j]->biases, momentum_2nd[j]->biases);
+        size_t b, e;
+        threadRange(b, e);
+        #pragma omp simd reduction(+ : sumsq)
+        for (size_t i = b; i < e; i++) sumsq += G[i] * G[i];
       }
+      gradNorm = fac * std::sqrt(sumsq);
+      if (gradNorm > clipNorm) fac *= clipNorm / gradNorm;
     }
 
+    // Given some learning algorithm..
+    const Algorithm algo(learningRate(), fac, lambda, beta_1, beta_2,
+                         beta_1t, beta_2t);
+
+    // ... compute the update with one sweep over all the parameters:
+    sweep(algo, std::integral_constant<bool, Algorithm::layerwise>());
+    NET.paramsChanged();
+    const int clip = clipNorm > 0;
+    NET.profiler.stopUpdate(nParams, Algorithm::flopsPerParam + 2 * clip,
+      (Algorithm::accessesPerParam + clip) * sizeof(Real), t0);
+
     step++;
-    beta_1t *= beta_1t; if(beta_1t<NNEPS) beta_1t = 0; // prevent underflow
-    beta_2t *= beta_2t; if(beta_2t<NNEPS) beta_2t = 0; // prevent underflow
+    beta_1t *= beta_1; if(beta_1t<NNEPS) beta_1t = 0; // prevent underflow
+    beta_2t *= beta_2; if(beta_2t<NNEPS) beta_2t = 0; // prevent underflow
   }
+
+  // Learning rate of the next update:
+  Real learningRate() const { return eta * schedule.factor(step); }
 };
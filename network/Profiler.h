@@ -0,0 +1,135 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Layers.h"
+#include <array>
+
+// Accumulates the wall time of forward and bckward of each layer, and of the
+// optimizer's update, together with the flops and bytes that each call moves
+// according to the layer's analytic estimates (Layer::flops, Layer::bytes).
+// Enabled by compiling with -DTDLL_PROFILE (`make profile=1`), otherwise all
+// its functions are empty and the compiler removes the calls.
+#ifdef TDLL_PROFILE
+
+template<typename Real>
+struct Profiler
+{
+  struct Entry
+  {
+    size_t calls = 0;
+    double time = 0, flops = 0, bytes = 0;
+
+    void add(const double t, const double f, const double b) {
+      calls++; time += t; flops += f; bytes += b;
+    }
+  };
+
+  // For each layer, forward (0) and bckward (1):
+  std::vector<std::array<Entry, 2>> entries;
+  Entry update;
+  // JSON report, one line per epoch. Overwritten by the first report:
+  std::string fname = "profile.json";
+  bool bFirstReport = true;
+
+  static double start() { return omp_get_wtime(); }
+
+  void stop(const Layer<Real>* const L, const bool bck, const int batchSize,
+            const double t0)
+  {
+    const double elapsed = omp_get_wtime() - t0;
+    if (entries.size() <= (size_t) L->ID) entries.resize(L->ID + 1);
+    entries[L->ID][bck].add(elapsed,
+      L->flops(batchSize, bck), L->bytes(batchSize, bck));
+  }
+
+  void stopUpdate(const size_t nParams, const int flopsPerParam,
+                  const int bytesPerParam, const double t0)
+  {
+    update.add(omp_get_wtime() - t0, (double) nParams * flopsPerParam,
+                                     (double) nParams * bytesPerParam);
+  }
+
+  void reset()
+  {
+    entries.clear();
+    update = Entry();
+  }
+
+  // Prints a table of the entries accumulated since the last report, appends
+  // them to the JSON file, and resets them:
+  void report(const std::vector<Layer<Real>*>& layers, const int epoch)
+  {
+    printf("Profile of epoch %d:\n", epoch);
+    printf("  ID  %-20s  dir  calls  time[ms]  GFLOP/s   GB/s\n", "layer");
+    double total = 0;
+    for (size_t j = 0; j < entries.size(); j++)
+      for (int d = 0; d < 2; d++) {
+        const Entry& E = entries[j][d];
+        if (E.calls == 0) continue;
+        printRow(std::to_string(j).c_str(), layers[j]->name(), d?"bck":"fwd", E);
+        total += E.time;
+      }
+    if (update.calls > 0) printRow("-", "Optimizer", "upd", update);
+    total += update.time;
+    printf("  total time %.3f ms\n", 1e3 * total);
+
+    FILE* pFile = fopen(fname.c_str(), bFirstReport ? "w" : "a");
+    if(pFile == nullptr) {
+      printf("Unable to write profile %s. Aborting.\n", fname.c_str()); abort();
+    }
+    fprintf(pFile, "{\"epoch\": %d, \"entries\": [", epoch);
+    const char* sep = "";
+    for (size_t j = 0; j < entries.size(); j++)
+      for (int d = 0; d < 2; d++) {
+        if (entries[j][d].calls == 0) continue;
+        printJSON(pFile, sep, (int) j, layers[j]->name(), d?"bck":"fwd",
+                  entries[j][d]);
+        sep = ", ";
+      }
+    if (update.calls > 0)
+      printJSON(pFile, sep, -1, "Optimizer", "upd", update);
+    fprintf(pFile, "]}\n");
+    fclose(pFile);
+
+    bFirstReport = false;
+    reset();
+  }
+
+  static void printRow(const char* const ID, const char* const name,
+                       const char* const dir, const Entry& E)
+  {
+    printf("%4s  %-20s  %s  %5lu  %8.3f  %7.2f  %6.2f\n", ID, name, dir,
+      E.calls, 1e3 * E.time, 1e-9 * E.flops / E.time, 1e-9 * E.bytes / E.time);
+  }
+
+  static void printJSON(FILE* const pFile, const char* const sep, const int ID,
+    const char* const name, const char* const dir, const Entry& E)
+  {
+    fprintf(pFile, "%s{\"id\": %d, \"layer\": \"%s\", \"dir\": \"%s\", "
+      "\"calls\": %lu, \"time\": %e, \"flops\": %e, \"bytes\": %e, "
+      "\"gflops\": %e, \"gbps\": %e}", sep, ID, name, dir, E.calls, E.time,
+      E.flops, E.bytes, 1e-9 * E.flops / E.time, 1e-9 * E.bytes / E.time);
+  }
+};
+
+#else
+
+template<typename Real>
+struct Profiler
+{
+  static double start() { return 0; }
+  void stop(const Layer<Real>* const, const bool, const int, const double) {}
+  void stopUpdate(const size_t, const int, const int, const double) {}
+  void reset() {}
+  void report(const std::vector<Layer<Real>*>&, const int) {}
+};
+
+#endif
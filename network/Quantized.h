@@ -0,0 +1,294 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Network.h"
+#include <cstdint>
+
+// Int8 post-training quantization. Weights are quantized symmetrically with
+// one scale per output channel, activations with one scale per layer found
+// by calibration (max of |output| on a sample of the dataset).
+// Products are accumulated in int32, then the accumulator is rescaled, the
+// bias added and, if followed by a LReLu, the nonlinearity applied before
+// rounding to the int8 input of the next layer.
+// Int8 values are widened to int16 when packed: weights of each output
+// channel and input patches of blocks of output pixels are contiguous and
+// padded to 32 bytes, so that the dot products vectorize with one multiply-add
+// instruction per pair of values (pmaddwd, AVX2 with `make arch=native`).
+
+// One Linear or convolution layer, with the LReLu that follows it if any:
+template<typename Real>
+struct QuantizedLayer
+{
+  // filters are padded to multiples of 16 values, and patches of 32 output
+  // pixels are packed at the time:
+  static constexpr int padK = 16, panelPixels = 32;
+  const ConvShape S;
+  // size of one filter, and padded size of its packed weights:
+  const int K = S.KnY * S.KnX * S.InC, Kpad = (K + padK-1) / padK * padK;
+  const bool bLReLu, bLast;
+  // int8 weights, widened to int16, [KnC][Kpad]:
+  int16_t* const W = _myalloc<int16_t>(S.KnC * Kpad);
+  // per channel: accumulator to output scale and bias, in output scale:
+  float* const mult = _myalloc<float>(S.KnC);
+  float* const bias = _myalloc<float>(S.KnC);
+
+  // inScale and outScale are the value of one quantization step of input and
+  // output. Output of the last layer is not quantized:
+  QuantizedLayer(const ConvShape& _S, const Params<Real>* const P,
+    const float inScale, const float outScale, const bool lrelu,
+    const bool last) : S(_S), bLReLu(lrelu), bLast(last)
+  {
+    assert(P->nWeights == K * S.KnC && P->nBiases == S.KnC);
+    memset(W, 0, S.KnC * Kpad * sizeof(int16_t));
+    const float invOut = bLast ? 1 : 1 / outScale;
+    for (int c = 0; c < S.KnC; c++)
+    {
+      Real wMax = 0;
+      for (int k = 0; k < K; k++)
+        wMax = std::max(wMax, std::fabs(P->weights[k * S.KnC + c]));
+      const float wScale = wMax > 0 ? wMax / 127 : 1;
+      for (int k = 0; k < K; k++)
+        W[c * Kpad + k] = quantize(P->weights[k * S.KnC + c] / wScale);
+      mult[c] = inScale * wScale * invOut;
+      bias[c] = P->biases[c] * invOut;
+    }
+  }
+
+  ~QuantizedLayer() { _myfree(W); _myfree(mult); _myfree(bias); }
+
+  QuantizedLayer(const QuantizedLayer&) = delete;
+  QuantizedLayer& operator=(const QuantizedLayer&) = delete;
+
+  static inline int8_t quantize(const float x) {
+    return std::min(std::max(std::round(x), (float) -127), (float) 127);
+  }
+
+  int inSize()  const { return S.InY * S.InX * S.InC; }
+  int outSize() const { return S.OpY * S.OpX * S.KnC; }
+
+  // in: int8 images [batchSize][InY][InX][InC]. Writes out, or outReal if
+  // this is the last layer, with sizes [batchSize][OpY][OpX][KnC]:
+  void forward(const int batchSize, const int8_t* const in, int8_t* const out,
+               Real* const outReal) const
+  {
+    const int nPixels = batchSize * S.OpY * S.OpX;
+    const int nPanels = (nPixels + panelPixels - 1) / panelPixels;
+
+    #pragma omp parallel
+    {
+      // input patches of a block of output pixels, same layout as filters:
+      int16_t* const panel = _myalloc<int16_t>(panelPixels * Kpad + 16);
+      memset(panel, 0, (panelPixels * Kpad + 16) * sizeof(int16_t));
+
+      #pragma omp for schedule(static)
+      for (int i = 0; i < nPanels; i++)
+      {
+        const int p0 = i * panelPixels;
+        const int nP = std::min(panelPixels, nPixels - p0);
+        // all patches are written before being read by the dot products:
+        int b = p0 / (S.OpY*S.OpX), oy = (p0 / S.OpX) % S.OpY, ox = p0 % S.OpX;
+        for (int p = 0; p < nP; p++) {
+          pack(in + (size_t) b * inSize(), oy, ox, panel + p * Kpad);
+          if (++ox == S.OpX) { ox = 0; if (++oy == S.OpY) { oy = 0; b++; } }
+        }
+        for (int p = 0; p < nP; p++) dots(panel + p * Kpad, p0 + p, out, outReal);
+      }
+
+      _myfree(panel);
+    }
+  }
+
+  // Writes the patch of image img of output pixel (oy, ox), as int16. Rows
+  // of the filter are copied in chunks of 16 values: patch and img must be
+  // readable and writable 16 values beyond their end.
+  void pack(const int8_t* const img, const int oy, const int ox,
+            int16_t* const patch) const
+  {
+    for (int ky = 0; ky < S.KnY; ky++)
+    {
+      const int iy = oy * S.Sy - S.Py + ky, ix0 = ox * S.Sx - S.Px;
+      int16_t* const __restrict__ dst = patch + ky * S.KnX * S.InC;
+      if (iy >= 0 && iy < S.InY && ix0 >= 0 && ix0 + S.KnX <= S.InX) {
+        // whole row of the filter is within the image, and contiguous:
+        const int8_t* const __restrict__ src = img + (iy*S.InX + ix0) * S.InC;
+        for (int i0 = 0; i0 < S.KnX * S.InC; i0 += 16)
+          for (int i = 0; i < 16; i++) dst[i0 + i] = src[i0 + i];
+        continue;
+      }
+      for (int kx = 0; kx < S.KnX; kx++) {
+        const int ix = ix0 + kx;
+        const bool inside = iy>=0 && iy<S.InY && ix>=0 && ix<S.InX;
+        const int8_t* const src = img + (iy * S.InX + ix) * S.InC;
+        for (int i = 0; i < S.InC; i++)
+          dst[kx * S.InC + i] = inside ? src[i] : 0; // zero padding
+      }
+    }
+  }
+
+  // Computes the KnC outputs of pixel p from its patch:
+  void dots(const int16_t* const __restrict__ patch, const int p,
+            int8_t* const out, Real* const outReal) const
+  {
+    static constexpr float leak = LReLuLayer<Real, 1>::leak;
+    for (int c = 0; c < S.KnC; c++)
+    {
+      const int16_t* const __restrict__ w = W + c * Kpad;
+      int32_t acc = 0;
+      for (int k = 0; k < Kpad; k++) acc += patch[k] * w[k];
+
+      float y = acc * mult[c] + bias[c];
+      if (bLReLu) y = y > 0 ? y : leak * y;
+      if (bLast) outReal[(size_t) p * S.KnC + c] = y;
+      else       out    [(size_t) p * S.KnC + c] = quantize(y);
+    }
+  }
+};
+
+// Inference-only int8 copy of a trained network made of Linear and
+// convolution layers (as selected by addConv2D), each optionally followed by
+// a LReLu (fused or not), and optionally ending with a SoftMax (or
+// SoftMaxCrossEntropy), which is computed in floating point.
+template<typename Real>
+struct QuantizedNetwork
+{
+  std::vector<QuantizedLayer<Real>*> layers;
+  int nInputs = 0, nOutputs = 0;
+  bool bSoftMax = false;
+  // quantization step of the network's input:
+  float inScale = 1;
+
+  // int8 activations of even and odd layers, and output of the last layer,
+  // for minibatches of up to `capacity` samples:
+  size_t capacity = 0, maxSize = 0;
+  int8_t *bufA = nullptr, *bufB = nullptr;
+
+  // Calibrates activation scales on the nCalib samples of calib, row-major
+  // matrix of size [nCalib]x[nInputs], by running forward on net:
+  QuantizedNetwork(Network<Real>& net, const Real* const calib,
+                   const int nCalib)
+  {
+    const size_t nLayers = net.layers.size();
+    // largest absolute value of the output of each layer:
+    std::vector<Real> absMax(nLayers, 0);
+    {
+      Real* const INP = net.getInputBuffer(nCalib);
+      std::copy(calib, calib + (size_t) nCalib * net.nInputs, INP);
+      const auto amax = [&](const size_t j) {
+        const Real* const O = net.workspace[j]->output;
+        const size_t n = (size_t) nCalib * net.layers[j]->size;
+        Real ret = 0;
+        #pragma omp parallel for schedule(static) reduction(max : ret)
+        for (size_t i = 0; i < n; i++) ret = std::max(ret, std::fabs(O[i]));
+        return ret;
+      };
+      // layers run one at a time: each output is read before the workspace
+      // plan lets it be overwritten
+      absMax[0] = amax(0);
+      for (size_t j = 1; j < nLayers; j++) {
+        net.layers[j]->forward(net.workspace, net.params);
+        absMax[j] = amax(j);
+      }
+    }
+    const auto scale = [&] (const size_t j) {
+      return absMax[j] > 0 ? (float) absMax[j] / 127 : (float) 1;
+    };
+
+    nInputs = net.nInputs;
+    inScale = scale(0);
+    size_t j = 1, jInp = 0;
+    while (j < nLayers)
+    {
+      ConvShape S;
+      const Layer<Real>* const L = net.layers[j];
+      if (L->convShape(S) && L->epilogue not_eq Epilogue::Tanh)
+      {
+        // LReLu either fused into the layer, or as the next layer:
+        const bool fused = L->epilogue == Epilogue::LReLu;
+        const bool lrelu = fused || (j+1 < nLayers &&
+                           strcmp(net.layers[j+1]->name(), "LReLu") == 0);
+        const size_t jOut = lrelu && not fused ? j+1 : j;
+        const bool last = jOut+1 == nLayers || (jOut+2 == nLayers &&
+                          strncmp(net.layers[jOut+1]->name(), "SoftMax", 7)==0);
+        layers.push_back(new QuantizedLayer<Real>(S, net.params[j],
+          scale(jInp), scale(jOut), lrelu, last));
+        maxSize = std::max(maxSize, (size_t) layers.back()->outSize());
+        nOutputs = net.layers[jOut]->size;
+        jInp = jOut;
+        j = jOut + 1;
+      }
+      else if (j == nLayers-1 && strncmp(L->name(), "SoftMax", 7) == 0 &&
+               layers.size() > 0)
+      {
+        bSoftMax = true;
+        j++;
+      }
+      else
+      {
+        printf("Layer %lu (%s) is not supported by the quantized network. "
+               "Aborting.\n", j, L->name());
+        abort();
+      }
+    }
+    if (layers.size() == 0) {
+      printf("Quantized network has no layers. Aborting.\n");
+      abort();
+    }
+    maxSize = std::max(maxSize, (size_t) nInputs);
+    printf("Quantized network: %lu int8 layers, input step %e%s\n",
+      layers.size(), inScale, bSoftMax ? ", float softmax output" : "");
+  }
+
+  ~QuantizedNetwork()
+  {
+    for (auto& l : layers) _dispose_object(l);
+    _myfree(bufA);
+    _myfree(bufB);
+  }
+
+  // I: row-major matrix [batchSize]x[nInputs], O: [batchSize]x[nOutputs]
+  void forward(Real* const O, const Real* const I, const int batchSize)
+  {
+    if (capacity < (size_t) batchSize) {
+      capacity = std::max((size_t) batchSize, 2 * capacity);
+      _myfree(bufA); _myfree(bufB);
+      // 16 more values: patches are read in chunks (QuantizedLayer::pack)
+      bufA = _myalloc<int8_t>(capacity * maxSize + 16);
+      bufB = _myalloc<int8_t>(capacity * maxSize + 16);
+    }
+
+    const float invIn = 1 / inScale;
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < batchSize * nInputs; i++)
+      bufA[i] = QuantizedLayer<Real>::quantize(I[i] * invIn);
+
+    int8_t *in = bufA, *out = bufB;
+    for (const auto& l : layers) {
+      l->forward(batchSize, in, out, O);
+      std::swap(in, out);
+    }
+
+    if (bSoftMax)
+    {
+      #pragma omp parallel for schedule(static)
+      for (int b = 0; b < batchSize; b++)
+      {
+        Real* const P = O + (size_t) b * nOutputs;
+        const Real maxP = * std::max_element(P, P + nOutputs);
+        Real norm = 0;
+        for (int i = 0; i < nOutputs; i++) {
+          P[i] = std::exp(P[i] - maxP);
+          norm += P[i];
+        }
+        for (int i = 0; i < nOutputs; i++) P[i] /= norm;
+      }
+    }
+  }
+};
@@ -17,40 +17,78 @@
 #include <limits>
 #include <cmath>
 #include <algorithm>
+#include <numeric>
 #include <omp.h>
 
-#if 1
-  typedef double Real;
-  #define gemv cblas_dgemv
-  #define gemm cblas_dgemm
-#else
+// Floating point type used by the drivers (main_*.cpp). Every class of the
+// library is templated on its floating point type, therefore single and double
+// precision networks can coexist in one binary. Select with `make prec=single`
+#ifdef SINGLE_PREC
   typedef float Real;
-  #define gemv cblas_sgemv
-  #define gemm cblas_sgemm
+#else
+  typedef double Real;
 #endif
 
 static constexpr int ALIGNBYTES = 32;
-static constexpr Real NNEPS = std::numeric_limits<Real>::epsilon();
 
-inline void _myfree(Real * const & ptr)
+template <typename T>
+inline void _myfree(T * const & ptr)
 {
   if(ptr == nullptr) return;
   free(ptr);
 }
 
-inline Real * _myalloc(const int size)
+template <typename T>
+inline T * _myalloc(const size_t size)
 {
-  Real * ret = nullptr;
+  T * ret = nullptr;
   if(size > 0)
   {
-    const int SSIMD = std::ceil(size*sizeof(Real)/(Real)ALIGNBYTES)*ALIGNBYTES;
-    posix_memalign((void **) &ret, 2*ALIGNBYTES, SSIMD);
+    const size_t SSIMD = (size*sizeof(T) + ALIGNBYTES-1) / ALIGNBYTES*ALIGNBYTES;
+    if(posix_memalign((void **) &ret, 2*ALIGNBYTES, SSIMD) not_eq 0) {
+      printf("Unable to allocate %lu bytes. Aborting.\n", SSIMD); abort();
+    }
   }
   // else if size = 0 no need to allocate. If code is correct will never be
   // accessed. if code is wrong and memory accessed will cause seg fault.
   return ret;
 }
 
+// Number of elements of an array whose size in bytes is a multiple of the
+// alignment of arrays returned by _myalloc. Used to place multiple arrays in
+// the same allocation, each starting at an aligned address:
+template <typename T>
+inline size_t _alignedSize(const size_t size)
+{
+  static constexpr size_t align = 2 * ALIGNBYTES / sizeof(T);
+  return (size + align - 1) / align * align;
+}
+
+// Aligned buffer of at least `size` elements owned by the calling thread and
+// kept for its next calls, so that kernels needing temporary memory at each
+// call only allocate the first time or when they need a larger buffer.
+// Buffers of different `slot` can be used at the same time.
+template <typename T>
+inline T * _scratch(const size_t slot, const size_t size)
+{
+  struct Buffers {
+    std::vector<T*> ptr;
+    std::vector<size_t> size;
+    ~Buffers() { for (T* const p : ptr) _myfree(p); }
+  };
+  static thread_local Buffers buffers;
+  if (buffers.ptr.size() <= slot) {
+    buffers.ptr.resize(slot + 1, nullptr);
+    buffers.size.resize(slot + 1, 0);
+  }
+  if (buffers.size[slot] < size) {
+    _myfree(buffers.ptr[slot]);
+    buffers.ptr[slot] = _myalloc<T>(size);
+    buffers.size[slot] = size;
+  }
+  return buffers.ptr[slot];
+}
+
 template <typename T>
 void _dispose_object(T *& ptr)
 {
@@ -0,0 +1,130 @@
+//
+//  High Performance Computing for Science and Engineering (HPCSE) 2018
+//  TDLL: Tiny Deep Learning Library - solution code for exercises 6 and 7.
+//
+//  Copyright (c) 2018 CSE-Lab, ETH Zurich, Switzerland.
+//  Distributed under the terms of the MIT license.
+//
+//  Created by Guido Novati (novatig@gmail.com).
+//
+
+#pragma once
+#include "Layers.h"
+
+// Assigns the outputs and the gradients of the outputs of all the layers to
+// offsets within one memory arena. Two buffers share memory if they are never
+// needed at the same time during a training step (forward then bckward) or,
+// if not training, during forward. Element-wise layers (LReLu, Tanh) write
+// their output over their input and the gradient wrt to their input over the
+// gradient wrt to their output, when bckward does not need the overwritten
+// values. The input of the network and the output and output gradient of the
+// last layer are never overwritten: the caller reads and writes them.
+template<typename Real>
+struct WorkspacePlan
+{
+  const size_t batchSize;
+  const bool training;
+  // For each layer, offsets within the arena of output and dError_dOutput.
+  // If not training, gradients are not allocated: errOffset is empty.
+  std::vector<size_t> outOffset, errOffset;
+  // Number of Reals needed by the arena, and by one buffer per activation:
+  size_t arenaSize = 0, naiveSize = 0;
+
+  WorkspacePlan(const std::vector<Layer<Real>*>& layers,
+                const size_t _batchSize, const bool _training) :
+    batchSize(_batchSize), training(_training)
+  {
+    const int nLayers = layers.size();
+    // Time of forward of layer j is j, time of bckward of layer j is
+    // 2*nLayers - j. Caller writes the input at time 0, and can access the
+    // network's input and output buffers until time 2*nLayers.
+    const int tEnd = 2 * nLayers;
+    const auto tBck = [&] (const int j) { return 2 * nLayers - j; };
+
+    // whether layer j writes its output over the output of layer j-1:
+    std::vector<bool> inPlace(nLayers, false);
+    for (int j = 2; j < nLayers; j++)
+      inPlace[j] = layers[j]->canRunInPlace() &&
+        ( not training || ( not layers[j]->bckwardNeedsInput() &&
+                            not layers[j-1]->bckwardNeedsOutput() ) );
+
+    std::vector<int> outBuf(nLayers), errBuf(nLayers);
+    for (int j = 0; j < nLayers; j++) {
+      naiveSize += 2 * _alignedSize<Real>(batchSize * layers[j]->size);
+      if (inPlace[j]) outBuf[j] = outBuf[j-1];
+      else outBuf[j] = newBuffer(batchSize * layers[j]->size, j);
+    }
+    if (training)
+      for (int j = nLayers-1; j >= 0; j--) {
+        if (j+1 < nLayers && inPlace[j+1]) errBuf[j] = errBuf[j+1];
+        else errBuf[j] = newBuffer(batchSize * layers[j]->size, tBck(j+1));
+      }
+
+    // Extend the lifetimes of buffers to all the times they are accessed:
+    use(outBuf[0], 0, tEnd);
+    use(outBuf[nLayers-1], 0, tEnd);
+    for (int j = 1; j < nLayers; j++) use(outBuf[j-1], j, j);
+    if (training)
+    {
+      use(errBuf[nLayers-1], 0, tEnd);
+      for (int j = 1; j < nLayers; j++) {
+        const int t = tBck(j);
+        use(errBuf[j], t, t);
+        use(errBuf[j-1], t, t);
+        if (layers[j]->bckwardNeedsInput())  use(outBuf[j-1], t, t);
+        if (layers[j]->bckwardNeedsOutput()) use(outBuf[j],   t, t);
+      }
+    }
+
+    assignOffsets();
+    for (int j = 0; j < nLayers; j++)
+      outOffset.push_back(buffers[outBuf[j]].offset);
+    if (training)
+      for (int j = 0; j < nLayers; j++)
+        errOffset.push_back(buffers[errBuf[j]].offset);
+  }
+
+
+  struct Buffer { size_t size, offset; int tBeg, tEnd; };
+  std::vector<Buffer> buffers;
+
+  int newBuffer(const size_t size, const int t) {
+    buffers.push_back({_alignedSize<Real>(size), 0, t, t});
+    return buffers.size() - 1;
+  }
+
+  void use(const int buf, const int tBeg, const int tEnd) {
+    buffers[buf].tBeg = std::min(buffers[buf].tBeg, tBeg);
+    buffers[buf].tEnd = std::max(buffers[buf].tEnd, tEnd);
+  }
+
+  // Greedy by size: largest buffers first, each at the lowest offset that
+  // does not overlap any placed buffer alive at the same time.
+  void assignOffsets()
+  {
+    std::vector<int> order(buffers.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&] (const int a, const int b)
+      { return buffers[a].size > buffers[b].size; });
+
+    std::vector<int> placed;
+    for (const int i : order)
+    {
+      Buffer& B = buffers[i];
+      std::vector<int> alive;
+      for (const int k : placed)
+        if (buffers[k].tBeg <= B.tEnd && B.tBeg <= buffers[k].tEnd)
+          alive.push_back(k);
+      std::sort(alive.begin(), alive.end(), [&] (const int a, const int b)
+        { return buffers[a].offset < buffers[b].offset; });
+
+      B.offset = 0;
+      for (const int k : alive) {
+        if (B.offset + B.size <= buffers[k].offset) break;
+        B.offset = std::max(B.offset, buffers[k].offset + buffers[k].size);
+      }
+      arenaSize = std::max(arenaSize, B.offset + B.size);
+      placed.push_back(i);
+    }
+  }
+};